@@ -0,0 +1,498 @@
+// Puts load on a Wayland server's socket, with nothing but the socket. Each
+// connection sends a mix of requests at a target rate and times how long the
+// server takes to answer them.
+//
+//   ob-bench [-s socket] [-c connections] [-t threads] [-r rate]
+//            [-q depth] [-d seconds] [-b burst] [-m mix]
+//
+// The socket defaults to $XDG_RUNTIME_DIR/$WAYLAND_DISPLAY (or wayland-0).
+// The rate is per connection, in operations per second. Without one, each
+// connection keeps the given number of operations in flight instead. The mix
+// weights the kinds of operation, e.g. "sync:8,registry:1,burst:1":
+//
+//   sync      a wl_display.sync roundtrip
+//   registry  wl_display.get_registry, then a sync once the globals are in
+//   burst     a number of syncs pipelined in one write, timed to the last
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+
+namespace waypositor { namespace bench {
+  namespace asio = boost::asio;
+  using Domain = asio::local::stream_protocol;
+  using Clock = std::chrono::steady_clock;
+
+  enum Kind : std::size_t { SYNC, REGISTRY, BURST, KINDS };
+  constexpr std::array<char const *, KINDS> kind_names{
+    "sync", "registry", "burst"
+  };
+
+  struct Options {
+    std::string socket{};
+    std::size_t connections{1};
+    std::size_t threads{1};
+    // Operations per second per connection. Zero means closed loop.
+    double rate{0};
+    // Operations in flight per connection, when there's no rate
+    std::size_t depth{1};
+    Clock::duration duration{std::chrono::seconds{5}};
+    std::size_t burst{16};
+    std::array<unsigned int, KINDS> mix{{1, 0, 0}};
+  };
+
+  // Latencies in nanoseconds, by kind of operation
+  struct Results {
+    std::array<std::vector<uint64_t>, KINDS> latencies{};
+    std::size_t errors{0};
+
+    void merge(Results &other) {
+      for (std::size_t kind = 0; kind < KINDS; ++kind) {
+        auto &mine = latencies[kind];
+        auto &theirs = other.latencies[kind];
+        mine.insert(mine.end(), theirs.begin(), theirs.end());
+        theirs.clear();
+      }
+      errors += other.errors;
+    }
+  };
+
+  class Connection final {
+  private:
+    enum class State { CONNECTING, RUNNING, DRAINING, FINISHED };
+    struct Outgoing {
+      std::vector<uint32_t> queued{};
+      std::vector<uint32_t> writing{};
+    };
+    // An operation is finished by the callback with this id
+    struct Pending {
+      Kind kind;
+      // When it was meant to be sent. Measuring from there rather than from
+      // when it was sent keeps a slow server from hiding its own backlog.
+      Clock::time_point start;
+    };
+
+    std::size_t mIndex;
+    Options const &mOptions;
+    Domain::socket mSocket;
+    asio::steady_timer mTimer;
+    std::mt19937 mRandom;
+    std::discrete_distribution<std::size_t> mKinds;
+    State mState;
+    Clock::time_point mDeadline;
+    Clock::time_point mNext;
+    uint32_t mNextId;
+    std::unordered_map<uint32_t, Pending> mPending;
+    Outgoing mOutgoing;
+    std::vector<unsigned char> mInput;
+    std::size_t mFilled;
+    Results mResults;
+
+    static constexpr std::size_t INPUT_SIZE = 64 * 1024;
+    static constexpr uint32_t DISPLAY = 1;
+
+    class Worker final {
+    public:
+      enum class Task { CONNECTED, READ, WROTE, TIMER };
+    private:
+      Connection *self;
+      Task mTask;
+    public:
+      Worker(Connection &self_, Task task) : self{&self_}, mTask{task} {}
+      Worker(Worker const &);
+      Worker &operator=(Worker const &);
+      Worker(Worker &&other) noexcept : self{other.self}, mTask{other.mTask} {
+        other.self = nullptr;
+      }
+      Worker &operator=(Worker &&other) {
+        if (this == &other) return *this;
+        self = other.self;
+        mTask = other.mTask;
+        other.self = nullptr;
+        return *this;
+      }
+      ~Worker() = default;
+
+      void operator()(
+        boost::system::error_code const &error = {}, std::size_t size = 0
+      ) {
+        if (error == asio::error::operation_aborted) return;
+        if (error) {
+          if (self->mState != State::FINISHED) {
+            std::cerr << "Connection " << self->mIndex << ": "
+                      << error.message() << std::endl;
+            self->mResults.errors++;
+            self->finish();
+          }
+          return;
+        }
+        switch (mTask) {
+        case Task::CONNECTED:
+          self->start();
+          return;
+        case Task::READ:
+          self->received(size);
+          return;
+        case Task::WROTE:
+          self->mOutgoing.writing.clear();
+          self->flush();
+          return;
+        case Task::TIMER:
+          self->tick();
+          return;
+        }
+      }
+    };
+
+    uint32_t new_id() { return mNextId++; }
+
+    void request(uint32_t object, uint16_t opcode, uint32_t argument) {
+      auto &queued = mOutgoing.queued;
+      uint32_t size = 3 * sizeof(uint32_t);
+      queued.push_back(object);
+      queued.push_back((size << 16) | opcode);
+      queued.push_back(argument);
+    }
+
+    void flush() {
+      if (mOutgoing.queued.empty() || !mOutgoing.writing.empty()) return;
+      std::swap(mOutgoing.queued, mOutgoing.writing);
+      asio::async_write(
+        mSocket, asio::buffer(mOutgoing.writing)
+      , Worker{*this, Worker::Task::WROTE}
+      );
+    }
+
+    void read() {
+      mSocket.async_read_some(
+        asio::buffer(mInput.data() + mFilled, mInput.size() - mFilled)
+      , Worker{*this, Worker::Task::READ}
+      );
+    }
+
+    // Queue an operation that was meant to start at the given time
+    void issue(Clock::time_point start) {
+      auto kind = static_cast<Kind>(mKinds(mRandom));
+      uint32_t callback = 0;
+      switch (kind) {
+      case SYNC:
+        callback = this->new_id();
+        this->request(DISPLAY, 0, callback);
+        break;
+      case REGISTRY:
+        this->request(DISPLAY, 1, this->new_id());
+        callback = this->new_id();
+        this->request(DISPLAY, 0, callback);
+        break;
+      case BURST:
+        for (std::size_t i = 0; i < mOptions.burst; ++i) {
+          callback = this->new_id();
+          this->request(DISPLAY, 0, callback);
+        }
+        break;
+      case KINDS:
+        return;
+      }
+      // Syncs are answered in order, so the last one finishes the operation
+      mPending.emplace(callback, Pending{kind, start});
+    }
+
+    void start() {
+      mState = State::RUNNING;
+      auto now = Clock::now();
+      mDeadline = now + mOptions.duration;
+      mNext = now;
+      this->read();
+      if (mOptions.rate > 0) {
+        this->tick();
+      } else {
+        for (std::size_t i = 0; i < mOptions.depth; ++i) this->issue(now);
+        this->flush();
+      }
+    }
+
+    // Issue whatever is due. Operations that fell behind schedule go out
+    // straight away, all together.
+    void tick() {
+      if (mState != State::RUNNING) return;
+      auto now = Clock::now();
+      auto interval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>{1.0 / mOptions.rate}
+      );
+      while (mNext <= now && mNext < mDeadline) {
+        this->issue(mNext);
+        mNext += interval;
+      }
+      this->flush();
+      if (mNext >= mDeadline) {
+        this->drain();
+        return;
+      }
+      mTimer.expires_at(mNext);
+      mTimer.async_wait(Worker{*this, Worker::Task::TIMER});
+    }
+
+    void drain() {
+      mState = State::DRAINING;
+      if (mPending.empty()) this->finish();
+    }
+
+    void finish() {
+      mState = State::FINISHED;
+      boost::system::error_code error;
+      mTimer.cancel(error);
+      mSocket.close(error);
+    }
+
+    void completed(Pending const &pending) {
+      auto now = Clock::now();
+      auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        now - pending.start
+      );
+      mResults.latencies[pending.kind].push_back(
+        static_cast<uint64_t>(elapsed.count())
+      );
+      if (mState == State::RUNNING && mOptions.rate <= 0) {
+        if (now < mDeadline) {
+          this->issue(now);
+          this->flush();
+        } else {
+          this->drain();
+        }
+      }
+      if (mState == State::DRAINING && mPending.empty()) this->finish();
+    }
+
+    void received(std::size_t size) {
+      mFilled += size;
+      std::size_t offset = 0;
+      static constexpr std::size_t header_size = 2 * sizeof(uint32_t);
+      while (mFilled - offset >= header_size) {
+        uint32_t header[2];
+        std::memcpy(header, mInput.data() + offset, header_size);
+        std::size_t message_size = header[1] >> 16;
+        if (message_size < header_size) {
+          std::cerr << "Connection " << mIndex << ": bad message" << std::endl;
+          mResults.errors++;
+          this->finish();
+          return;
+        }
+        if (mFilled - offset < message_size) break;
+        uint32_t object = header[0];
+        uint16_t opcode = header[1] & 0xffff;
+        offset += message_size;
+
+        if (object == DISPLAY && opcode == 0) {
+          std::cerr << "Connection " << mIndex << ": protocol error"
+                    << std::endl;
+          mResults.errors++;
+          this->finish();
+          return;
+        }
+        // wl_callback.done. Anything else (globals, delete_id) is ignored.
+        if (opcode != 0) continue;
+        auto it = mPending.find(object);
+        if (it == mPending.end()) continue;
+        Pending pending = it->second;
+        mPending.erase(it);
+        this->completed(pending);
+        if (mState == State::FINISHED) return;
+      }
+      // Keep whatever is left of a partial message
+      std::memmove(mInput.data(), mInput.data() + offset, mFilled - offset);
+      mFilled -= offset;
+      this->read();
+    }
+
+  public:
+    Connection(
+      std::size_t index, Options const &options, asio::io_service &asio
+    ) : mIndex{index}, mOptions{options}, mSocket{asio}, mTimer{asio}
+      , mRandom{static_cast<std::mt19937::result_type>(index)}
+      , mKinds{options.mix.begin(), options.mix.end()}
+      , mState{State::CONNECTING}, mDeadline{}, mNext{}
+      , mNextId{2}, mPending{}, mOutgoing{}
+      , mInput(INPUT_SIZE), mFilled{0}, mResults{}
+    {}
+    Connection(Connection const &) = delete;
+    Connection &operator=(Connection const &) = delete;
+
+    void launch() {
+      mSocket.async_connect(
+        Domain::endpoint{mOptions.socket}
+      , Worker{*this, Worker::Task::CONNECTED}
+      );
+    }
+
+    Results &results() { return mResults; }
+  };
+
+  inline std::optional<Options> parse(int argc, char **argv) {
+    Options options{};
+    char const *runtime = std::getenv("XDG_RUNTIME_DIR");
+    char const *display = std::getenv("WAYLAND_DISPLAY");
+    if (runtime != nullptr) {
+      options.socket = runtime;
+      options.socket += "/";
+      options.socket += display != nullptr ? display : "wayland-0";
+    }
+
+    int option = 0;
+    while ((option = getopt(argc, argv, "s:c:t:r:q:d:b:m:")) != -1) {
+      switch (option) {
+      case 's':
+        options.socket = optarg;
+        break;
+      case 'c':
+        options.connections = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 't':
+        options.threads = std::max(1ul, std::strtoul(optarg, nullptr, 10));
+        break;
+      case 'r':
+        options.rate = std::strtod(optarg, nullptr);
+        break;
+      case 'q':
+        options.depth = std::max(1ul, std::strtoul(optarg, nullptr, 10));
+        break;
+      case 'd':
+        options.duration = std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>{std::strtod(optarg, nullptr)}
+        );
+        break;
+      case 'b':
+        options.burst = std::max(1ul, std::strtoul(optarg, nullptr, 10));
+        break;
+      case 'm': {
+        options.mix.fill(0);
+        std::stringstream list{optarg};
+        std::string item{};
+        while (std::getline(list, item, ',')) {
+          auto colon = item.find(':');
+          std::string name = item.substr(0, colon);
+          unsigned int weight = colon == std::string::npos
+            ? 1 : static_cast<unsigned int>(std::stoul(item.substr(colon + 1)));
+          auto it = std::find(kind_names.begin(), kind_names.end(), name);
+          if (it == kind_names.end()) {
+            std::cerr << "Unknown request kind " << name << std::endl;
+            return std::nullopt;
+          }
+          options.mix[it - kind_names.begin()] = weight;
+        }
+        break;
+      }
+      default:
+        return std::nullopt;
+      }
+    }
+    if (options.socket.empty()) {
+      std::cerr << "No socket given and XDG_RUNTIME_DIR isn't set"
+                << std::endl;
+      return std::nullopt;
+    }
+    if (std::all_of(
+      options.mix.begin(), options.mix.end()
+    , [](unsigned int weight) { return weight == 0; }
+    )) {
+      std::cerr << "Nothing in the mix" << std::endl;
+      return std::nullopt;
+    }
+    return options;
+  }
+
+  inline void report(Results &results, Clock::duration elapsed) {
+    using Seconds = std::chrono::duration<double>;
+    double seconds = Seconds{elapsed}.count();
+    auto percentile = [](std::vector<uint64_t> const &sorted, double p) {
+      auto index = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+      return sorted[index] / 1000.0;
+    };
+
+    std::cout << std::left << std::setw(10) << "kind"
+              << std::right << std::setw(10) << "count"
+              << std::setw(12) << "ops/s"
+              << std::setw(10) << "p50"
+              << std::setw(10) << "p90"
+              << std::setw(10) << "p99"
+              << std::setw(10) << "p99.9"
+              << std::setw(10) << "max"
+              << "  (latencies in us)" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    for (std::size_t kind = 0; kind < KINDS; ++kind) {
+      auto &latencies = results.latencies[kind];
+      if (latencies.empty()) continue;
+      std::sort(latencies.begin(), latencies.end());
+      std::cout << std::left << std::setw(10) << kind_names[kind]
+                << std::right << std::setw(10) << latencies.size()
+                << std::setw(12) << latencies.size() / seconds
+                << std::setw(10) << percentile(latencies, 0.5)
+                << std::setw(10) << percentile(latencies, 0.9)
+                << std::setw(10) << percentile(latencies, 0.99)
+                << std::setw(10) << percentile(latencies, 0.999)
+                << std::setw(10) << latencies.back() / 1000.0
+                << std::endl;
+    }
+    if (results.errors > 0) {
+      std::cout << results.errors << " connections failed" << std::endl;
+    }
+  }
+}}
+
+int main(int argc, char **argv) {
+  using namespace waypositor::bench;
+  auto options = parse(argc, argv);
+  if (!options) {
+    std::cerr << "Usage: " << argv[0] << " [-s socket] [-c connections]"
+              << " [-t threads] [-r rate] [-q depth] [-d seconds]"
+              << " [-b burst] [-m sync:N,registry:N,burst:N]" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // Each thread runs its own share of the connections
+  std::vector<std::unique_ptr<asio::io_service>> services{};
+  for (std::size_t i = 0; i < options->threads; ++i) {
+    services.push_back(std::make_unique<asio::io_service>());
+  }
+  std::vector<std::unique_ptr<Connection>> connections{};
+  for (std::size_t i = 0; i < options->connections; ++i) {
+    connections.push_back(std::make_unique<Connection>(
+      i, *options, *services[i % services.size()]
+    ));
+    connections.back()->launch();
+  }
+
+  auto start = Clock::now();
+  std::vector<std::thread> threads{};
+  for (auto &service : services) {
+    threads.emplace_back([&service] { service->run(); });
+  }
+  for (std::thread &thread : threads) thread.join();
+  auto elapsed = Clock::now() - start;
+
+  Results results{};
+  for (auto &connection : connections) results.merge(connection->results());
+  report(results, elapsed);
+  return results.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -4,11 +4,24 @@
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <signal.h>
 #include <fcntl.h>
 
+#include <linux/dma-buf.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include <gbm.h>
 #include <xf86drm.h>
 
@@ -16,6 +29,7 @@
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
 
 struct buffer;
+struct window;
 
 struct display {
     struct wl_display *display;
@@ -23,48 +37,184 @@ struct display {
     struct wl_compositor *compositor;
     struct wl_shell *shell;
     struct zwp_linux_dmabuf_v1 *dmabuf;
+    struct wl_shm *shm;
     int req_dmabuf_immediate;
     struct gbm_device *dev;
     int node_fd;
 };
 
+struct rect {
+    int x, y, width, height;
+};
+
 struct buffer {
+    struct window *window;
+    // Null until the compositor has made it, in non-immediate mode
     struct wl_buffer *buffer;
     int busy;
+    // When it was last released, or made
+    uint64_t idle_since_ns;
+    // When it was last attached, for timing its release
+    uint64_t committed_ns;
+    // Null with wl_shm
     struct gbm_bo *bo;
     int dmabuf_fd;
+    // In MAP_MODE_PERSISTENT, and with wl_shm, for as long as the buffer
+    // lives
+    uint8_t *map;
+    size_t map_length;
+    // Only with wl_shm
+    int stride;
+    // Whether the background's been drawn, and where the rectangle is, for
+    // the partial damage modes
+    int painted;
+    int has_rect;
+    struct rect rect;
 };
 
-#define NUM_BUFFERS 3
+// Buffers are made as they're needed, up to a cap, and the ones not needed
+// for a while are let go of again, down to the minimum
+#define MIN_BUFFERS 2
+#define MAX_BUFFERS 32
+
+static int max_buffers = 8;
+static uint64_t buffer_idle_ns = 1000000000ull;
+
+// Counts, and how long things took, in nanoseconds
+struct timing {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+struct window_stats {
+    uint64_t frames;
+    // Filling buffers, mapping and unmapping included
+    struct timing fill;
+    // From asking for a frame callback to it coming
+    struct timing callback;
+    // From a buffer being committed to it being released
+    struct timing release;
+};
 
 struct window {
     struct display *display;
+    // Which thread it's on, and which of its windows it is
+    int thread, index;
     int width, height;
+    // Frames a second to draw at, or 0 for every frame callback
+    int rate;
+    uint64_t next_draw_ns;
+    // Frames drawn so far, for animating
+    uint32_t frames;
+    // When the frame callback was asked for
+    uint64_t frame_requested_ns;
+    uint64_t started_ns;
+    uint64_t reported_ns;
+    struct window_stats second;
+    struct window_stats total;
+    // The rectangle in the last frame drawn, for the partial damage modes
+    int has_rect;
+    struct rect rect;
     struct wl_surface *surface;
     struct wl_shell_surface *shell_surface;
-    struct buffer buffers[NUM_BUFFERS];
+    struct buffer *buffers[MAX_BUFFERS];
+    int buffer_count;
+    int buffer_high_water;
     struct buffer *prev_buffer;
     struct wl_callback *callback;
+    // Every buffer was busy at the last redraw, so the next release (or
+    // creation) redraws
+    int waiting;
 };
 
 enum {
   MAP_MODE_GBM = 0, // gbm_bo_map
   MAP_MODE_MMAP, // system mmap
+  MAP_MODE_PERSISTENT, // system mmap once, with DMA_BUF_IOCTL_SYNC per fill
   MAP_MODE_MAX
 };
 
+static const char *map_mode_names[MAP_MODE_MAX] = {"gbm", "mmap", "persistent"};
+
 static int current_map_mode = MAP_MODE_GBM;
 
-static int running = 1;
+enum {
+  BACKEND_DMABUF = 0, // gbm buffers, through zwp_linux_dmabuf_v1
+  BACKEND_SHM, // memfd pools, through wl_shm; needs no GPU
+  BACKEND_MAX
+};
+
+static int current_backend = BACKEND_DMABUF;
+
+enum {
+  DAMAGE_FULL = 0, // everything is drawn and damaged each frame
+  DAMAGE_RECT, // a small rectangle moves about on a still background
+  DAMAGE_BAND, // a full width band moves up and down
+  DAMAGE_MAX
+};
+
+static int current_damage = DAMAGE_FULL;
+// Of the rectangle; bands only take the height
+static int damage_width = 64, damage_height = 64;
+
+enum {
+  PATTERN_STATIC = 0, // the same gradient every frame
+  PATTERN_SCROLL, // the gradient moves a pixel each frame
+  PATTERN_MAX
+};
+
+static int current_pattern = PATTERN_STATIC;
+
+// With only the one window, its stats are reported every second as well as
+// at exit
+static int report_every_second = 1;
+
+// Cleared from the signal handler, and read by every thread
+static std::atomic<int> running{1};
+
+// The gbm device is shared by every thread, and gbm isn't thread safe
+static std::mutex gbm_mutex;
 
 static void
 redraw(void *data, struct wl_callback *callback, uint32_t time);
 
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// A buffer's come free, so a window that ran out can carry on
+static void
+window_buffer_ready(struct window *window)
+{
+  if (!window->waiting)
+    return;
+  window->waiting = 0;
+  redraw(window, NULL, 0);
+}
+
+static void
+timing_add(struct timing *timing, uint64_t ns)
+{
+  timing->count++;
+  timing->total_ns += ns;
+  if (ns > timing->max_ns)
+    timing->max_ns = ns;
+}
+
 static void
 buffer_release(void *data, struct wl_buffer */* buffer */)
 {
   struct buffer *buf = static_cast<struct buffer *>(data);
   buf->busy = 0;
+  buf->idle_since_ns = now_ns();
+  timing_add(&buf->window->second.release, buf->idle_since_ns - buf->committed_ns);
+  timing_add(&buf->window->total.release, buf->idle_since_ns - buf->committed_ns);
+  window_buffer_ready(buf->window);
 }
 
 static const struct wl_buffer_listener buffer_listener = {
@@ -72,17 +222,227 @@ static const struct wl_buffer_listener buffer_listener = {
 };
 
 static void
-fill_content(uint8_t *raw_data, int width, int height, int stride)
+window_stats_print(const struct window *window, const char *what,
+    const struct window_stats *stats, uint64_t elapsed_ns)
 {
-    int x = 0, y = 0;
-    uint32_t *pix;
+  auto mean = [](const struct timing *timing) {
+    return timing->count ? timing->total_ns / 1000.0 / timing->count : 0.0;
+  };
+  fprintf(stderr,
+      "window %d.%d %dx%d %s: %.1f fps; fill (%s) mean %.1f us, max %.1f us; "
+      "frame callback mean %.1f us, max %.1f us; "
+      "release mean %.1f us, max %.1f us\n",
+      window->thread, window->index, window->width, window->height, what,
+      elapsed_ns ? stats->frames * 1e9 / elapsed_ns : 0.0,
+      current_backend == BACKEND_SHM ? "shm" : map_mode_names[current_map_mode],
+      mean(&stats->fill), stats->fill.max_ns / 1000.0,
+      mean(&stats->callback), stats->callback.max_ns / 1000.0,
+      mean(&stats->release), stats->release.max_ns / 1000.0);
+}
+
+// 8 pixels to a vector. The compiler splits it for targets with narrower
+// registers; stores needn't be aligned.
+typedef uint32_t pixels8 __attribute__((vector_size(32)));
+typedef uint32_t pixels8_unaligned
+    __attribute__((vector_size(32), aligned(4), may_alias));
+
+// One row of the gradient, with x offset by shift, 16 pixels at a time.
+// y_bits is the row's own part of every pixel.
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void
+fill_row(uint32_t *pix, int width, uint32_t y_bits, uint32_t shift)
+{
+  const uint32_t base = (0xffu << 24) | y_bits | 0xf0;
+  pixels8 x = {0, 1, 2, 3, 4, 5, 6, 7};
+  x += shift;
+  int i = 0;
+  for (; i + 16 <= width; i += 16) {
+    *(pixels8_unaligned *)(pix + i) = ((x & 0xff) << 16) | base;
+    *(pixels8_unaligned *)(pix + i + 8) = (((x + 8) & 0xff) << 16) | base;
+    x += 16;
+  }
+  for (; i < width; i++)
+    pix[i] = (((i + shift) & 0xff) << 16) | base;
+}
+
+struct fill_job {
+  uint8_t *raw_data;
+  int width, height, stride;
+  uint32_t shift;
+};
+
+static void
+fill_rows(const struct fill_job *job, int first, int last)
+{
+  for (int y = first; y < last; y++)
+    fill_row((uint32_t *)(job->raw_data + (size_t)y * job->stride),
+        job->width, ((y + job->shift) & 0xff) << 8, job->shift);
+}
+
+// Splits each fill into bands of rows, one per thread, the calling thread
+// included
+struct fill_pool {
+  std::vector<std::thread> threads;
+  // Windows on different threads take turns with the pool
+  std::mutex turn;
+  std::mutex mutex;
+  std::condition_variable work;
+  std::condition_variable done;
+  int bands;
+  struct fill_job job;
+  uint64_t generation;
+  int pending;
+  bool stopping;
+};
 
-    for (y = 0; y < height; y++) {
-        pix = (uint32_t *)(raw_data + y * stride);
-        for (x = 0; x < width; x++)
-            *pix++ = (0xff << 24) | ((x % 256) << 16) |
-                 ((y % 256) << 8) | 0xf0;
+static struct fill_pool *pool;
+
+static void
+fill_band(const struct fill_job *job, int band, int bands)
+{
+  fill_rows(job, job->height * band / bands, job->height * (band + 1) / bands);
+}
+
+static void
+fill_worker(int band)
+{
+  uint64_t seen = 0;
+  for (;;) {
+    struct fill_job job;
+    {
+      std::unique_lock<std::mutex> lock(pool->mutex);
+      pool->work.wait(lock, [&] {
+        return pool->stopping || pool->generation != seen;
+      });
+      if (pool->stopping)
+        return;
+      seen = pool->generation;
+      job = pool->job;
     }
+    fill_band(&job, band, pool->bands);
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    if (--pool->pending == 0)
+      pool->done.notify_one();
+  }
+}
+
+static void
+fill_pool_start(int threads)
+{
+  pool = new fill_pool{};
+  pool->bands = threads;
+  // The calling thread takes band 0
+  for (int i = 1; i < threads; i++)
+    pool->threads.emplace_back(fill_worker, i);
+}
+
+static void
+fill_pool_stop(void)
+{
+  if (!pool)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->stopping = true;
+  }
+  pool->work.notify_all();
+  for (auto &thread : pool->threads)
+    thread.join();
+  delete pool;
+  pool = nullptr;
+}
+
+static void
+fill_content(uint8_t *raw_data, int width, int height, int stride,
+    uint32_t frame)
+{
+  struct fill_job job = {raw_data, width, height, stride, 0};
+  if (current_pattern == PATTERN_SCROLL)
+    job.shift = frame;
+
+  if (!pool) {
+    fill_rows(&job, 0, height);
+    return;
+  }
+  std::lock_guard<std::mutex> turn(pool->turn);
+  int bands = pool->bands;
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->job = job;
+    pool->pending = bands - 1;
+    pool->generation++;
+  }
+  pool->work.notify_all();
+  fill_band(&job, 0, bands);
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  pool->done.wait(lock, [] { return pool->pending == 0; });
+}
+
+// Just the part of the (unscrolled) gradient under the rectangle
+static void
+fill_background(uint8_t *raw_data, int stride, const struct rect *rect)
+{
+  for (int y = rect->y; y < rect->y + rect->height; y++)
+    fill_row((uint32_t *)(raw_data + (size_t)y * stride) + rect->x,
+        rect->width, (y & 0xff) << 8, rect->x);
+}
+
+static void
+fill_solid(uint8_t *raw_data, int stride, const struct rect *rect,
+    uint32_t pixel)
+{
+  for (int y = rect->y; y < rect->y + rect->height; y++) {
+    uint32_t *pix = (uint32_t *)(raw_data + (size_t)y * stride) + rect->x;
+    std::fill(pix, pix + rect->width, pixel);
+  }
+}
+
+// Back and forth between 0 and range
+static int
+bounce(uint32_t step, int range)
+{
+  if (range <= 0)
+    return 0;
+  int at = step % (2 * (uint32_t)range);
+  return at <= range ? at : 2 * range - at;
+}
+
+// Where the rectangle is in the window's next frame
+static void
+window_move_rect(struct window *window)
+{
+  struct rect *rect = &window->rect;
+  rect->width = std::min(damage_width, window->width);
+  rect->height = std::min(damage_height, window->height);
+  if (current_damage == DAMAGE_BAND)
+    rect->width = window->width;
+  rect->x = bounce(window->frames * 4, window->width - rect->width);
+  rect->y = bounce(window->frames * 3, window->height - rect->height);
+}
+
+// Draws the next frame into a mapped buffer. In the partial damage modes,
+// only where the rectangle is now, and where it was when the buffer was last
+// drawn into, are touched, once the buffer has a background.
+static void
+paint_buffer(struct buffer *buffer, uint8_t *raw_data, int stride)
+{
+  struct window *window = buffer->window;
+  if (current_damage == DAMAGE_FULL) {
+    fill_content(raw_data, window->width, window->height, stride,
+        window->frames);
+    return;
+  }
+  if (!buffer->painted) {
+    fill_content(raw_data, window->width, window->height, stride, 0);
+    buffer->painted = 1;
+  } else if (buffer->has_rect) {
+    fill_background(raw_data, stride, &buffer->rect);
+  }
+  fill_solid(raw_data, stride, &window->rect, 0xffffffff);
+  buffer->rect = window->rect;
+  buffer->has_rect = 1;
 }
 
 // Only called in non-immediate mode.
@@ -99,6 +459,7 @@ create_succeeded(void *data,
   zwp_linux_buffer_params_v1_destroy(params);
 
   fprintf(stderr, "Succeed to create wl buffer from dmabuf\n");
+  window_buffer_ready(buffer->window);
 }
 
 // Only called in non-immediate mode.
@@ -120,33 +481,56 @@ static const struct zwp_linux_buffer_params_v1_listener params_listener = {
   create_failed
 };
 
+// Tells the kernel the CPU is starting or done with a mapping, so caches
+// are dealt with for whoever else uses the buffer
+static bool
+dmabuf_sync(int fd, uint64_t flags)
+{
+  struct dma_buf_sync sync = { flags };
+  int ret;
+  do {
+    ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+  } while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+  if (ret == -1) {
+    fprintf(stderr, "DMA_BUF_IOCTL_SYNC failed: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
 bool draw_content(struct buffer *buffer)
 {
+  // Plain memory, written straight into
+  if (current_backend == BACKEND_SHM) {
+    paint_buffer(buffer, buffer->map, buffer->stride);
+    return true;
+  }
+
+
   // Solution1: using gbm_bo_map. But currently not implement in mesa for intel driver. Only for gallium drivers.
   if (current_map_mode == MAP_MODE_GBM) {
     uint32_t stride = 0;
     void* map_info = nullptr;
+    std::unique_lock<std::mutex> gbm_lock(gbm_mutex);
     uint8_t *raw_data = static_cast<uint8_t *>(gbm_bo_map(buffer->bo, 0, 0, gbm_bo_get_width(buffer->bo),
         gbm_bo_get_height(buffer->bo),
-        GBM_BO_TRANSFER_WRITE, &stride, &map_info));
+        // Partial updates draw over what's there, so it has to be read in
+        current_damage == DAMAGE_FULL ? GBM_BO_TRANSFER_WRITE : GBM_BO_TRANSFER_READ_WRITE,
+        &stride, &map_info));
+    gbm_lock.unlock();
     if (!map_info) {
       fprintf(stderr, "map_bo failed %p\n", (void *)raw_data);
       return false;
     }
     assert(raw_data);
-    fill_content(raw_data, gbm_bo_get_width(buffer->bo), gbm_bo_get_height(buffer->bo), stride);
+    paint_buffer(buffer, raw_data, stride);
+    gbm_lock.lock();
     gbm_bo_unmap(buffer->bo, map_info);
   }
 
-  buffer->dmabuf_fd = gbm_bo_get_fd(buffer->bo);
-  if (buffer->dmabuf_fd < 0) {
-      fprintf(stderr, "error: dmabuf_fd < 0\n");
-      return false;
-  }
-
   // Solution2: generic system call 'mmap'. But bm_bo_get_fd always returns a read-only fd. So we can mmap for RO access but not for RW access.
   if (current_map_mode == MAP_MODE_MMAP) {
-    size_t length = gbm_bo_get_width (buffer->bo) * gbm_bo_get_height(buffer->bo) * 4;
+    size_t length = gbm_bo_get_stride(buffer->bo) * gbm_bo_get_height(buffer->bo);
     void* map_data = mmap(0 /* addr */, length, PROT_WRITE, MAP_SHARED, buffer->dmabuf_fd, 0 /* offset */);
 
     if (map_data == MAP_FAILED) {
@@ -154,10 +538,46 @@ bool draw_content(struct buffer *buffer)
       return false;
     }
     assert(map_data);
-    fill_content(static_cast<uint8_t *>(map_data), gbm_bo_get_width(buffer->bo), gbm_bo_get_height(buffer->bo), gbm_bo_get_stride (buffer->bo));
+    paint_buffer(buffer, static_cast<uint8_t *>(map_data), gbm_bo_get_stride (buffer->bo));
     munmap(map_data, length);
   }
 
+  // Solution3: mapped once when the buffer was made, so only the writes
+  // themselves are paid for
+  if (current_map_mode == MAP_MODE_PERSISTENT) {
+    if (!dmabuf_sync(buffer->dmabuf_fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE))
+      return false;
+    paint_buffer(buffer, buffer->map, gbm_bo_get_stride(buffer->bo));
+    if (!dmabuf_sync(buffer->dmabuf_fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE))
+      return false;
+  }
+
+  return true;
+}
+
+// Fills the buffer for the next frame, timed
+static bool
+draw_frame(struct buffer *buffer)
+{
+  struct window *window = buffer->window;
+  uint64_t start = now_ns();
+  if (!draw_content(buffer))
+    return false;
+  uint64_t end = now_ns();
+  if (!window->started_ns)
+    window->started_ns = window->reported_ns = start;
+  window->frames++;
+  window->second.frames++;
+  window->total.frames++;
+  timing_add(&window->second.fill, end - start);
+  timing_add(&window->total.fill, end - start);
+  if (end - window->reported_ns >= 1000000000ull) {
+    if (report_every_second)
+      window_stats_print(window, "last second", &window->second,
+          end - window->reported_ns);
+    memset(&window->second, 0, sizeof window->second);
+    window->reported_ns = end;
+  }
   return true;
 }
 
@@ -165,15 +585,19 @@ static int
 create_dmabuf_buffer(struct display *display, struct buffer *buffer,
              int width, int height)
 {
+  buffer->idle_since_ns = now_ns();
+
   struct zwp_linux_buffer_params_v1 *params;
   uint64_t modifier = 0;
   uint32_t format = GBM_FORMAT_ARGB8888;
   uint32_t flags = GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING;
   /* gbm_bo_map works with tiled layout, sounds like it makes it virtually
    * linear for the user. It is not the case for mmap so ensure it. */
-  if (current_map_mode == MAP_MODE_MMAP)
+  if (current_map_mode == MAP_MODE_MMAP ||
+      current_map_mode == MAP_MODE_PERSISTENT)
     flags |= GBM_BO_USE_LINEAR;
 
+  std::unique_lock<std::mutex> gbm_lock(gbm_mutex);
   buffer->bo = gbm_bo_create(
       display->dev, width, height,
       format, flags);
@@ -184,8 +608,39 @@ create_dmabuf_buffer(struct display *display, struct buffer *buffer,
 
   uint32_t stride = gbm_bo_get_stride (buffer->bo);
 
-  if (!draw_content(buffer))
-    goto error;
+  /* gbm_bo_get_fd's fd is read-only, and a persistent mapping is written
+   * through, so export one that's writable from the device instead. */
+  if (current_map_mode == MAP_MODE_PERSISTENT) {
+    int ret = drmPrimeHandleToFD(display->node_fd,
+                                 gbm_bo_get_handle(buffer->bo).u32,
+                                 DRM_CLOEXEC | DRM_RDWR, &buffer->dmabuf_fd);
+    if (ret < 0) {
+      fprintf(stderr, "drmPrimeHandleToFD with DRM_RDWR failed: %s; "
+              "persistent mapping needs a writable dmabuf fd\n",
+              strerror(errno));
+      buffer->dmabuf_fd = -1;
+    }
+  } else {
+    buffer->dmabuf_fd = gbm_bo_get_fd(buffer->bo);
+  }
+  gbm_lock.unlock();
+  if (buffer->dmabuf_fd < 0) {
+      fprintf(stderr, "error: dmabuf_fd < 0\n");
+      goto error;
+  }
+
+  if (current_map_mode == MAP_MODE_PERSISTENT) {
+    buffer->map_length = (size_t)stride * height;
+    void *map_data = mmap(0 /* addr */, buffer->map_length, PROT_WRITE, MAP_SHARED, buffer->dmabuf_fd, 0 /* offset */);
+    if (map_data == MAP_FAILED) {
+      fprintf(stderr, "mmap of the dmabuf failed: %s\n", strerror(errno));
+      close(buffer->dmabuf_fd);
+      goto error;
+    }
+    buffer->map = static_cast<uint8_t *>(map_data);
+  }
+
+  // The content is drawn for each frame, in redraw()
 
   params = zwp_linux_dmabuf_v1_create_params(display->dmabuf);
   zwp_linux_buffer_params_v1_add(params,
@@ -215,10 +670,55 @@ create_dmabuf_buffer(struct display *display, struct buffer *buffer,
   return 0;
 
 error:
+  gbm_lock.lock();
   gbm_bo_destroy(buffer->bo);
   return -1;
 }
 
+// A memfd of its own, shared as a pool with just the one buffer in it. The
+// mapping outlives the pool and the fd.
+static int
+create_shm_buffer(struct display *display, struct buffer *buffer,
+             int width, int height)
+{
+  buffer->idle_since_ns = now_ns();
+  buffer->dmabuf_fd = -1;
+  buffer->stride = width * 4;
+  buffer->map_length = (size_t)buffer->stride * height;
+
+  int fd = memfd_create("client-dmabuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    fprintf(stderr, "memfd_create failed: %s\n", strerror(errno));
+    return -1;
+  }
+  if (ftruncate(fd, buffer->map_length) < 0) {
+    fprintf(stderr, "ftruncate failed: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  // So the compositor needn't fear it shrinking under its mapping
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+
+  void *map_data = mmap(0 /* addr */, buffer->map_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 /* offset */);
+  if (map_data == MAP_FAILED) {
+    fprintf(stderr, "map shm failed\n");
+    close(fd);
+    return -1;
+  }
+  buffer->map = static_cast<uint8_t *>(map_data);
+
+  struct wl_shm_pool *shm_pool = wl_shm_create_pool(display->shm, fd, buffer->map_length);
+  buffer->buffer = wl_shm_pool_create_buffer(shm_pool, 0 /* offset */,
+                  width,
+                  height,
+                  buffer->stride,
+                  WL_SHM_FORMAT_ARGB8888);
+  wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+  wl_shm_pool_destroy(shm_pool);
+  close(fd);
+  return 0;
+}
+
 static void
 handle_ping(void */*data*/, struct wl_shell_surface *shell_surface,
         uint32_t serial)
@@ -232,12 +732,86 @@ static const struct wl_shell_surface_listener shell_surface_listener = {
   nullptr /* handle_popup_done */
 };
 
+static void
+destroy_buffer(struct buffer *buffer)
+{
+  if (buffer->buffer)
+    wl_buffer_destroy(buffer->buffer);
+  if (buffer->map)
+    munmap(buffer->map, buffer->map_length);
+  if (buffer->bo) {
+    std::lock_guard<std::mutex> gbm_lock(gbm_mutex);
+    gbm_bo_destroy(buffer->bo);
+  }
+  if (buffer->dmabuf_fd >= 0)
+    close(buffer->dmabuf_fd);
+  free(buffer);
+}
+
+static void
+window_report_buffers(struct window *window, const char *what)
+{
+  fprintf(stderr, "window %d.%d buffers: %s, %d now, high water %d\n",
+      window->thread, window->index, what,
+      window->buffer_count, window->buffer_high_water);
+}
+
+// Null if the cap's been reached, or making one failed
+static struct buffer *
+window_add_buffer(struct window *window)
+{
+  if (window->buffer_count >= max_buffers)
+    return NULL;
+  struct buffer *buffer =
+      static_cast<struct buffer *>(calloc(1, sizeof(struct buffer)));
+  if (!buffer)
+    return NULL;
+  buffer->window = window;
+  int ret;
+  if (current_backend == BACKEND_SHM)
+    ret = create_shm_buffer(window->display, buffer,
+                            window->width, window->height);
+  else
+    ret = create_dmabuf_buffer(window->display, buffer,
+                               window->width, window->height);
+  if (ret < 0) {
+    free(buffer);
+    return NULL;
+  }
+  window->buffers[window->buffer_count++] = buffer;
+  if (window->buffer_count > window->buffer_high_water)
+    window->buffer_high_water = window->buffer_count;
+  return buffer;
+}
+
+// Lets go of buffers that have been idle for a while, keeping the minimum
+static void
+window_trim_buffers(struct window *window, uint64_t now)
+{
+  int trimmed = 0;
+  for (int i = window->buffer_count - 1;
+       i >= 0 && window->buffer_count > MIN_BUFFERS; i--) {
+    struct buffer *buffer = window->buffers[i];
+    if (buffer->busy || !buffer->buffer ||
+        now - buffer->idle_since_ns < buffer_idle_ns)
+      continue;
+    destroy_buffer(buffer);
+    // Shifted down rather than swapped, so the rest keep their order
+    std::copy(window->buffers + i + 1,
+              window->buffers + window->buffer_count,
+              window->buffers + i);
+    window->buffer_count--;
+    trimmed = 1;
+  }
+  if (trimmed)
+    window_report_buffers(window, "trimmed");
+}
+
 static struct window *
-create_window(struct display *display, int width, int height)
+create_window(struct display *display, int width, int height, int rate)
 {
   struct window *window;
   int i;
-  int ret;
 
   window = static_cast<struct window *>(calloc(1, sizeof(struct window)));
   if (!window)
@@ -247,6 +821,7 @@ create_window(struct display *display, int width, int height)
   window->display = display;
   window->width = width;
   window->height = height;
+  window->rate = rate;
   window->surface = wl_compositor_create_surface(display->compositor);
 
   window->shell_surface = wl_shell_get_shell_surface(display->shell, window->surface);
@@ -254,10 +829,8 @@ create_window(struct display *display, int width, int height)
   wl_shell_surface_add_listener(window->shell_surface, &shell_surface_listener, nullptr);
   wl_shell_surface_set_toplevel(window->shell_surface);
 
-  for (i = 0; i < NUM_BUFFERS; ++i) {
-    ret = create_dmabuf_buffer(display, &window->buffers[i],
-                                   width, height);
-    if (ret < 0)
+  for (i = 0; i < MIN_BUFFERS; ++i) {
+    if (!window_add_buffer(window))
       return NULL;
   }
 
@@ -270,29 +843,38 @@ destroy_window(struct window *window)
   if (window->callback)
     wl_callback_destroy(window->callback);
 
-  for (int i = 0; i < NUM_BUFFERS; i++) {
-    if (!window->buffers[i].buffer)
-      continue;
-
-    wl_buffer_destroy(window->buffers[i].buffer);
-    window->buffers[i].buffer = nullptr;
-    gbm_bo_destroy(window->buffers[i].bo);
-    window->buffers[i].bo = nullptr;
-    close(window->buffers[i].dmabuf_fd);
-  }
+  window_stats_print(window, "in all", &window->total,
+      now_ns() - window->started_ns);
+  window_report_buffers(window, "at exit");
+  for (int i = 0; i < window->buffer_count; i++)
+    destroy_buffer(window->buffers[i]);
 
   wl_surface_destroy(window->surface);
   free(window);
 }
 
+// Null if there's nothing to draw into yet
 static struct buffer *
 window_next_buffer(struct window *window)
 {
-  for (int i = 0; i < NUM_BUFFERS; i++)
-    if (!window->buffers[i].busy)
-      return &window->buffers[i];
+  int pending = 0;
+  for (int i = 0; i < window->buffer_count; i++) {
+    struct buffer *buffer = window->buffers[i];
+    if (!buffer->buffer)
+      pending = 1;
+    else if (!buffer->busy)
+      return buffer;
+  }
+  // One that's on its way will do
+  if (pending)
+    return NULL;
 
-  return NULL;
+  struct buffer *buffer = window_add_buffer(window);
+  if (buffer)
+    window_report_buffers(window, "grew");
+  if (!buffer || !buffer->buffer)
+    return NULL;
+  return buffer;
 }
 
 static const struct wl_callback_listener frame_listener = {
@@ -304,25 +886,68 @@ redraw(void *data, struct wl_callback *callback, [[maybe_unused]] uint32_t time)
 {
   struct window *window = static_cast<struct window *>(data);
   struct buffer *buffer;
+  uint64_t now = now_ns();
+
+  if (callback) {
+    wl_callback_destroy(callback);
+    timing_add(&window->second.callback, now - window->frame_requested_ns);
+    timing_add(&window->total.callback, now - window->frame_requested_ns);
+  }
+  window->callback = NULL;
+
+  if (window->rate > 0) {
+    // Within a millisecond counts as due, or jitter would skip whole frames
+    if (callback && now + 1000000 < window->next_draw_ns) {
+      window->callback = wl_surface_frame(window->surface);
+      wl_callback_add_listener(window->callback, &frame_listener, window);
+      window->frame_requested_ns = now;
+      wl_surface_commit(window->surface);
+      return;
+    }
+    // Falling behind doesn't earn a burst of frames later
+    window->next_draw_ns = std::max(window->next_draw_ns, now) +
+        1000000000ull / window->rate;
+  }
 
   buffer = window_next_buffer(window);
   if (!buffer) {
-    fprintf(stderr,
-        !callback ? "Failed to create the first buffer.\n" :
-        "All buffers busy at redraw(). Server bug?\n");
-    abort();
+    // The compositor is holding on to all of them, and there can't be any
+    // more. Carry on once one comes back.
+    window->waiting = 1;
+    return;
   }
 
-  wl_surface_attach(window->surface, buffer->buffer, 0, 0);
-  wl_surface_damage(window->surface, 0, 0, window->width, window->height);
+  struct rect previous = window->rect;
+  int had_rect = window->has_rect;
+  if (current_damage != DAMAGE_FULL)
+    window_move_rect(window);
 
-  if (callback)
-    wl_callback_destroy(callback);
+  if (!draw_frame(buffer)) {
+    running = 0;
+    return;
+  }
+
+  wl_surface_attach(window->surface, buffer->buffer, 0, 0);
+  if (current_damage == DAMAGE_FULL) {
+    wl_surface_damage(window->surface, 0, 0, window->width, window->height);
+  } else {
+    // Where it was is background again, unless nothing's been shown yet
+    if (had_rect)
+      wl_surface_damage(window->surface, previous.x, previous.y,
+          previous.width, previous.height);
+    else
+      wl_surface_damage(window->surface, 0, 0, window->width, window->height);
+    wl_surface_damage(window->surface, window->rect.x, window->rect.y,
+        window->rect.width, window->rect.height);
+    window->has_rect = 1;
+  }
 
   window->callback = wl_surface_frame(window->surface);
   wl_callback_add_listener(window->callback, &frame_listener, window);
+  window->frame_requested_ns = buffer->committed_ns = now_ns();
   wl_surface_commit(window->surface);
   buffer->busy = 1;
+  window_trim_buffers(window, buffer->committed_ns);
 }
 
 static void
@@ -339,6 +964,10 @@ registry_handle_global(void *data, struct wl_registry *registry,
       d->shell =
           static_cast<struct wl_shell *>(wl_registry_bind(registry, id,
                    &wl_shell_interface, 1));
+  } else if (strcmp(interface, "wl_shm") == 0) {
+      d->shm =
+          static_cast<struct wl_shm *>(wl_registry_bind(registry, id,
+                   &wl_shm_interface, 1));
   } else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0) {
       int version = d->req_dmabuf_immediate ? 2 : 1;
       d->dmabuf = static_cast<struct zwp_linux_dmabuf_v1 *>(wl_registry_bind(registry,
@@ -355,7 +984,7 @@ static const struct wl_registry_listener registry_listener = {
 static struct display *
 create_display(int is_immediate)
 {
-  struct display *display = static_cast<struct display *>(malloc(sizeof *display));
+  struct display *display = static_cast<struct display *>(calloc(1, sizeof *display));
   if (display == NULL) {
       fprintf(stderr, "out of memory\n");
       exit(1);
@@ -369,6 +998,15 @@ create_display(int is_immediate)
   wl_registry_add_listener(display->registry,
                &registry_listener, display);
   wl_display_roundtrip(display->display);
+  if (current_backend == BACKEND_SHM) {
+    if (display->shm == NULL) {
+      fprintf(stderr, "No wl_shm global\n");
+      exit(1);
+    }
+    // No render node needed
+    display->node_fd = -1;
+    return display;
+  }
   if (display->dmabuf == NULL) {
       fprintf(stderr, "No zwp_linux_dmabuf global\n");
       exit(1);
@@ -401,9 +1039,12 @@ destroy_display(struct display *display)
   if (display->dev)
     gbm_device_destroy(display->dev);
 
-  if (display->node_fd)
+  if (display->node_fd >= 0)
     close(display->node_fd);
 
+  if (display->shm)
+    wl_shm_destroy(display->shm);
+
   if (display->dmabuf)
     zwp_linux_dmabuf_v1_destroy(display->dmabuf);
 
@@ -416,6 +1057,120 @@ destroy_display(struct display *display)
   free(display);
 }
 
+// Each thread has windows of its own, on an event queue of its own. The
+// display it's given is a view of the shared one, where the globals are
+// wrappers on its queue, so that whatever's made from them lands there too.
+struct client_thread {
+  int index;
+  int windows;
+  const std::vector<std::pair<int, int>> *sizes;
+  const std::vector<int> *rates;
+  struct display *shared;
+  std::thread thread;
+};
+
+// Null for a global that isn't there
+template <typename T>
+static T *
+wrap_on_queue(T *proxy, struct wl_event_queue *queue)
+{
+  if (!proxy)
+    return NULL;
+  T *wrapper = static_cast<T *>(wl_proxy_create_wrapper(proxy));
+  wl_proxy_set_queue(reinterpret_cast<struct wl_proxy *>(wrapper), queue);
+  return wrapper;
+}
+
+static void
+run_thread(struct client_thread *thread)
+{
+  struct display *shared = thread->shared;
+  struct wl_event_queue *queue = wl_display_create_queue(shared->display);
+  struct display view = *shared;
+  view.compositor = wrap_on_queue(shared->compositor, queue);
+  view.shell = wrap_on_queue(shared->shell, queue);
+  view.dmabuf = wrap_on_queue(shared->dmabuf, queue);
+  view.shm = wrap_on_queue(shared->shm, queue);
+
+  std::vector<struct window *> windows;
+  for (int i = 0; i < thread->windows && running; i++) {
+    size_t n = (size_t)thread->index * thread->windows + i;
+    const std::pair<int, int> &size = (*thread->sizes)[n % thread->sizes->size()];
+    struct window *window = create_window(&view, size.first, size.second,
+        (*thread->rates)[n % thread->rates->size()]);
+    if (!window) {
+      running = 0;
+      break;
+    }
+    window->thread = thread->index;
+    window->index = i;
+    windows.push_back(window);
+  }
+
+  /* Here we retrieve the linux-dmabuf objects if executed without immed,
+   * or error */
+  wl_display_roundtrip_queue(shared->display, queue);
+
+  if (running) {
+    for (struct window *window : windows)
+      redraw(window, NULL, 0);
+  }
+
+  int ret = 0;
+  while (running && ret != -1)
+    ret = wl_display_dispatch_queue(shared->display, queue);
+  // The others might be blocked on their queues
+  running = 0;
+
+  for (struct window *window : windows)
+    destroy_window(window);
+  if (view.shm)
+    wl_proxy_wrapper_destroy(view.shm);
+  if (view.dmabuf)
+    wl_proxy_wrapper_destroy(view.dmabuf);
+  wl_proxy_wrapper_destroy(view.shell);
+  wl_proxy_wrapper_destroy(view.compositor);
+  wl_display_flush(shared->display);
+  wl_event_queue_destroy(queue);
+}
+
+// e.g. 256x256,1920x1080
+static std::vector<std::pair<int, int>>
+check_sizes(const char *c)
+{
+  std::vector<std::pair<int, int>> sizes;
+  for (;;) {
+    int width, height, length;
+    if (sscanf(c, "%dx%d%n", &width, &height, &length) != 2 ||
+        width <= 0 || height <= 0)
+      exit(0);
+    sizes.emplace_back(width, height);
+    c += length;
+    if (*c != ',')
+      break;
+    c++;
+  }
+  return sizes;
+}
+
+// Frames a second, e.g. 60,30,0
+static std::vector<int>
+check_rates(const char *c)
+{
+  std::vector<int> rates;
+  for (;;) {
+    int rate, length;
+    if (sscanf(c, "%d%n", &rate, &length) != 1 || rate < 0)
+      exit(0);
+    rates.push_back(rate);
+    c += length;
+    if (*c != ',')
+      break;
+    c++;
+  }
+  return rates;
+}
+
 static void
 signal_int(int /* signum */)
 {
@@ -435,6 +1190,47 @@ is_import_mode_immediate(const char* c)
   return 0;
 }
 
+static int
+check_pattern(const char* c)
+{
+  if (!strcmp(c, "static"))
+      return PATTERN_STATIC;
+  else if (!strcmp(c, "scroll"))
+      return PATTERN_SCROLL;
+  else
+      exit(0);
+
+  return 0;
+}
+
+static int
+check_backend(const char* c)
+{
+  if (!strcmp(c, "dmabuf"))
+      return BACKEND_DMABUF;
+  else if (!strcmp(c, "shm"))
+      return BACKEND_SHM;
+  else
+      exit(0);
+
+  return 0;
+}
+
+static int
+check_damage(const char* c)
+{
+  if (!strcmp(c, "full"))
+      return DAMAGE_FULL;
+  else if (!strcmp(c, "rect"))
+      return DAMAGE_RECT;
+  else if (!strcmp(c, "band"))
+      return DAMAGE_BAND;
+  else
+      exit(0);
+
+  return 0;
+}
+
 static int
 check_map_mode(const char* c)
 {
@@ -442,6 +1238,8 @@ check_map_mode(const char* c)
       return MAP_MODE_GBM;
   else if (!strncmp(c, "mmap", 4))
       return MAP_MODE_MMAP;
+  else if (!strncmp(c, "persistent", 10))
+      return MAP_MODE_PERSISTENT;
   else
       exit(0);
 
@@ -453,14 +1251,28 @@ main(int argc, char **argv)
 {
   struct sigaction sigint;
   struct display *display;
-  struct window *window;
   int is_immediate = 0;
-  int ret = 0, i = 0;
+  int fill_threads = 1;
+  int client_threads = 1, windows = 1;
+  std::vector<std::pair<int, int>> sizes{{256, 256}};
+  std::vector<int> rates{0};
+  int i = 0;
   current_map_mode = MAP_MODE_GBM;
 
   if (argc > 1) {
     static const char import_mode[] = "--import-immediate=";
     static const char map_mode[] = "--map-mode=";
+    static const char pattern[] = "--pattern=";
+    static const char threads[] = "--fill-threads=";
+    static const char size[] = "--size=";
+    static const char buffers[] = "--max-buffers=";
+    static const char idle[] = "--buffer-idle-ms=";
+    static const char client_threads_option[] = "--threads=";
+    static const char windows_option[] = "--windows=";
+    static const char rate[] = "--rate=";
+    static const char backend[] = "--backend=";
+    static const char damage[] = "--damage=";
+    static const char damage_size[] = "--damage-size=";
     for (i = 1; i < argc; i++) {
       if (!strncmp(argv[i], import_mode,
              sizeof(import_mode) - 1)) {
@@ -470,35 +1282,84 @@ main(int argc, char **argv)
              sizeof(map_mode) - 1)) {
         current_map_mode = check_map_mode(argv[i]
                     + sizeof(map_mode) - 1);
+      } else if (!strncmp(argv[i], pattern,
+             sizeof(pattern) - 1)) {
+        current_pattern = check_pattern(argv[i]
+                    + sizeof(pattern) - 1);
+      } else if (!strncmp(argv[i], threads,
+             sizeof(threads) - 1)) {
+        fill_threads = atoi(argv[i] + sizeof(threads) - 1);
+      } else if (!strncmp(argv[i], size,
+             sizeof(size) - 1)) {
+        sizes = check_sizes(argv[i] + sizeof(size) - 1);
+      } else if (!strncmp(argv[i], buffers,
+             sizeof(buffers) - 1)) {
+        max_buffers = atoi(argv[i] + sizeof(buffers) - 1);
+        if (max_buffers < MIN_BUFFERS)
+          max_buffers = MIN_BUFFERS;
+        if (max_buffers > MAX_BUFFERS)
+          max_buffers = MAX_BUFFERS;
+      } else if (!strncmp(argv[i], idle,
+             sizeof(idle) - 1)) {
+        buffer_idle_ns = strtoull(argv[i] + sizeof(idle) - 1, NULL, 10) * 1000000ull;
+      } else if (!strncmp(argv[i], client_threads_option,
+             sizeof(client_threads_option) - 1)) {
+        client_threads = atoi(argv[i] + sizeof(client_threads_option) - 1);
+        if (client_threads < 1)
+          client_threads = 1;
+      } else if (!strncmp(argv[i], windows_option,
+             sizeof(windows_option) - 1)) {
+        windows = atoi(argv[i] + sizeof(windows_option) - 1);
+        if (windows < 1)
+          windows = 1;
+      } else if (!strncmp(argv[i], rate,
+             sizeof(rate) - 1)) {
+        rates = check_rates(argv[i] + sizeof(rate) - 1);
+      } else if (!strncmp(argv[i], backend,
+             sizeof(backend) - 1)) {
+        current_backend = check_backend(argv[i] + sizeof(backend) - 1);
+      } else if (!strncmp(argv[i], damage_size,
+             sizeof(damage_size) - 1)) {
+        if (sscanf(argv[i] + sizeof(damage_size) - 1, "%dx%d",
+                   &damage_width, &damage_height) != 2 ||
+            damage_width <= 0 || damage_height <= 0)
+          exit(0);
+      } else if (!strncmp(argv[i], damage,
+             sizeof(damage) - 1)) {
+        current_damage = check_damage(argv[i] + sizeof(damage) - 1);
       }
     }
   }
 
+  if (fill_threads > 1)
+    fill_pool_start(fill_threads);
+
+  report_every_second = client_threads * windows == 1;
+
   display = create_display(is_immediate);
-  window = create_window(display, 256, 256);
-  if (!window)
-    return 1;
 
   sigint.sa_handler = signal_int;
   sigemptyset(&sigint.sa_mask);
   sigint.sa_flags = SA_RESETHAND;
   sigaction(SIGINT, &sigint, NULL);
 
-  /* Here we retrieve the linux-dmabuf objects if executed without immed,
-   * or error */
-  wl_display_roundtrip(display->display);
-
-  if (!running)
-    return 1;
-
-  redraw(window, NULL, 0);
-
-  while (running && ret != -1)
-    ret = wl_display_dispatch(display->display);
+  std::vector<struct client_thread> threads(client_threads);
+  for (i = 0; i < client_threads; i++) {
+    threads[i].index = i;
+    threads[i].windows = windows;
+    threads[i].sizes = &sizes;
+    threads[i].rates = &rates;
+    threads[i].shared = display;
+    threads[i].thread = std::thread(run_thread, &threads[i]);
+  }
+  // A thread blocked on its queue only wakes for events, and the one a
+  // frame callback brings is never far off
+  for (struct client_thread &thread : threads)
+    thread.thread.join();
 
   fprintf(stderr, "simple-dmabuf exiting\n");
-  destroy_window(window);
   destroy_display(display);
+  fill_pool_stop();
 
   return 0;
 }
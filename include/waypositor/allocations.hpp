@@ -0,0 +1,124 @@
+#ifndef UUID_C7F20B94_6E1D_4A85_B3C8_19D5E04F6A72
+#define UUID_C7F20B94_6E1D_4A85_B3C8_19D5E04F6A72
+
+#include <cstddef>
+#include <cstdint>
+
+#include <unistd.h>
+
+// Per-thread allocation counts, for finding (and keeping out) allocations on
+// hot paths. They're only kept when built with -Dallocation_tracking=true,
+// which links in src/allocations.cpp to count every malloc. Otherwise the
+// counts stay at zero and nothing is checked.
+namespace waypositor { namespace allocations {
+#ifdef WAYPOSITOR_TRACK_ALLOCATIONS
+  constexpr bool TRACKED = true;
+#else
+  constexpr bool TRACKED = false;
+#endif
+
+  struct Counts {
+    uint64_t allocations{0};
+    uint64_t bytes{0};
+    // Of the allocations, the ones made growing something that's allowed to
+    // grow (see Allow)
+    uint64_t grown{0};
+
+    Counts operator-(Counts const &other) const {
+      return {
+        allocations - other.allocations, bytes - other.bytes
+      , grown - other.grown
+      };
+    }
+  };
+
+  namespace detail {
+    // Only the interposed allocator writes these
+    inline thread_local Counts counts{};
+    // Nonzero while allocating is forbidden on this thread
+    inline thread_local unsigned forbidden{0};
+    inline thread_local char const *forbidden_by{nullptr};
+    // Whether forbidding anything is checked on this thread
+    inline thread_local bool checking{false};
+    // Nonzero while growing something that's allowed to grow
+    inline thread_local unsigned growing{0};
+
+    // Called by the allocator. It mustn't allocate, so it doesn't.
+    inline void allocated(std::size_t bytes) {
+      counts.allocations++;
+      counts.bytes += bytes;
+      if (growing > 0) counts.grown++;
+      if (forbidden == 0 || !checking) return;
+      forbidden = 0;
+      auto say = [](char const *what) {
+        std::size_t length = 0;
+        while (what[length]) ++length;
+        [[maybe_unused]] auto written = ::write(STDERR_FILENO, what, length);
+      };
+      say("Allocated where allocating is forbidden: ");
+      say(forbidden_by);
+      say("\n");
+      __builtin_trap();
+    }
+  }
+
+  // This thread's, since it started
+  inline Counts counts() { return detail::counts; }
+
+  // Whether Forbid traps on this thread. It doesn't until told to, so that
+  // what only happens while warming up (a table growing, an arena getting
+  // its first block) isn't held against a hot path.
+  inline void check(bool enabled) { detail::checking = enabled; }
+
+  // What this thread allocates from construction on
+  class Region final {
+  private:
+    Counts mStart;
+  public:
+    Region() : mStart{allocations::counts()} {}
+    Counts counts() const { return allocations::counts() - mStart; }
+  };
+
+  // Traps if this thread allocates while one of these is in scope, and
+  // it's being checked. The reason is written out first. Nests.
+  class Forbid final {
+  private:
+    char const *mPrevious;
+  public:
+    explicit Forbid(char const *reason) : mPrevious{detail::forbidden_by} {
+      if constexpr (!TRACKED) return;
+      detail::forbidden++;
+      detail::forbidden_by = reason;
+    }
+    Forbid(Forbid const &) = delete;
+    Forbid &operator=(Forbid const &) = delete;
+    ~Forbid() {
+      if constexpr (!TRACKED) return;
+      detail::forbidden--;
+      detail::forbidden_by = mPrevious;
+    }
+  };
+
+  // Lifts a Forbid while in scope, for what's allowed to grow where
+  // nothing else is (a table, an arena's blocks). What's allocated is
+  // counted as grown.
+  class Allow final {
+  private:
+    unsigned mForbidden;
+  public:
+    Allow() : mForbidden{detail::forbidden} {
+      if constexpr (!TRACKED) return;
+      detail::forbidden = 0;
+      detail::growing++;
+    }
+    Allow(Allow const &) = delete;
+    Allow &operator=(Allow const &) = delete;
+    ~Allow() {
+      if constexpr (!TRACKED) return;
+      detail::forbidden = mForbidden;
+      detail::growing--;
+    }
+  };
+}}
+
+#endif
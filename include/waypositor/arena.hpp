@@ -0,0 +1,225 @@
+#ifndef UUID_9F3B6E20_D41C_4C7A_85E9_2A70C8B1D563
+#define UUID_9F3B6E20_D41C_4C7A_85E9_2A70C8B1D563
+
+#include <waypositor/allocations.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+namespace waypositor { namespace arena {
+  // Small allocations for a single owner (e.g. a connection), carved out of
+  // blocks that are only given back when the arena goes. What's freed goes
+  // on a free list for its size class, for the next allocation of that
+  // class. Anything bigger than the largest class, or more aligned than
+  // a class, goes to the heap. Thread safe.
+  //
+  // Everything allocated from an arena has to be given back, or be done
+  // with, before the arena goes.
+  class Arena final {
+  public:
+    // Close together where most objects are, as rounding up is slack
+    static constexpr std::array<std::size_t, 11> CLASSES{
+      16, 32, 48, 64, 96, 128, 160, 256, 512, 768, 1024
+    };
+    static constexpr std::size_t ALIGNMENT = 16;
+    // Blocks start small, so that owners with little in them stay small,
+    // and double from there. The first fits an idle connection with a
+    // registry, and no more: one block too many costs more than it saves.
+    static constexpr std::size_t FIRST_BLOCK = 288;
+    static constexpr std::size_t LAST_BLOCK = 8192;
+
+  private:
+    struct Node {
+      Node *next;
+    };
+    struct alignas(ALIGNMENT) Block {
+      Block *next;
+    };
+
+    std::mutex mMutex{};
+    // Otherwise everything goes to the heap, for comparison
+    bool mEnabled;
+    Block *mBlocks{nullptr};
+    std::size_t mNextBlock{FIRST_BLOCK};
+    unsigned char *mCursor{nullptr};
+    unsigned char *mEnd{nullptr};
+    std::array<Node *, CLASSES.size()> mFree{};
+    // In blocks and on the heap
+    std::size_t mReserved{0};
+    // As asked for, so that what's lost to rounding up to a class counts
+    // as unused
+    std::size_t mUsed{0};
+
+    static std::size_t size_class(std::size_t size) {
+      return static_cast<std::size_t>(
+        std::lower_bound(CLASSES.begin(), CLASSES.end(), size)
+      - CLASSES.begin()
+      );
+    }
+
+    // Should be synchronized by mMutex
+    void *carve(std::size_t size) {
+      if (static_cast<std::size_t>(mEnd - mCursor) < size) {
+        std::size_t block_size = std::max(mNextBlock, size + sizeof(Block));
+        allocations::Allow growing{};
+        auto block = static_cast<Block *>(::operator new(block_size));
+        block->next = mBlocks;
+        mBlocks = block;
+        mReserved += block_size;
+        // What's left of the last block is wasted, as it's smaller than
+        // what's asked for
+        mCursor = reinterpret_cast<unsigned char *>(block + 1);
+        mEnd = reinterpret_cast<unsigned char *>(block) + block_size;
+        mNextBlock = std::min(mNextBlock * 2, LAST_BLOCK);
+      }
+      void *result = mCursor;
+      mCursor += size;
+      return result;
+    }
+
+    static void *heap_allocate(std::size_t size, std::size_t alignment) {
+      if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        return ::operator new(size, std::align_val_t{alignment});
+      }
+      return ::operator new(size);
+    }
+
+    static void heap_deallocate(void *pointer, std::size_t alignment) {
+      if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+        ::operator delete(pointer, std::align_val_t{alignment});
+      } else {
+        ::operator delete(pointer);
+      }
+    }
+
+  public:
+    explicit Arena(bool enabled = true) : mEnabled{enabled} {}
+    Arena(Arena const &) = delete;
+    Arena &operator=(Arena const &) = delete;
+    ~Arena() {
+      // Wholesale: nothing is given back one allocation at a time
+      while (mBlocks) {
+        Block *next = mBlocks->next;
+        ::operator delete(mBlocks);
+        mBlocks = next;
+      }
+    }
+
+    void *allocate(std::size_t size, std::size_t alignment) {
+      std::size_t index = size_class(size);
+      auto lock = std::lock_guard(mMutex);
+      mUsed += size;
+      if (!mEnabled || index == CLASSES.size() || alignment > ALIGNMENT) {
+        mReserved += size;
+        return heap_allocate(size, alignment);
+      }
+      if (Node *node = mFree[index]) {
+        mFree[index] = node->next;
+        return node;
+      }
+      return this->carve(CLASSES[index]);
+    }
+
+    // The size and alignment have to be what was allocated with
+    void deallocate(void *pointer, std::size_t size, std::size_t alignment) {
+      std::size_t index = size_class(size);
+      auto lock = std::lock_guard(mMutex);
+      mUsed -= size;
+      if (!mEnabled || index == CLASSES.size() || alignment > ALIGNMENT) {
+        mReserved -= size;
+        heap_deallocate(pointer, alignment);
+        return;
+      }
+      auto node = static_cast<Node *>(pointer);
+      node->next = mFree[index];
+      mFree[index] = node;
+    }
+
+    // In bytes, what's held on to in all, and what of that is in use. The
+    // difference is free-listed, or was never handed out.
+    std::pair<std::size_t, std::size_t> usage() {
+      auto lock = std::lock_guard(mMutex);
+      return {mReserved, mUsed};
+    }
+  };
+
+  // For containers
+  template <typename T>
+  class Allocator {
+  private:
+    Arena *mArena;
+    template <typename U> friend class Allocator;
+  public:
+    using value_type = T;
+
+    explicit Allocator(Arena &arena) : mArena{&arena} {}
+    template <typename U>
+    Allocator(Allocator<U> const &other) : mArena{other.mArena} {}
+
+    T *allocate(std::size_t count) {
+      return static_cast<T *>(
+        mArena->allocate(count * sizeof(T), alignof(T))
+      );
+    }
+
+    void deallocate(T *pointer, std::size_t count) {
+      mArena->deallocate(pointer, count * sizeof(T), alignof(T));
+    }
+
+    template <typename U>
+    bool operator==(Allocator<U> const &other) const {
+      return mArena == other.mArena;
+    }
+
+    template <typename U>
+    bool operator!=(Allocator<U> const &other) const {
+      return mArena != other.mArena;
+    }
+  };
+
+  // Destroys what a Pointer points to, and gives back its memory. It
+  // remembers what was made, so a Pointer to a base class with a virtual
+  // destructor is fine.
+  class Deleter final {
+  private:
+    Arena *mArena;
+    // Kept small, as there's one of these per object
+    uint32_t mSize;
+    uint32_t mAlignment;
+  public:
+    Deleter() : mArena{nullptr}, mSize{0}, mAlignment{0} {}
+    Deleter(Arena &arena, std::size_t size, std::size_t alignment)
+      : mArena{&arena}
+      , mSize{static_cast<uint32_t>(size)}
+      , mAlignment{static_cast<uint32_t>(alignment)}
+    {}
+
+    std::size_t size() const { return mSize; }
+
+    template <typename T>
+    void operator()(T *pointer) const {
+      pointer->~T();
+      mArena->deallocate(pointer, mSize, mAlignment);
+    }
+  };
+
+  template <typename T>
+  using Pointer = std::unique_ptr<T, Deleter>;
+
+  template <typename T, typename ...Args>
+  Pointer<T> make(Arena &arena, Args&&... args) {
+    void *memory = arena.allocate(sizeof(T), alignof(T));
+    return Pointer<T>{
+      new (memory) T(std::forward<Args>(args)...)
+    , Deleter{arena, sizeof(T), alignof(T)}
+    };
+  }
+}}
+
+#endif
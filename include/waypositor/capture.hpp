@@ -0,0 +1,210 @@
+#ifndef UUID_4BFEDFB8_EF6D_4768_8468_5F1D61B8EA1E
+#define UUID_4BFEDFB8_EF6D_4768_8468_5F1D61B8EA1E
+
+#include <waypositor/logger.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace waypositor { namespace capture {
+  using Clock = std::chrono::steady_clock;
+
+  // A capture file holds what clients sent to the server, so that it can be
+  // played back later. After the magic bytes, it's a sequence of records:
+  //
+  //   type          one byte (see Type)
+  //   connection    varint
+  //   delay         varint, microseconds since the previous record
+  //   DATA only:    varint length, then the bytes
+  //   FDS only:     varint count of file descriptors
+  //
+  // Varints are little endian base 128. File descriptors can't be recorded,
+  // so only their count is, in the position they arrived in.
+  enum class Type : unsigned char { OPEN = 1, DATA = 2, FDS = 3, CLOSE = 4 };
+
+  constexpr char MAGIC[8] = {'W', 'P', 'C', 'A', 'P', '\0', '\0', '\1'};
+
+  struct Record {
+    Type type;
+    std::size_t connection;
+    Clock::duration delay;
+    std::vector<unsigned char> bytes;
+    std::size_t fds;
+  };
+
+  class Writer final {
+  private:
+    std::mutex mMutex;
+    std::ofstream mFile;
+    Clock::time_point mLast;
+    // Reads that follow each other closely on one connection go in a single
+    // record
+    std::optional<std::size_t> mPendingConnection;
+    Clock::time_point mPendingTime;
+    std::vector<unsigned char> mPending;
+
+    static constexpr auto COALESCE = std::chrono::milliseconds{1};
+
+    struct Private {};
+
+    // Should be synchronized by mMutex
+    void varint(uint64_t value) {
+      do {
+        auto byte = static_cast<unsigned char>(value & 0x7f);
+        value >>= 7;
+        if (value != 0) byte |= 0x80;
+        mFile.put(static_cast<char>(byte));
+      } while (value != 0);
+    }
+
+    // Should be synchronized by mMutex
+    void header(Type type, std::size_t connection, Clock::time_point time) {
+      auto delay = std::chrono::duration_cast<std::chrono::microseconds>(
+        time - mLast
+      );
+      mLast = time;
+      mFile.put(static_cast<char>(type));
+      this->varint(connection);
+      this->varint(static_cast<uint64_t>(std::max<long long>(
+        delay.count(), 0
+      )));
+    }
+
+    // Should be synchronized by mMutex
+    void flush_pending() {
+      if (!mPendingConnection) return;
+      this->header(Type::DATA, *mPendingConnection, mPendingTime);
+      this->varint(mPending.size());
+      mFile.write(
+        reinterpret_cast<char const *>(mPending.data())
+      , static_cast<std::streamsize>(mPending.size())
+      );
+      mPendingConnection = std::nullopt;
+      mPending.clear();
+    }
+
+  public:
+    Writer(Private, std::ofstream file)
+      : mMutex{}, mFile{std::move(file)}, mLast{Clock::now()}
+      , mPendingConnection{std::nullopt}, mPendingTime{}, mPending{}
+    { mFile.write(MAGIC, sizeof(MAGIC)); }
+    Writer(Writer const &) = delete;
+    Writer &operator=(Writer const &) = delete;
+    ~Writer() {
+      auto lock = std::lock_guard(mMutex);
+      this->flush_pending();
+    }
+
+    static std::optional<Writer> create(Logger &log, std::string const &path) {
+      std::ofstream file{path, std::ios::binary | std::ios::trunc};
+      if (!file) {
+        log.error("Couldn't open capture file ", path);
+        return std::nullopt;
+      }
+      log.info("Capturing client traffic to ", path);
+      return std::make_optional<Writer>(Private{}, std::move(file));
+    }
+
+    // All of these are thread safe
+    void open(std::size_t connection) {
+      auto lock = std::lock_guard(mMutex);
+      this->flush_pending();
+      this->header(Type::OPEN, connection, Clock::now());
+    }
+
+    void data(std::size_t connection, void const *bytes, std::size_t size) {
+      auto now = Clock::now();
+      auto lock = std::lock_guard(mMutex);
+      if (
+        mPendingConnection != connection || now - mPendingTime > COALESCE
+      ) {
+        this->flush_pending();
+        mPendingConnection = connection;
+        mPendingTime = now;
+      }
+      auto first = static_cast<unsigned char const *>(bytes);
+      mPending.insert(mPending.end(), first, first + size);
+    }
+
+    void fds(std::size_t connection, std::size_t count) {
+      auto lock = std::lock_guard(mMutex);
+      this->flush_pending();
+      this->header(Type::FDS, connection, Clock::now());
+      this->varint(count);
+    }
+
+    void close(std::size_t connection) {
+      auto lock = std::lock_guard(mMutex);
+      this->flush_pending();
+      this->header(Type::CLOSE, connection, Clock::now());
+      mFile.flush();
+    }
+  };
+
+  // Reads a whole capture. Returns nothing if it's malformed.
+  inline std::optional<std::vector<Record>> read(std::istream &in) {
+    char magic[sizeof(MAGIC)]{};
+    in.read(magic, sizeof(magic));
+    if (!in || !std::equal(magic, magic + sizeof(magic), MAGIC)) {
+      return std::nullopt;
+    }
+
+    auto varint = [&in]() -> std::optional<uint64_t> {
+      uint64_t value = 0;
+      for (unsigned int shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == std::char_traits<char>::eof()) return std::nullopt;
+        value |= uint64_t{static_cast<unsigned char>(byte) & 0x7fu} << shift;
+        if (!(byte & 0x80)) return value;
+      }
+      return std::nullopt;
+    };
+
+    std::vector<Record> records{};
+    for (int type = in.get(); type != std::char_traits<char>::eof();
+         type = in.get()) {
+      auto connection = varint();
+      auto delay = varint();
+      if (!connection || !delay) return std::nullopt;
+      Record record{
+        static_cast<Type>(type), *connection
+      , std::chrono::microseconds{*delay}, {}, 0
+      };
+      switch (record.type) {
+      case Type::OPEN:
+      case Type::CLOSE:
+        break;
+      case Type::DATA: {
+        auto size = varint();
+        if (!size) return std::nullopt;
+        record.bytes.resize(*size);
+        in.read(
+          reinterpret_cast<char *>(record.bytes.data())
+        , static_cast<std::streamsize>(*size)
+        );
+        if (!in) return std::nullopt;
+        break;
+      }
+      case Type::FDS: {
+        auto count = varint();
+        if (!count) return std::nullopt;
+        record.fds = *count;
+        break;
+      }
+      default:
+        return std::nullopt;
+      }
+      records.push_back(std::move(record));
+    }
+    return records;
+  }
+}}
+
+#endif
@@ -0,0 +1,705 @@
+#ifndef UUID_5AFB4C12_6BD6_43C3_ACB2_D1EA5B253589
+#define UUID_5AFB4C12_6BD6_43C3_ACB2_D1EA5B253589
+
+#include <waypositor/metrics.hpp>
+
+#include <boost/align/aligned_allocator.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace waypositor {
+  namespace asio = boost::asio;
+
+  namespace coroutine {
+    // A type-safe coroutine stack! After creation, this shouldn't allocate
+    // except if the stack needs to grow. Suspend/resume amounts to copying a
+    // pointer and an offset through the thread pool's queues.
+    //
+    // This stack aims to be provably correct because only one
+    // (non-moved-from) stack pointer can exist at a time. Ownership must be
+    // passed back to the stack to call a new coroutine, and if the active
+    // pointer goes out of scope, the frame is popped, activating its parent.
+    class Stack final {
+    private:
+      // Every coroutine stack has a context that provides general utilites
+      // necessary across coroutines (e.g., logging, async operations). It
+      // should be thread safe. It's type is safely stored inside the
+      // stack/frame pointers, allowing this stack to be reused for any type of
+      // context.
+      void *mContext{nullptr};
+
+      // This is where the stack frames are stored
+      using Store = std::vector<
+        unsigned char
+      , // I'm not clear on the alignment guarantees (if any) for the buffers
+        // created by std::vector. This is an attempt to guarantee that maximal
+        // alignment is used. That way we know that using aligned offsets will
+        // guarantee aligned addresses.
+        boost::alignment::aligned_allocator<
+          unsigned char, alignof(std::max_align_t)
+        >
+      >;
+      Store mStore{};
+       
+      // A type for representing a stack frame
+      template <typename T, typename ParentPointer>
+      class Frame final {
+      private:
+        // The parent frame's stack pointer, or equivalent for the root pointer
+        ParentPointer mParentPointer;
+        // The frame data
+        T mData;
+      public:
+        template <typename ...Args>
+        Frame(ParentPointer parent_pointer, Args&&... args)
+          : mParentPointer{std::move(parent_pointer)}
+          , mData(std::forward<Args>(args)...)
+        {}
+
+        // Dereferencing these on anything but the active frame is bad news!
+        ParentPointer &parent_pointer() { return mParentPointer; }
+        ParentPointer const &parent_pointer() const { return mParentPointer; }
+
+        T &data() { return mData; }
+        T const &data() const { return mData; }
+      };
+
+      // Get a reference to a specific frame
+      template <typename T, typename ParentPointer>
+      auto &frame(std::size_t offset) {
+        return reinterpret_cast<Frame<T, ParentPointer> &>(mStore[offset]);
+      }
+
+      // Get a const reference to a specific current frame
+      template <typename T, typename ParentPointer>
+      auto const &frame(std::size_t offset) const {
+        return reinterpret_cast<Frame<T, ParentPointer> &>(mStore[offset]);
+      }
+
+      // Cast the context pointer to the correct type
+      template <typename Context>
+      Context &context() { return *static_cast<Context *>(mContext); }
+
+      // Cast the context pointer to the correct const type
+      template <typename Context>
+      Context const &context() const {
+        return *static_cast<Context *>(mContext);
+      }
+
+      // A stack pointer. We use a chain of ownership to avoid using/destroying
+      // stack pointers out of order. (Each call passes ownership of the parent
+      // frame.) Note that this ownership chain is encoded in the type, so a
+      // deeply nested frame's type will include the type of all frames up to
+      // that point.
+      template <
+        // The context type associated with this stack
+        typename Context
+      , // The type of this frame's data
+        typename T
+      , // Tag for invoking parent's coreturn callback
+        typename ReturnTag
+      , // Parent's logic type
+        typename ParentLogic
+      , // Parent's frame pointer type. This is a Pointer<...> for all frames
+        // except the root frame, where it is Root::Pointer<...>.
+        typename ParentPointer
+      >
+      class Pointer final {
+      private:
+        Stack *mStack;
+        std::size_t mOffset;
+
+        auto &frame() {
+          return mStack->frame<T, ParentPointer>(mOffset);
+        }
+
+        auto const &frame() const {
+          return mStack->frame<T, ParentPointer>(mOffset);
+        }
+      public:
+        Pointer(Pointer const &);
+        Pointer &operator=(Pointer const &);
+        Pointer(Pointer &&other)
+          : mStack{other.mStack}, mOffset{other.mOffset}
+        { other.mStack = nullptr; }
+        Pointer &operator=(Pointer &&other) {
+          if (this == &other) return *this;
+          mStack = other.mStack;
+          mOffset = other.mOffset;
+          other.mStack = nullptr;
+          return *this;
+        }
+        ~Pointer() {
+          if (!*this) return;
+          // The frame pointer has gone out of scope. Reactivate the parent
+          // frame, or trigger the stack completion callback.
+          mStack->pop<T, ParentLogic, ParentPointer>(mOffset);
+        }
+
+        Pointer(Stack &stack, std::size_t offset)
+          : mStack{&stack}, mOffset{offset} {}
+
+        explicit operator bool() const { return mStack != nullptr; }
+
+        Context &context() { return mStack->context<Context>(); }
+        Context const &context() const { return mStack->context<Context>(); }
+
+        // Return information to the parent frame. This doesn't actually resume
+        // the parent. That doesn't happen until the current stack pointer goes
+        // out of scope. (This should guarantee that the parent resumes even if
+        // coreturn is never called.) It also means the child frame is free to
+        // call coreturn multiple times before it exits.
+        template <typename ...Args>
+        void coreturn(Args... args) {
+          assert(*this);
+          // Reach through the parent pointer to call coreturn. Usually this
+          // means calling it on the frame data. The ReturnTag allows the parent
+          // frame to invoke multiple coroutines with different coreturn
+          // callbacks.
+          this->frame().parent_pointer()->coreturn(
+            ReturnTag{}, std::move(args)...
+          );
+        }
+
+        // Invoke a new coroutine
+        template <
+          // The frame data for the coroutine. This type should define a type
+          // U::Logic<FramePointer> that accepts ownership of the FramePointer
+          // created by this function in its constructor. It should also define
+          // a member function U::coreturn(MyReturnTag, ...)
+          typename U
+        , // The tag the child logic should use when invoking coreturn on the
+          // frame data
+          typename MyReturnTag
+        , // A callable type that manipulates the frame data via the stack
+          // pointer. It maintains ownership of the active frame pointer.
+          typename MyLogic
+        , // Arguments for constructing the frame data. These are copied to
+          // avoid inadvertently referencing into a stack that gets resized.
+          // (Note that this doesn't prevent transferring ownership via
+          // std::move.)
+          typename ...Args
+        >
+        void coinvoke(Args... args) {
+          assert(*this);
+          mStack->call<Context, U, MyReturnTag, MyLogic>(
+            // Transfer ownership of this stack pointer back to the stack
+            std::move(*this)
+          , std::move(args)...
+          );
+        }
+
+        T *operator->() { assert(*this); return &this->frame().data(); }
+        T const *operator->() const {
+          assert(*this); return &this->frame().data();
+        }
+        T &operator*() { assert(*this); return this->frame().data(); }
+        T const &operator*() const {
+          assert(*this); return this->frame().data();
+        }
+
+        // Bytes the stack holds on to, used or not
+        std::size_t stack_capacity() const {
+          assert(*this); return mStack->mStore.capacity();
+        }
+
+        // Give back the stack's unused space if it holds on to more than
+        // the budget. Like a call, this invalidates anything referencing into
+        // the stack.
+        void trim_stack(std::size_t budget) {
+          assert(*this);
+          mStack->trim(budget);
+        }
+      };
+
+      void trim(std::size_t budget) {
+        if (mStore.capacity() <= budget) return;
+        // Frames are moved as bytes, as when the stack grows
+        Store{mStore.begin(), mStore.end()}.swap(mStore);
+      }
+
+      // Destroy the current stack frame and reactivate the logic for its parent
+      template <typename T, typename ParentLogic, typename ParentPointer>
+      void pop(std::size_t offset) {
+        using FrameT = Frame<T, ParentPointer>;
+        // Get the current frame
+        FrameT &doomed = this->frame<T, ParentPointer>(offset);
+        // The new size of the stack after the pop. Anything past the frame
+        // was popped before it.
+        std::size_t new_size = offset;
+        // Reactivate the parent frame's logic, and pass it ownership of the
+        // parent's frame pointer
+        ParentLogic logic{std::move(doomed.parent_pointer())};
+        // Destroy the current frame
+        doomed.~FrameT();
+        // Resize the stack. Shrinking a vector does not reallocate, so this
+        // space remains free for reuse. (We could probably get away without
+        // doing an explicit resize.)
+        mStore.resize(new_size);
+        // Resume the parent frame. If this is the root frame it may destroy the
+        // stack!
+        logic();
+      }
+
+      // The logic for setting up a stack frame
+      template <
+        typename Context, typename T, typename ReturnTag
+      , typename ParentLogic, typename ParentPointer, typename ...Args
+      >
+      void call(ParentPointer parent_pointer, Args&&... args) {
+        using FrameT = Frame<T, ParentPointer>;
+
+        // Get an aligned offset
+        std::size_t mask = alignof(FrameT) - 1;
+        std::size_t offset = mStore.size();
+        std::size_t aligned = (offset + mask) & ~mask;
+
+        // Make space. This invalidates anything referencing into the existing
+        // stack!!
+        mStore.resize(aligned + sizeof(FrameT));
+
+        // Construct a frame
+        new (&mStore[aligned]) FrameT(
+          std::move(parent_pointer), std::forward<Args>(args)...
+        );
+
+        // Create a frame pointer and pass ownership to T's Logic callback
+        using PointerT = Pointer<
+          Context, T, ReturnTag, ParentLogic, ParentPointer
+        >;
+        typename T::template Logic<PointerT>{PointerT{*this, aligned}}();
+      }
+
+      // This object lives in the root stack frame. When the call stack
+      // finishes, this goes out of scope
+      template <typename ParentPointer>
+      class RootPointer final {
+      private:
+        // (For now) this object owns the stack! The stack is destroyed when it
+        // goes out of scope. In the future there may be an object pool that
+        // allows for Stack reuse.
+        std::unique_ptr<Stack> mStack;
+        // Contains the parent pointer supplied at stack creation, or
+        // std::nullopt if none was supplied
+        ParentPointer mParentPointer;
+      public:
+        // Type for extracting the parent pointer and passing it along to a
+        // ParentLogic instance.
+        template <typename ParentLogic>
+        class Logic final {
+        private:
+          RootPointer<ParentPointer> mRootPointer;
+        public:
+          Logic(RootPointer pointer) : mRootPointer{std::move(pointer)} {}
+
+          void operator()() {
+            ParentLogic{std::move(mRootPointer.mParentPointer)}();
+          }
+        };
+
+        RootPointer(
+          std::unique_ptr<Stack> stack, ParentPointer parent = std::nullopt
+        )
+          : mStack{std::move(stack)}, mParentPointer{std::move(parent)}
+        {}
+
+        // Dispatch the coreturn call to the parent pointer
+        ParentPointer &operator->() { return mParentPointer; }
+        ParentPointer const &operator->() const { return mParentPointer; }
+      };
+
+      // Helpers for constructing a one-off stack with no parent pointer
+      struct NullTag {};
+      struct NullPointer {
+        NullPointer *operator->() { return this; }
+        NullPointer const *operator->() const { return this; }
+        void coreturn(NullTag) {}
+      };
+      template <typename Unused>
+      struct NullLogic {
+        NullLogic(Unused) {}
+        void operator()() {}
+      };
+
+      struct Private {};
+
+    public:
+      Stack(
+        Private // Make the constructor effectively private
+      , void *context
+      ) : mContext{context}
+      { /*mStore.reserve(1 << 10);*/ } // Start with a 1KB stack for now
+
+      // Kick off the stack! Note that a stack can be reused if it's empty
+      template <
+        // The coroutine to invoke first
+        typename T
+      , // coreturn will be invoked through the ParentPointer instance using
+        // this tag
+        typename ParentReturnTag
+      , // The stack's special context instance (e.g., Connection)
+        typename Context
+      , // This could be frame pointer for another stack, or it could be a
+        // special handle (e.g., Forker<...>::KeepaliveHandle)
+        typename ParentPointer
+      , // Arguments for constructing the T instance
+        typename ...Args
+      >
+      static void spawn(
+        Context &context, ParentPointer parent_pointer, Args&&... args
+      ) {
+        auto stack_pointer = std::make_unique<Stack>(Private{}, &context);
+        auto &stack = *stack_pointer;
+        RootPointer root_pointer{
+          std::move(stack_pointer), std::move(parent_pointer)
+        };
+        stack.template call<
+          Context, T, ParentReturnTag
+        , typename RootPointer<ParentPointer>::template Logic<
+            NullLogic<ParentPointer>
+          >
+        >(
+          std::move(root_pointer), std::forward<Args>(args)...
+        );
+      }
+
+      // This is like std::thread::detach. It spins up a coroutine stack without
+      // worrying about what happens when it finishes.
+      template <
+        // The coroutine to invoke first
+        typename T
+      , // The stack's special context instance (e.g., Connection)
+        typename Context
+      , // Arguments for constructing the T instance
+        typename ...Args
+      >
+      static void spawn(
+        Context &context, Args&&... args
+      ) {
+        spawn<T, NullTag>(
+          context, NullPointer{}, std::forward<Args>(args)...
+        );
+      }
+    };
+
+    template <typename Context>
+    class Forker final {
+    private:
+      struct ReturnTag {};
+
+      class Lookup;
+      // An entry in the lookup. This is owned by both the Lookup instance and
+      // the associated Stack. It maintains a weak_ptr to the Lookup instance
+      // that owns it so that destruction of the Stack's pointer can remove the
+      // Entry from the Lookup.
+      struct Entry final {
+        std::size_t id;
+        std::weak_ptr<Lookup> maybe_owner;
+        Context context;
+        template <typename ...Args>
+        Entry(
+          std::size_t id_, std::shared_ptr<Lookup> const &owner
+        , Args&&... args
+        ) : id{id_}, maybe_owner{owner}
+          , context{id_, std::forward<Args>(args)...}
+        {}
+
+        void coreturn(ReturnTag) {
+          // Forker does not return information to the calling coroutine, so we
+          // don't do anything.
+        }
+      };
+
+      // This represents the Stack's ownership of an Entry. If it goes out of
+      // scope, it attempts to remove the associated Entry from its owning
+      // Lookup instance, assuming the Lookup instance still exists.
+      class KeepaliveHandle final {
+      private:
+        std::shared_ptr<Entry> mEntry;
+      public:
+        KeepaliveHandle(KeepaliveHandle &&) = default;
+        KeepaliveHandle &operator=(KeepaliveHandle &&) = default;
+        ~KeepaliveHandle() {
+          if (!mEntry) return;
+          auto owner = mEntry->maybe_owner.lock();
+          if (!owner) return;
+          owner->erase(mEntry->id);
+        }
+
+        explicit KeepaliveHandle(std::shared_ptr<Entry> entry)
+          : mEntry{std::move(entry)}
+        {}
+
+        Entry *operator->() { return mEntry.get(); }
+        Entry const *operator->() const { return mEntry.get(); }
+        Entry &operator*() { return *mEntry; }
+        Entry const &operator*() const { return *mEntry; }
+      };
+
+      // Lookups contain these. OwnerHandle maintains shared ownership over an
+      // Entry with KeepaliveHandle. Destruction requests shutdown of the
+      // Context.
+      class OwnerHandle final {
+      private:
+        std::shared_ptr<Entry> mEntry;
+      public:
+        // These should be deleted, but there was a bug in gcc:
+        // https://gcc.gnu.org/bugzilla/show_bug.cgi?id=80654
+        OwnerHandle(OwnerHandle const &);
+        OwnerHandle &operator=(OwnerHandle const &);
+        OwnerHandle(OwnerHandle &&) = default;
+        OwnerHandle &operator=(OwnerHandle &&) = default;
+        ~OwnerHandle() {
+          if (!mEntry) return;
+          // This call should make async operations fail. (E.g., for an ASIO
+          // connection it should destroy the socket.) That should tear down the
+          // coroutine stack and eventually destroy the context.
+          mEntry->context.shutdown();
+        }
+
+        explicit OwnerHandle(std::shared_ptr<Entry> entry)
+          : mEntry{std::move(entry)}
+        {}
+      };
+
+      // This stores all the Context instances and destroying it allows us to
+      // cleanly shut everything down.
+      class Lookup final {
+      private:
+        std::unordered_map<std::size_t, OwnerHandle> mLookup;
+        std::mutex mLock;
+      public:
+        // How many are in here, if anyone is counting
+        metrics::Gauge *live{nullptr};
+
+        ~Lookup() { if (live) live->sub(mLookup.size()); }
+
+        template <typename ...Args>
+        void emplace(Args&&... args) {
+          auto lock = std::lock_guard(mLock);
+          if (mLookup.emplace(std::forward<Args>(args)...).second && live) {
+            live->add();
+          }
+        }
+
+        void erase(std::size_t id) {
+          auto lock = std::lock_guard(mLock);
+          if (mLookup.erase(id) > 0 && live) live->sub();
+        }
+      };
+
+      // An internal version of fork to do tuple unpacking
+      template <
+        typename Coroutine
+      , typename ...CoroArgs, std::size_t ...CoroIndices
+      , typename ...ContextArgs, std::size_t ...ContextIndices
+      >
+      void fork_impl(
+        std::tuple<ContextArgs...> context_args
+      , std::index_sequence<ContextIndices...>
+      , std::tuple<CoroArgs...> coro_args
+      , std::index_sequence<CoroIndices...>
+      ) {
+        // gcc reports unused-but-set warnings when these tuples are empty.
+        // Suppress them.
+        (void)context_args;
+        (void)coro_args;
+
+        // Make a shared pointer to the context
+        auto pointer = std::make_shared<Entry>(
+          // Pass the id to the context constructor. (Useful for logging.)
+          mCurrentId, mLookup
+        , std::forward<ContextArgs>(std::get<ContextIndices>(context_args))...
+        );
+
+        // And a copy. Dual ownership is required to allow us to shut down
+        // contexts unexpectedly.
+        auto copy = pointer;
+
+        // Put an ownership handle in the lookup. If it goes away, a context
+        // shutdown will be requested.
+        mLookup->emplace(mCurrentId, OwnerHandle{std::move(copy)});
+
+        // Kick off the associated coroutine stack
+        // Take the context reference before the handle is moved from, as
+        // argument evaluation order is unspecified
+        auto &context = pointer->context;
+        KeepaliveHandle keepalive{std::move(pointer)};
+        Stack::spawn<Coroutine, ReturnTag>(
+          context, std::move(keepalive)
+        , std::forward<CoroArgs>(std::get<CoroIndices>(coro_args))...
+        );
+
+        mCurrentId++;
+        if (mForked) mForked->add();
+      }
+
+    public:
+      // Count the stacks as they come and go. Call this before forking.
+      void instrument(metrics::Gauge &live, metrics::Counter &forked) {
+        mLookup->live = &live;
+        mForked = &forked;
+      }
+
+      // Fork a new coroutine stack and create a Context instance to go with it
+      template <
+        typename Coroutine, typename ...ContextArgs, typename ...CoroArgs
+      >
+      void fork(
+        std::piecewise_construct_t
+      , std::tuple<ContextArgs...> context_args
+      , std::tuple<CoroArgs...> coro_args
+      ) {
+        fork_impl<Coroutine>(
+          std::move(context_args)
+        , std::make_index_sequence<sizeof...(ContextArgs)>{}
+        , std::move(coro_args)
+        , std::make_index_sequence<sizeof...(CoroArgs)>{}
+        );
+      }
+    private:
+      std::shared_ptr<Lookup> mLookup{std::make_shared<Lookup>()};
+      std::size_t mCurrentId{0};
+      metrics::Counter *mForked{nullptr};
+    };
+
+    // Factor out some boilerplate
+    template <typename State, typename StackPointer>
+    class LogicMixin {
+    private:
+      using Logic = typename State::template Logic<StackPointer>;
+      StackPointer mSelf;
+    public:
+      LogicMixin(StackPointer self) : mSelf{std::move(self)} {}
+
+      // ASIO error-handling boilerplate
+      void operator()(
+        boost::system::error_code const &error = {}, std::size_t = 0
+      ) {
+        if (error) {
+          mSelf.context().log_error("ASIO error: ", error.message());
+          return;
+        }
+
+        // Resume the actual logic
+        static_cast<Logic *>(this)->resume();
+      }
+
+    protected:
+      template <typename Destination>
+      void async_read(Destination &destination) {
+        mSelf.context().async_read(
+          asio::buffer(&destination, sizeof(Destination))
+        , std::move(static_cast<Logic &>(*this))
+        );
+      }
+
+      // Fill a whole buffer
+      template <typename Buffer>
+      void async_read_buffer(Buffer buffer) {
+        mSelf.context().async_read(
+          buffer, std::move(static_cast<Logic &>(*this))
+        );
+      }
+
+      template <typename Duration>
+      void async_wait(Duration wait) {
+        mSelf.context().async_wait(
+          wait, std::move(static_cast<Logic &>(*this))
+        );
+      }
+
+      template <typename ...Args>
+      void log_info(Args&&... args) {
+        mSelf.context().log_info(std::forward<Args>(args)...);
+      }
+
+      template <typename ...Args>
+      void log_trace(Args&&... args) {
+        mSelf.context().log_trace(std::forward<Args>(args)...);
+      }
+
+      template <typename ...Args>
+      void log_error(Args&&... args) {
+        mSelf.context().log_error(std::forward<Args>(args)...);
+      }
+
+      void suspend() {
+        mSelf.context().post(std::move(static_cast<Logic &>(*this)));
+      }
+
+      // Have the context give back what it can while it waits for more to
+      // read. Call this from the root frame: the stack is trimmed to the
+      // budget first.
+      void park(std::size_t stack_budget, std::size_t scratch = 0) {
+        mSelf.trim_stack(stack_budget);
+        mSelf.context().park(mSelf.stack_capacity() + scratch);
+      }
+
+      void unpark() { mSelf.context().unpark(); }
+
+      // Invoke a new coroutine
+      template <
+        // The frame data for the coroutine. This type should define a type
+        // U::Logic<FramePointer> that accepts ownership of the FramePointer
+        // created by this function in its constructor. It should also define
+        // a member function U::coreturn(ReturnTag, ...)
+        typename U
+      , // The tag the child logic should use when invoking coreturn on the
+        // frame data
+        typename ReturnTag
+      , // Arguments for constructing the frame data
+        typename ...Args
+      >
+      void coinvoke(Args&&... args) {
+        mSelf.template coinvoke<U, ReturnTag, Logic>(
+          std::forward<Args>(args)...
+        );
+      }
+
+      template <typename ...Args>
+      void coreturn(Args&&... args) {
+        mSelf.coreturn(std::forward<Args>(args)...);
+      }
+
+      template <typename ...Args>
+      void dispatch(uint32_t object_id, Args&&... args) {
+        mSelf.context().dispatch(object_id, std::forward<Args>(args)...);
+      }
+
+      template <typename T, typename ...Args>
+      void create(Args&&... args) {
+        mSelf.context().template create<T>(std::forward<Args>(args)...);
+      }
+
+      uint32_t next_serial() { return mSelf.context().next_serial(); }
+
+      auto const &limits() { return mSelf.context().limits(); }
+
+      auto admit() { return mSelf.context().admit(); }
+
+      void sync(uint32_t callback_id) { mSelf.context().sync(callback_id); }
+
+      State &frame() { return *mSelf; }
+      State const &frame() const { return *mSelf; }
+    };
+
+    template <typename Derived>
+    struct FrameMixin {
+      template <typename StackPointer>
+      using LogicMixin = LogicMixin<Derived, StackPointer>;
+    };
+  }
+}
+
+#endif
@@ -1,16 +1,46 @@
 #ifndef UUID_26FEC1E9_7A51_45A7_AE29_9AC2E40D3CF9
 #define UUID_26FEC1E9_7A51_45A7_AE29_9AC2E40D3CF9
 
+#include <waypositor/detail/scheduling.hpp>
+
+#include <future>
 #include <thread>
 
 namespace waypositor { namespace detail {
+  // Start a thread that applies the policy to itself before running the
+  // function. This waits until the policy has been applied, so that what
+  // took effect can be reported straight away.
+  template <typename Function>
+  std::thread launch(
+    ThreadPolicy policy, Function function, AppliedPolicy &applied
+  ) {
+    std::promise<AppliedPolicy> promise{};
+    auto future = promise.get_future();
+    std::thread thread{
+      [ policy = std::move(policy), function = std::move(function)
+      , promise = std::move(promise)
+      ]() mutable {
+        promise.set_value(detail::apply(policy));
+        function();
+      }
+    };
+    applied = future.get();
+    return thread;
+  }
+
   class RAIIThread {
   private:
+    AppliedPolicy mPolicy;
     std::thread mThread;
   public:
     RAIIThread() = default;
     template <typename ...Args>
     RAIIThread(Args&&... args) : mThread{std::forward<Args>(args)...} {}
+    template <typename Function>
+    RAIIThread(ThreadPolicy policy, Function function)
+      : mPolicy{}
+      , mThread{launch(std::move(policy), std::move(function), mPolicy)}
+    {}
     RAIIThread(RAIIThread const &) = delete;
     RAIIThread &operator=(RAIIThread const &) = delete;
     RAIIThread(RAIIThread &&) = default;
@@ -19,7 +49,8 @@ namespace waypositor { namespace detail {
 
     explicit operator bool() const { return mThread.joinable(); }
     std::thread::id get_id() { return mThread.get_id(); }
+    AppliedPolicy const &policy() const { return mPolicy; }
   };
 }}
 
-#endif
\ No newline at end of file
+#endif
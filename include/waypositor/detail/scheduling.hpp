@@ -0,0 +1,225 @@
+#ifndef UUID_8C2B4E0A_5D1F_4B7E_9A63_2F0D7C41E9B5
+#define UUID_8C2B4E0A_5D1F_4B7E_9A63_2F0D7C41E9B5
+
+#include <waypositor/metrics.hpp>
+
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <sched.h>
+#include <sys/resource.h>
+
+namespace waypositor { namespace detail {
+  // How a thread would like to be scheduled. Each thread role (e.g. "DRAW")
+  // is configured through the environment:
+  //
+  //   WAYPOSITOR_<ROLE>_SCHED  "fifo:<priority>", "rr:<priority>" or "other"
+  //   WAYPOSITOR_<ROLE>_NICE   a nice value, e.g. "-5"
+  //   WAYPOSITOR_<ROLE>_CPUS   a CPU list, e.g. "0,2-3"
+  //
+  // Anything left unset keeps the default.
+  struct ThreadPolicy {
+    enum class Scheduler { DEFAULT, OTHER, FIFO, RR };
+    Scheduler scheduler{Scheduler::DEFAULT};
+    int priority{0};
+    std::optional<int> nice{};
+    std::vector<int> cpus{};
+
+    static ThreadPolicy from_environment(char const *role) {
+      auto variable = [role](char const *setting) -> char const * {
+        std::string name{"WAYPOSITOR_"};
+        name += role;
+        name += "_";
+        name += setting;
+        return std::getenv(name.c_str());
+      };
+
+      ThreadPolicy policy{};
+      if (char const *value = variable("SCHED")) {
+        std::string_view sched{value};
+        auto colon = sched.find(':');
+        auto name = sched.substr(0, colon);
+        if (name == "fifo") policy.scheduler = Scheduler::FIFO;
+        else if (name == "rr") policy.scheduler = Scheduler::RR;
+        else if (name == "other") policy.scheduler = Scheduler::OTHER;
+        if (colon != std::string_view::npos) {
+          policy.priority = std::atoi(value + colon + 1);
+        }
+      }
+      if (char const *value = variable("NICE")) {
+        policy.nice = std::atoi(value);
+      }
+      if (char const *value = variable("CPUS")) {
+        // Comma separated CPUs or ranges of CPUs
+        std::stringstream list{value};
+        std::string item{};
+        while (std::getline(list, item, ',')) {
+          int first = 0, last = 0;
+          char dash = '\0';
+          std::stringstream range{item};
+          if (!(range >> first)) continue;
+          last = first;
+          if (range >> dash && dash == '-') range >> last;
+          for (int cpu = first; cpu <= last; ++cpu) {
+            policy.cpus.push_back(cpu);
+          }
+        }
+      }
+      return policy;
+    }
+  };
+
+  // What actually took effect. Missing privileges (e.g. no CAP_SYS_NICE for
+  // SCHED_FIFO) aren't fatal: the thread carries on with whatever it was
+  // allowed, and the description says what was refused.
+  struct AppliedPolicy {
+    std::string description{"default"};
+    bool degraded{false};
+    // Read back from the thread once it's done, whatever was asked for
+    std::string scheduler{"SCHED_OTHER"};
+    int priority{0};
+    int nice{0};
+    // In the same form as WAYPOSITOR_<ROLE>_CPUS, e.g. "0,2-3"
+    std::string cpus{};
+  };
+
+  inline std::string cpu_list(cpu_set_t const &set) {
+    std::stringstream list{};
+    char const *separator = "";
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (!CPU_ISSET(cpu, &set)) continue;
+      int last = cpu;
+      while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set)) ++last;
+      list << separator << cpu;
+      if (last != cpu) list << "-" << last;
+      separator = ",";
+      cpu = last;
+    }
+    return list.str();
+  }
+
+  // A waypositor_thread_policy sample of 1 for the thread, with its
+  // scheduling in the labels. Threads that come and go take it back off.
+  inline metrics::Gauge &export_policy(
+    metrics::Registry &registry, std::string_view role
+  , AppliedPolicy const &policy
+  ) {
+    std::stringstream labels{};
+    labels << "role=\"" << role << "\",policy=\"" << policy.scheduler
+           << "\",priority=\"" << policy.priority << "\",nice=\""
+           << policy.nice << "\",cpus=\"" << policy.cpus << "\"";
+    metrics::Gauge &gauge = registry.gauge(
+      "waypositor_thread_policy", "How each thread is scheduled", labels.str()
+    );
+    gauge.add(1);
+    return gauge;
+  }
+
+  // Apply a policy to the calling thread
+  inline AppliedPolicy apply(ThreadPolicy const &policy) {
+    AppliedPolicy applied{};
+    std::stringstream description{};
+    auto refused = [&applied, &description](char const *what) {
+      static constexpr std::size_t errno_buffer_size = 256;
+      char buffer[errno_buffer_size]{};
+      applied.degraded = true;
+      description << " (" << what << " refused: "
+                  << strerror_r(errno, buffer, errno_buffer_size) << ")";
+    };
+
+    using Scheduler = ThreadPolicy::Scheduler;
+    if (policy.scheduler != Scheduler::DEFAULT) {
+      int native = SCHED_OTHER;
+      char const *name = "SCHED_OTHER";
+      if (policy.scheduler == Scheduler::FIFO) {
+        native = SCHED_FIFO;
+        name = "SCHED_FIFO";
+      } else if (policy.scheduler == Scheduler::RR) {
+        native = SCHED_RR;
+        name = "SCHED_RR";
+      }
+      sched_param parameters{};
+      parameters.sched_priority =
+        policy.scheduler == Scheduler::OTHER ? 0 : policy.priority;
+      // On Linux a pid of 0 means the calling thread
+      if (sched_setscheduler(0, native, &parameters) == 0) {
+        description << name;
+        if (native != SCHED_OTHER) {
+          description << " priority " << policy.priority;
+        }
+      } else {
+        description << "SCHED_OTHER";
+        refused(name);
+      }
+    } else {
+      description << "SCHED_OTHER";
+    }
+
+    if (policy.nice) {
+      // The nice value is per thread on Linux
+      if (setpriority(PRIO_PROCESS, 0, *policy.nice) == 0) {
+        description << ", nice " << *policy.nice;
+      } else {
+        refused("nice");
+      }
+    }
+
+    if (!policy.cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int cpu : policy.cpus) CPU_SET(cpu, &set);
+      if (sched_setaffinity(0, sizeof(set), &set) == 0) {
+        description << ", cpus";
+        char separator = ' ';
+        for (int cpu : policy.cpus) {
+          description << separator << cpu;
+          separator = ',';
+        }
+      } else {
+        refused("cpu affinity");
+      }
+    }
+
+    applied.description = description.str();
+
+    switch (sched_getscheduler(0)) {
+    case SCHED_FIFO:
+      applied.scheduler = "SCHED_FIFO";
+      break;
+    case SCHED_RR:
+      applied.scheduler = "SCHED_RR";
+      break;
+    case SCHED_BATCH:
+      applied.scheduler = "SCHED_BATCH";
+      break;
+    case SCHED_IDLE:
+      applied.scheduler = "SCHED_IDLE";
+      break;
+    default:
+      break;
+    }
+    sched_param parameters{};
+    if (sched_getparam(0, &parameters) == 0) {
+      applied.priority = parameters.sched_priority;
+    }
+    // -1 is a valid nice value, so errno tells the failures apart
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, 0);
+    if (errno == 0) applied.nice = nice;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      applied.cpus = cpu_list(set);
+    }
+    return applied;
+  }
+}}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef UUID_B216A081_47C3_49F5_A2FB_B04E71726ECE
+#define UUID_B216A081_47C3_49F5_A2FB_B04E71726ECE
+
+#include <array>
+#include <atomic>
+
+namespace waypositor { namespace detail {
+  // Hands values from one writer thread to one reader thread without either
+  // of them ever waiting. The writer fills in the back slot and publishes
+  // it; the reader picks up whatever was published last (skipping anything
+  // it was too slow to see).
+  template <typename T>
+  class TripleBuffer final {
+  private:
+    // The low bits of mMiddle index the slot in the middle. The fresh bit
+    // says the reader hasn't picked it up yet.
+    static constexpr unsigned char INDEX = 0x3;
+    static constexpr unsigned char FRESH = 0x4;
+
+    std::array<T, 3> mSlots;
+    std::atomic<unsigned char> mMiddle;
+    // Only touched by the writer
+    unsigned char mBack;
+    // Only touched by the reader
+    unsigned char mFront;
+  public:
+    TripleBuffer() : mSlots{}, mMiddle{1}, mBack{0}, mFront{2} {}
+    TripleBuffer(TripleBuffer const &) = delete;
+    TripleBuffer &operator=(TripleBuffer const &) = delete;
+
+    // Writer only
+    T &back() { return mSlots[mBack]; }
+
+    // Writer only. Swaps the back slot into the middle.
+    void publish() {
+      mBack = mMiddle.exchange(mBack | FRESH, std::memory_order_acq_rel)
+            & INDEX;
+    }
+
+    // Reader only. Swaps the middle slot to the front if something was
+    // published since last time, and says whether it did.
+    bool update() {
+      if (!(mMiddle.load(std::memory_order_relaxed) & FRESH)) return false;
+      mFront = mMiddle.exchange(mFront, std::memory_order_acq_rel) & INDEX;
+      return true;
+    }
+
+    // Reader only
+    T &front() { return mSlots[mFront]; }
+    T const &front() const { return mSlots[mFront]; }
+  };
+}}
+
+#endif
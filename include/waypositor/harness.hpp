@@ -0,0 +1,180 @@
+#ifndef UUID_7C0E2B5A_3D91_4F6B_A8E4_91C25D6F0B37
+#define UUID_7C0E2B5A_3D91_4F6B_A8E4_91C25D6F0B37
+
+#include <waypositor/protocol.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace waypositor { namespace harness {
+  // The client side of an in-process connection, for driving a Server from
+  // benchmarks without going through the filesystem. Everything blocks, and
+  // a Client belongs to one thread; the server runs on its own.
+  class Client final {
+  private:
+    // Only the socket lives on it; nothing ever runs
+    asio::io_service mAsio;
+    Domain::socket mSocket;
+    uint32_t mNextId;
+    std::vector<uint32_t> mOutgoing;
+    // Sent along with the outgoing requests. The caller owns them.
+    std::vector<int> mFds;
+    // Kept in words so that messages stay aligned. The offsets are in bytes.
+    std::vector<uint32_t> mIncoming;
+    std::size_t mBegin;
+    std::size_t mEnd;
+    bool mValid;
+
+    unsigned char *bytes() {
+      return reinterpret_cast<unsigned char *>(mIncoming.data());
+    }
+
+    bool fill() {
+      if (mBegin > 0) {
+        std::memmove(this->bytes(), this->bytes() + mBegin, mEnd - mBegin);
+        mEnd -= mBegin;
+        mBegin = 0;
+      }
+      if (mEnd == mIncoming.size() * sizeof(uint32_t)) {
+        mIncoming.resize(mIncoming.size() * 2);
+      }
+      boost::system::error_code error{};
+      std::size_t read = mSocket.read_some(asio::buffer(
+        this->bytes() + mEnd, mIncoming.size() * sizeof(uint32_t) - mEnd
+      ), error);
+      if (error) return mValid = false;
+      mEnd += read;
+      return true;
+    }
+
+    // The next event, with its object id. It's valid until the next read.
+    std::optional<std::pair<uint32_t, Message>> next() {
+      while (mEnd - mBegin < 8) {
+        if (!this->fill()) return std::nullopt;
+      }
+      uint32_t header[2];
+      std::memcpy(header, this->bytes() + mBegin, sizeof(header));
+      std::size_t size = header[1] >> 16;
+      if (size < 8 || size % 4 != 0) {
+        mValid = false;
+        return std::nullopt;
+      }
+      while (mEnd - mBegin < size) {
+        if (!this->fill()) return std::nullopt;
+      }
+      auto words = mIncoming.data() + mBegin / sizeof(uint32_t);
+      mBegin += size;
+      return std::make_pair(header[0], Message{
+        static_cast<uint16_t>(header[1] & 0xffff), words + 2, (size - 8) / 4
+      });
+    }
+
+  public:
+    explicit Client(Server &server)
+      : mAsio{}, mSocket{server.connect(mAsio)}, mNextId{2}, mOutgoing{}
+      , mFds{}, mIncoming(1024), mBegin{0}, mEnd{0}, mValid{true}
+    {}
+
+    // False once the server has hung up or sent something unreadable
+    explicit operator bool() const { return mValid; }
+
+    // Ids are never reused, so there are plenty but not endlessly many
+    uint32_t new_id() { return mNextId++; }
+
+    // Queued until the next flush
+    void request(Event const &event) { event.append_to(mOutgoing); }
+
+    // For a request with an fd argument. The fd is sent, not given away.
+    void request(Event const &event, int fd) {
+      this->request(event);
+      mFds.push_back(fd);
+    }
+
+    bool flush() {
+      if (mOutgoing.empty()) return mValid;
+      auto bytes = asio::buffer(mOutgoing);
+      if (!mFds.empty()) {
+        // They go along with the first of the bytes
+        std::vector<char> control(CMSG_SPACE(mFds.size() * sizeof(int)));
+        iovec iov{bytes.data(), bytes.size()};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(mFds.size() * sizeof(int));
+        std::memcpy(CMSG_DATA(header), mFds.data(), mFds.size() * sizeof(int));
+        ssize_t sent;
+        do {
+          sent = ::sendmsg(mSocket.native_handle(), &message, MSG_NOSIGNAL);
+        } while (sent < 0 && errno == EINTR);
+        mFds.clear();
+        if (sent < 0) {
+          mOutgoing.clear();
+          return mValid = false;
+        }
+        bytes += static_cast<std::size_t>(sent);
+      }
+      boost::system::error_code error{};
+      asio::write(mSocket, bytes, error);
+      mOutgoing.clear();
+      if (error) mValid = false;
+      return mValid;
+    }
+
+    // Whether there's room to write without waiting, once there is or the
+    // timeout's up. A server that's stopped reading takes a while to make
+    // room again.
+    bool writable(std::chrono::milliseconds timeout) {
+      pollfd fd{mSocket.native_handle(), POLLOUT, 0};
+      return ::poll(&fd, 1, static_cast<int>(timeout.count())) > 0;
+    }
+
+    // Sends everything queued, and hands every event that comes back to the
+    // handler as (object id, Message &) until it returns true. False if the
+    // connection broke on the way; a protocol error from the server is just
+    // another event.
+    template <typename Handler>
+    bool until(Handler &&handler) {
+      if (!this->flush()) return false;
+      while (auto event = this->next()) {
+        auto &[object, message] = *event;
+        if (handler(object, message)) return true;
+      }
+      return false;
+    }
+
+    // Sends everything queued with a wl_display.sync behind it, and hands
+    // every event that comes back before the sync's done to the handler
+    template <typename Handler>
+    bool roundtrip(Handler &&handler) {
+      uint32_t callback = this->new_id();
+      this->request(Event{1, 0}.uint(callback));
+      return this->until([&](uint32_t object, Message &message) {
+        if (object == callback && message.opcode() == 0) return true;
+        handler(object, message);
+        return false;
+      });
+    }
+
+    bool roundtrip() {
+      return this->roundtrip([](uint32_t, Message &) {});
+    }
+  };
+}}
+
+#endif
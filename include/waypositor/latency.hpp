@@ -0,0 +1,317 @@
+#ifndef UUID_E3A1C6F2_58B4_4D0E_9C27_6B0F4D8A21E5
+#define UUID_E3A1C6F2_58B4_4D0E_9C27_6B0F4D8A21E5
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace waypositor { namespace latency {
+  using Clock = std::chrono::steady_clock;
+
+  // Log-linear buckets in nanoseconds, in the manner of HdrHistogram: exact
+  // below 32ns, then 16 buckets per power of two, so any value is off by
+  // at most 1/16th. Anything past 2^48ns (about three days) goes in the last
+  // bucket.
+  constexpr unsigned SUB_BITS = 5;
+  constexpr uint64_t SUB = 1u << SUB_BITS;
+  constexpr uint64_t HALF = SUB / 2;
+  constexpr unsigned MAX_BITS = 48;
+  constexpr std::size_t BUCKETS = SUB + (MAX_BITS - SUB_BITS) * HALF;
+
+  constexpr std::size_t bucket(uint64_t value) {
+    if (value < SUB) return static_cast<std::size_t>(value);
+    if (value >> MAX_BITS) return BUCKETS - 1;
+    unsigned shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+    return SUB + (shift - 1) * HALF + ((value >> shift) - HALF);
+  }
+
+  // The largest value that lands in the bucket
+  constexpr uint64_t highest(std::size_t index) {
+    if (index < SUB) return index;
+    std::size_t offset = index - SUB;
+    unsigned shift = static_cast<unsigned>(offset / HALF) + 1;
+    return ((HALF + offset % HALF + 1) << shift) - 1;
+  }
+
+  static_assert(bucket(highest(BUCKETS - 1)) == BUCKETS - 1);
+  static_assert(bucket(highest(SUB)) == SUB);
+  static_assert(bucket(highest(SUB) + 1) == SUB + 1);
+
+  // What the time is of
+  enum class Kind : uint8_t {
+    // From the request's header being decoded to its handler returning
+    HANDLER
+    // From the request to the client being sent its answer
+  , REPLY
+  };
+
+  // Requests are told apart by interface and opcode. Interfaces are string
+  // literals, so within a thread they're compared by address.
+  struct Key {
+    char const *interface;
+    uint16_t opcode;
+    Kind kind;
+
+    bool operator==(Key const &other) const {
+      return interface == other.interface && opcode == other.opcode
+          && kind == other.kind;
+    }
+  };
+
+  // Written by one thread only, and read by any
+  class Histogram final {
+  private:
+    std::array<std::atomic<uint64_t>, BUCKETS> mCounts{};
+    std::atomic<uint64_t> mMax{0};
+
+    static void bump(std::atomic<uint64_t> &counter, uint64_t by) {
+      // There's a single writer, so this needn't be a locked add
+      counter.store(
+        counter.load(std::memory_order_relaxed) + by
+      , std::memory_order_relaxed
+      );
+    }
+
+  public:
+    void record(uint64_t nanoseconds) {
+      bump(mCounts[bucket(nanoseconds)], 1);
+      if (nanoseconds > mMax.load(std::memory_order_relaxed)) {
+        mMax.store(nanoseconds, std::memory_order_relaxed);
+      }
+    }
+
+    friend class Snapshot;
+  };
+
+  // Histograms added together, at some point in time
+  class Snapshot final {
+  private:
+    std::array<uint64_t, BUCKETS> mCounts{};
+    uint64_t mCount{0};
+    uint64_t mMax{0};
+
+  public:
+    Snapshot &operator+=(Histogram const &histogram) {
+      for (std::size_t i = 0; i < BUCKETS; ++i) {
+        uint64_t count = histogram.mCounts[i].load(std::memory_order_relaxed);
+        mCounts[i] += count;
+        mCount += count;
+      }
+      mMax = std::max(mMax, histogram.mMax.load(std::memory_order_relaxed));
+      return *this;
+    }
+
+    Snapshot &operator+=(Snapshot const &other) {
+      for (std::size_t i = 0; i < BUCKETS; ++i) mCounts[i] += other.mCounts[i];
+      mCount += other.mCount;
+      mMax = std::max(mMax, other.mMax);
+      return *this;
+    }
+
+    uint64_t count() const { return mCount; }
+    uint64_t max() const { return mMax; }
+
+    // In nanoseconds, for a fraction between 0 and 1
+    uint64_t percentile(double fraction) const {
+      if (mCount == 0) return 0;
+      auto wanted = static_cast<uint64_t>(fraction * mCount + 0.5);
+      wanted = std::clamp<uint64_t>(wanted, 1, mCount);
+      uint64_t seen = 0;
+      for (std::size_t i = 0; i < BUCKETS; ++i) {
+        seen += mCounts[i];
+        if (seen >= wanted) return std::min(highest(i), mMax);
+      }
+      return mMax;
+    }
+
+    // Roughly, from the bucket each value landed in
+    uint64_t total() const {
+      uint64_t total = 0;
+      for (std::size_t i = 0; i < BUCKETS; ++i) {
+        total += mCounts[i] * highest(i);
+      }
+      return total;
+    }
+
+    // Bucket upper bounds and counts, for whoever wants the whole shape
+    template <typename Visitor>
+    void each(Visitor &&visitor) const {
+      for (std::size_t i = 0; i < BUCKETS; ++i) {
+        if (mCounts[i] > 0) visitor(highest(i), mCounts[i]);
+      }
+    }
+  };
+
+  // Collects per-request timings from any number of threads. Each thread
+  // records into histograms of its own, without locking once a key has
+  // been seen; they're only added up when someone asks.
+  class Recorder final {
+  private:
+    struct KeyHash {
+      std::size_t operator()(Key const &key) const {
+        return std::hash<void const *>{}(key.interface)
+             ^ (std::size_t{key.opcode} << 1)
+             ^ (static_cast<std::size_t>(key.kind) << 17);
+      }
+    };
+
+    struct Shard {
+      // Only the owning thread changes the map, and it only takes the lock
+      // to do so. Readers always take it.
+      std::mutex mutex{};
+      std::unordered_map<
+        Key, std::unique_ptr<Histogram>, KeyHash
+      > histograms{};
+    };
+
+    // Told apart from any recorder that used to live at the same address
+    uint64_t mSerial;
+    mutable std::mutex mMutex{};
+    std::vector<std::unique_ptr<Shard>> mShards{};
+
+    static uint64_t next_serial() {
+      static std::atomic<uint64_t> serial{0};
+      return ++serial;
+    }
+
+    Shard &shard() {
+      thread_local uint64_t last = 0;
+      thread_local Shard *cached = nullptr;
+      if (last == mSerial) return *cached;
+
+      thread_local std::unordered_map<uint64_t, Shard *> shards{};
+      auto it = shards.find(mSerial);
+      if (it == shards.end()) {
+        auto lock = std::lock_guard(mMutex);
+        mShards.push_back(std::make_unique<Shard>());
+        it = shards.emplace(mSerial, mShards.back().get()).first;
+      }
+      last = mSerial;
+      cached = it->second;
+      return *cached;
+    }
+
+  public:
+    Recorder() : mSerial{next_serial()} {}
+    Recorder(Recorder const &) = delete;
+    Recorder &operator=(Recorder const &) = delete;
+
+    void record(Key const &key, Clock::duration duration) {
+      Shard &shard = this->shard();
+      auto it = shard.histograms.find(key);
+      if (it == shard.histograms.end()) {
+        auto lock = std::lock_guard(shard.mutex);
+        it = shard.histograms.emplace(
+          key, std::make_unique<Histogram>()
+        ).first;
+      }
+      auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        duration
+      ).count();
+      it->second->record(static_cast<uint64_t>(std::max<int64_t>(
+        0, nanoseconds
+      )));
+    }
+
+    using Name = std::tuple<std::string_view, uint16_t, Kind>;
+
+    // Every thread's histograms, added up by interface name and opcode
+    std::map<Name, Snapshot> snapshot() const {
+      std::map<Name, Snapshot> result{};
+      auto lock = std::lock_guard(mMutex);
+      for (auto const &shard : mShards) {
+        auto shard_lock = std::lock_guard(shard->mutex);
+        for (auto const &[key, histogram] : shard->histograms) {
+          result[{key.interface, key.opcode, key.kind}] += *histogram;
+        }
+      }
+      return result;
+    }
+  };
+
+  // A summary family in the Prometheus text format, in seconds
+  inline void expose(
+    std::ostream &out, std::map<Recorder::Name, Snapshot> const &snapshot
+  ) {
+    char const *name = "waypositor_request_seconds";
+    out << "# HELP " << name << " Time taken by requests\n"
+        << "# TYPE " << name << " summary\n";
+    for (auto const &[key, histogram] : snapshot) {
+      auto const &[interface, opcode, kind] = key;
+      std::ostringstream labels{};
+      labels << "interface=\"" << interface << "\",opcode=\"" << opcode
+             << "\",kind=\"" << (kind == Kind::REPLY ? "reply" : "handler")
+             << "\"";
+      for (double quantile : {0.5, 0.9, 0.99, 0.999}) {
+        out << name << "{" << labels.str() << ",quantile=\"" << quantile
+            << "\"} " << histogram.percentile(quantile) / 1e9 << "\n";
+      }
+      out << name << "_sum{" << labels.str() << "} "
+          << histogram.total() / 1e9 << "\n"
+          << name << "_count{" << labels.str() << "} "
+          << histogram.count() << "\n";
+    }
+  }
+
+  // A table, busiest first, with times in microseconds
+  inline void print(
+    std::ostream &out, std::map<Recorder::Name, Snapshot> const &snapshot
+  ) {
+    std::vector<std::pair<Recorder::Name, Snapshot const *>> rows{};
+    for (auto const &[name, histogram] : snapshot) {
+      rows.emplace_back(name, &histogram);
+    }
+    std::stable_sort(
+      rows.begin(), rows.end()
+    , [](auto const &a, auto const &b) {
+        return a.second->total() > b.second->total();
+      }
+    );
+
+    auto flags = out.flags();
+    auto precision = out.precision();
+    out << std::left << std::setw(32) << "request"
+        << std::right << std::setw(10) << "count"
+        << std::setw(10) << "p50"
+        << std::setw(10) << "p90"
+        << std::setw(10) << "p99"
+        << std::setw(10) << "p99.9"
+        << std::setw(10) << "max"
+        << std::setw(12) << "total ms" << "\n";
+    out << std::fixed << std::setprecision(1);
+    for (auto const &[name, histogram] : rows) {
+      auto const &[interface, opcode, kind] = name;
+      std::string label{interface};
+      label += "." + std::to_string(opcode);
+      if (kind == Kind::REPLY) label += " reply";
+      auto us = [](uint64_t nanoseconds) { return nanoseconds / 1000.0; };
+      out << std::left << std::setw(32) << label
+          << std::right << std::setw(10) << histogram->count()
+          << std::setw(10) << us(histogram->percentile(0.5))
+          << std::setw(10) << us(histogram->percentile(0.9))
+          << std::setw(10) << us(histogram->percentile(0.99))
+          << std::setw(10) << us(histogram->percentile(0.999))
+          << std::setw(10) << us(histogram->max())
+          << std::setw(12) << histogram->total() / 1e6 << "\n";
+    }
+    out.flags(flags);
+    out.precision(precision);
+  }
+}}
+
+#endif
@@ -2,9 +2,14 @@
 #define UUID_41EEDDB2_BBF7_4710_92EB_432DE7EE73F0
 
 #include <waypositor/detail/raiithread.hpp>
+#include <waypositor/loop.hpp>
+#include <waypositor/metrics.hpp>
 
 #include <boost/asio/io_service.hpp>
 
+#include <chrono>
+#include <cstdlib>
+#include <functional>
 #include <mutex>
 #include <iostream>
 #include <optional>
@@ -22,6 +27,13 @@ namespace waypositor {
     std::mutex mMutex;
     std::unordered_map<std::thread::id, std::string> mNameLookup;
     detail::RAIIThread mThread;
+    // Set WAYPOSITOR_TRACE for messages about every request
+    bool mTracing;
+    // Only there once instrumented
+    metrics::Counter *mInfos{nullptr};
+    metrics::Counter *mErrors{nullptr};
+    metrics::Gauge *mBacklog{nullptr};
+    loop::Monitor *mMonitor{nullptr};
 
     template <bool flush, typename ...Messages>
     static void print_helper(std::ostream &ostream, Messages&&... messages) {
@@ -45,17 +57,35 @@ namespace waypositor {
 
     void stop() { mASIO.post([this] { mWork = std::nullopt; }); }
 
+    template <typename ...Messages>
+    void print(std::thread::id thread_id, Messages&&... messages) {
+      std::lock_guard lock{mMutex};
+      print_helper<false>(
+        std::cout, "[", thread_name(thread_id), "] "
+      , std::forward<Messages>(messages)...
+      );
+    }
+
+    static double milliseconds(loop::Clock::duration duration) {
+      return std::chrono::duration<double, std::milli>{duration}.count();
+    }
+
   public:
     Logger(std::string main_thread_name)
       : mASIO{}
       , mWork{mASIO}
       , mMutex{}
       , mNameLookup{}
-      , mThread{[this] { mASIO.run(); }}
+      , mThread{
+          detail::ThreadPolicy::from_environment("LOGGER")
+        , [this] { mASIO.run(); }
+        }
+      , mTracing{std::getenv("WAYPOSITOR_TRACE") != nullptr}
     {
       this->register_thread(
         std::this_thread::get_id(), std::move(main_thread_name)
       );
+      this->info("Logger thread scheduling: ", mThread.policy().description);
     }
     ~Logger() { this->stop(); }
 
@@ -69,10 +99,49 @@ namespace waypositor {
       mNameLookup.erase(id);
     }
 
+    // Count what goes through the log. Call this before any other thread
+    // logs.
+    void instrument(metrics::Registry &registry) {
+      detail::export_policy(registry, "Logger", mThread.policy());
+      char const *help = "Messages logged, by level";
+      mInfos = &registry.counter(
+        "waypositor_log_messages_total", help, "level=\"info\""
+      );
+      mErrors = &registry.counter(
+        "waypositor_log_messages_total", help, "level=\"error\""
+      );
+      mBacklog = &registry.gauge(
+        "waypositor_log_backlog", "Messages waiting for the log thread"
+      );
+      // Reported straight from the log thread, rather than through itself
+      mMonitor = &loop::Monitor::install(
+        mASIO, registry, "Logger", [this](loop::Slow const &slow) {
+          std::lock_guard lock{mMutex};
+          print_helper<false>(
+            std::cout, "[Logger] Slow handler: ", slow.handler, " ran "
+          , milliseconds(slow.ran), "ms after waiting "
+          , milliseconds(slow.waited), "ms"
+          );
+        }
+      );
+    }
+
+    // For other loops' monitors: slow handlers go to the log
+    std::function<void(loop::Slow const &)> slow_handlers() {
+      return [this](loop::Slow const &slow) {
+        this->info(
+          "Slow handler on ", std::string{slow.loop}, ": "
+        , std::string{slow.handler}, " ran ", milliseconds(slow.ran)
+        , "ms after waiting ", milliseconds(slow.waited), "ms"
+        );
+      };
+    }
+
     // This is immediate. It's slower, but it shouldn't be running under normal
     // operation. Error messages won't be lost in the event of a crash.
     template <typename ...Messages>
     void error(Messages&&... messages) {
+      if (mErrors) mErrors->add();
       std::lock_guard lock{mMutex};
       print_helper<true>(
         std::cerr
@@ -88,20 +157,27 @@ namespace waypositor {
       this->error(messages..., ": ", buffer);
     }
 
+    // Like info, but only when tracing. Otherwise nothing is formatted or
+    // queued.
+    template <typename ...Messages>
+    void trace(Messages&&... messages) {
+      if (mTracing) this->info(std::forward<Messages>(messages)...);
+    }
+
     // This queues messages to run on the log thread.
     template <typename ...Messages>
     void info(Messages... messages) {
       auto thread_id = std::this_thread::get_id();
-      mASIO.post([
-        this, thread_id = std::move(thread_id)
+      if (mInfos) mInfos->add();
+      if (mBacklog) mBacklog->add();
+      loop::post(mMonitor, mASIO, [
+        this, thread_id = std::move(thread_id), backlog = mBacklog
       , messages = std::make_tuple(std::move(messages)...)
       ]() {
+        if (backlog) backlog->sub();
         std::apply(
           [this, &thread_id](auto&&... messages_) {
-            std::lock_guard lock{mMutex};
-            print_helper<false>(
-              std::cout, "[", thread_name(thread_id), "] ", messages_...
-            );
+            this->print(thread_id, messages_...);
           }
         , messages
         );
@@ -0,0 +1,206 @@
+#ifndef UUID_2D6C94E1_B7A3_4F58_9E02_C5F18A3D7B64
+#define UUID_2D6C94E1_B7A3_4F58_9E02_C5F18A3D7B64
+
+#include <waypositor/metrics.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <typeinfo>
+#include <utility>
+
+#include <cxxabi.h>
+
+#include <boost/asio/associated_allocator.hpp>
+#include <boost/asio/execution_context.hpp>
+#include <boost/asio/io_service.hpp>
+
+namespace waypositor { namespace loop {
+  namespace asio = boost::asio;
+  using Clock = std::chrono::steady_clock;
+
+  // What a slow handler gets reported as
+  struct Slow {
+    std::string_view loop;
+    std::string_view handler;
+    // From being posted to starting. Zero for completion handlers, which
+    // wait on I/O rather than on the loop.
+    Clock::duration waited;
+    Clock::duration ran;
+  };
+
+  // Readable, and only worked out once per type. Template arguments are
+  // left out; the coroutine stacks would otherwise go on for lines.
+  template <typename T>
+  std::string const &type_name() {
+    static std::string const name = [] {
+      int status = 0;
+      std::unique_ptr<char, void (*)(void *)> demangled{
+        abi::__cxa_demangle(typeid(T).name(), nullptr, nullptr, &status)
+      , std::free
+      };
+      if (status != 0) return std::string{typeid(T).name()};
+      std::string result{};
+      std::size_t depth = 0;
+      for (char const *c = demangled.get(); *c; ++c) {
+        if (*c == '<' && depth++ == 0) result += "<...>";
+        if (depth == 0) result += *c;
+        if (*c == '>' && depth > 0) --depth;
+      }
+      return result;
+    }();
+    return name;
+  }
+
+  class Monitor;
+
+  // A handler that times itself for its loop's monitor
+  template <typename Handler>
+  class Timed final {
+  private:
+    Monitor *mMonitor;
+    // Unset for completion handlers
+    Clock::time_point mPosted;
+    Handler mHandler;
+  public:
+    Timed(Monitor &monitor, Clock::time_point posted, Handler handler)
+      : mMonitor{&monitor}, mPosted{posted}, mHandler{std::move(handler)}
+    {}
+    // Declared but not defined, so that move-only handlers get through asio
+    Timed(Timed const &);
+    Timed &operator=(Timed const &);
+    Timed(Timed &&) = default;
+    Timed &operator=(Timed &&) = default;
+
+    // Allocated like the handler would have been
+    using allocator_type = asio::associated_allocator_t<Handler>;
+    allocator_type get_allocator() const noexcept {
+      return asio::get_associated_allocator(mHandler);
+    }
+
+    template <typename ...Args>
+    void operator()(Args&&... args);
+  };
+
+  // Times the handlers run on one io_service: how long they waited to run
+  // once posted, and how long they ran for. Lives as a service of the
+  // io_service, so anything with the io_service can find it. Only handlers
+  // that go through it are timed.
+  class Monitor final : public asio::io_service::service {
+  private:
+    std::string mName{};
+    Clock::duration mThreshold{};
+    std::function<void(Slow const &)> mReport{};
+    metrics::Histogram *mWaited{nullptr};
+    metrics::Histogram *mRan{nullptr};
+    metrics::Counter *mSlow{nullptr};
+
+    static Clock::duration default_threshold() {
+      // A quarter of a frame at 60Hz
+      Clock::duration threshold = std::chrono::milliseconds{4};
+      if (char const *value = std::getenv("WAYPOSITOR_SLOW_HANDLER_US")) {
+        threshold = std::chrono::microseconds{std::atoll(value)};
+      }
+      return threshold;
+    }
+
+  public:
+    static inline asio::execution_context::id id{};
+
+    // Only for asio; see install()
+    explicit Monitor(asio::io_service &asio)
+      : asio::io_service::service{asio}
+    {}
+
+    void shutdown() override {}
+
+    // Watch an io_service. Do this before anything looks for the monitor,
+    // i.e. before the io_service is in use. Slow handlers are passed to the
+    // report function on the loop's own thread.
+    static Monitor &install(
+      asio::io_service &asio, metrics::Registry &registry, std::string name
+    , std::function<void(Slow const &)> report
+    , Clock::duration threshold = default_threshold()
+    ) {
+      // The io_service owns it
+      auto &monitor = asio::use_service<Monitor>(asio);
+      std::string labels = "loop=\"" + name + "\"";
+      monitor.mName = std::move(name);
+      monitor.mThreshold = threshold;
+      monitor.mReport = std::move(report);
+      monitor.mWaited = &registry.histogram(
+        "waypositor_loop_wait_seconds"
+      , "From a handler being posted to it running", labels
+      );
+      monitor.mRan = &registry.histogram(
+        "waypositor_loop_handler_seconds", "How long handlers ran for", labels
+      );
+      monitor.mSlow = &registry.counter(
+        "waypositor_loop_slow_handlers_total"
+      , "Handlers that ran for longer than the threshold", labels
+      );
+      return monitor;
+    }
+
+    // Null if nobody is watching. This takes a lock, so look once and keep
+    // the answer.
+    static Monitor *find(asio::io_service &asio) {
+      if (!asio::has_service<Monitor>(asio)) return nullptr;
+      return &asio::use_service<Monitor>(asio);
+    }
+
+    // For handlers about to be posted
+    template <typename Handler>
+    Timed<std::decay_t<Handler>> posted(Handler &&handler) {
+      return {*this, Clock::now(), std::forward<Handler>(handler)};
+    }
+
+    // For completion handlers, where only the running time says anything
+    // about the loop
+    template <typename Handler>
+    Timed<std::decay_t<Handler>> completion(Handler &&handler) {
+      return {*this, Clock::time_point{}, std::forward<Handler>(handler)};
+    }
+
+    template <typename Handler>
+    void ran(
+      Clock::time_point posted, Clock::time_point start, Clock::time_point end
+    ) {
+      Clock::duration waited{};
+      if (posted != Clock::time_point{}) {
+        waited = start - posted;
+        mWaited->record(waited);
+      }
+      Clock::duration ran = end - start;
+      mRan->record(ran);
+      if (ran < mThreshold) return;
+      mSlow->add();
+      if (mReport) mReport(Slow{mName, type_name<Handler>(), waited, ran});
+    }
+  };
+
+  template <typename Handler>
+  template <typename ...Args>
+  void Timed<Handler>::operator()(Args&&... args) {
+    auto start = Clock::now();
+    // The handler may hand itself on (i.e. move itself away), but this
+    // wrapper stays put until it returns
+    mHandler(std::forward<Args>(args)...);
+    mMonitor->template ran<Handler>(mPosted, start, Clock::now());
+  }
+
+  // Post to an io_service, timed if there's a monitor
+  template <typename Handler>
+  void post(Monitor *monitor, asio::io_service &asio, Handler &&handler) {
+    if (monitor) {
+      asio.post(monitor->posted(std::forward<Handler>(handler)));
+    } else {
+      asio.post(std::forward<Handler>(handler));
+    }
+  }
+}}
+
+#endif
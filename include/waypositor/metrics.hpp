@@ -0,0 +1,283 @@
+#ifndef UUID_5B8D2F47_1C6E_4A93_B0D5_8E24F7A6C913
+#define UUID_5B8D2F47_1C6E_4A93_B0D5_8E24F7A6C913
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace waypositor { namespace metrics {
+  // Every thread records into one of these, so that threads seldom share
+  // a cache line. More threads than shards just share some.
+  constexpr std::size_t SHARDS = 16;
+
+  inline std::size_t shard() {
+    static std::atomic<std::size_t> next{0};
+    thread_local std::size_t index =
+      next.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+    return index;
+  }
+
+  namespace detail {
+    template <typename T>
+    struct alignas(64) Slot {
+      std::atomic<T> value{0};
+    };
+  }
+
+  // Only ever goes up
+  class Counter final {
+  private:
+    std::array<detail::Slot<uint64_t>, SHARDS> mSlots{};
+  public:
+    void add(uint64_t by = 1) {
+      mSlots[shard()].value.fetch_add(by, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+      uint64_t total = 0;
+      for (auto const &slot : mSlots) {
+        total += slot.value.load(std::memory_order_relaxed);
+      }
+      return total;
+    }
+  };
+
+  // Goes up and down, possibly on different threads
+  class Gauge final {
+  private:
+    std::array<detail::Slot<int64_t>, SHARDS> mSlots{};
+  public:
+    void add(int64_t by = 1) {
+      mSlots[shard()].value.fetch_add(by, std::memory_order_relaxed);
+    }
+
+    void sub(int64_t by = 1) { this->add(-by); }
+
+    int64_t value() const {
+      int64_t total = 0;
+      for (auto const &slot : mSlots) {
+        total += slot.value.load(std::memory_order_relaxed);
+      }
+      return total;
+    }
+  };
+
+  // Durations, in buckets from a microsecond to ten seconds
+  class Histogram final {
+  public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr std::array<uint64_t, 22> BOUNDS{
+      1'000, 2'500, 5'000, 10'000, 25'000, 50'000, 100'000, 250'000
+    , 500'000, 1'000'000, 2'500'000, 5'000'000, 10'000'000, 25'000'000
+    , 50'000'000, 100'000'000, 250'000'000, 500'000'000, 1'000'000'000
+    , 2'500'000'000, 5'000'000'000, 10'000'000'000
+    };
+
+  private:
+    struct alignas(64) Shard {
+      // The last one is for anything past the last bound
+      std::array<std::atomic<uint64_t>, BOUNDS.size() + 1> counts{};
+      std::atomic<uint64_t> sum{0};
+    };
+    std::array<Shard, SHARDS> mShards{};
+
+  public:
+    void record(Clock::duration duration) {
+      auto nanoseconds = static_cast<uint64_t>(std::max<int64_t>(
+        0, std::chrono::duration_cast<std::chrono::nanoseconds>(
+          duration
+        ).count()
+      ));
+      std::size_t bucket = static_cast<std::size_t>(
+        std::lower_bound(BOUNDS.begin(), BOUNDS.end(), nanoseconds)
+      - BOUNDS.begin()
+      );
+      Shard &shard = mShards[metrics::shard()];
+      shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+      shard.sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+    }
+
+    // Per bucket, not cumulative. The sum is in nanoseconds.
+    std::pair<std::array<uint64_t, BOUNDS.size() + 1>, uint64_t>
+    values() const {
+      std::pair<std::array<uint64_t, BOUNDS.size() + 1>, uint64_t> result{};
+      for (Shard const &shard : mShards) {
+        for (std::size_t i = 0; i < shard.counts.size(); ++i) {
+          result.first[i] += shard.counts[i].load(std::memory_order_relaxed);
+        }
+        result.second += shard.sum.load(std::memory_order_relaxed);
+      }
+      return result;
+    }
+  };
+
+  // Owns every metric, so that they live as long as anything may record into
+  // them. Metrics are made up front; recording never touches the registry,
+  // and scraping only ever reads.
+  class Registry final {
+  private:
+    using Metric = std::variant<
+      std::unique_ptr<Counter>, std::unique_ptr<Gauge>
+    , std::unique_ptr<Histogram>
+    >;
+
+    struct Entry {
+      std::string name;
+      std::string help;
+      // Prometheus label pairs without the braces, e.g. crtc="41"
+      std::string labels;
+      Metric metric;
+    };
+
+    mutable std::mutex mMutex{};
+    std::vector<Entry> mEntries{};
+    std::vector<std::function<void(std::ostream &)>> mCollectors{};
+
+    template <typename T>
+    T &make(std::string name, std::string help, std::string labels) {
+      auto lock = std::lock_guard(mMutex);
+      for (Entry &entry : mEntries) {
+        if (entry.name != name || entry.labels != labels) continue;
+        auto existing = std::get_if<std::unique_ptr<T>>(&entry.metric);
+        assert(existing != nullptr);
+        return **existing;
+      }
+      auto metric = std::make_unique<T>();
+      T &result = *metric;
+      mEntries.push_back(Entry{
+        std::move(name), std::move(help), std::move(labels)
+      , std::move(metric)
+      });
+      return result;
+    }
+
+    static void sample(
+      std::ostream &out, std::string const &name, std::string const &labels
+    , std::string const &extra
+    ) {
+      out << name;
+      if (!labels.empty() || !extra.empty()) {
+        out << "{" << labels;
+        if (!labels.empty() && !extra.empty()) out << ",";
+        out << extra << "}";
+      }
+      out << " ";
+    }
+
+  public:
+    Registry() = default;
+    Registry(Registry const &) = delete;
+    Registry &operator=(Registry const &) = delete;
+
+    // Asking again for the same name and labels gives the same metric. These
+    // are thread safe.
+    Counter &counter(
+      std::string name, std::string help, std::string labels = {}
+    ) {
+      return this->make<Counter>(
+        std::move(name), std::move(help), std::move(labels)
+      );
+    }
+
+    Gauge &gauge(std::string name, std::string help, std::string labels = {}) {
+      return this->make<Gauge>(
+        std::move(name), std::move(help), std::move(labels)
+      );
+    }
+
+    Histogram &histogram(
+      std::string name, std::string help, std::string labels = {}
+    ) {
+      return this->make<Histogram>(
+        std::move(name), std::move(help), std::move(labels)
+      );
+    }
+
+    // For whatever keeps numbers of its own. The collector writes complete
+    // metric families in the text format, on whichever thread scrapes. It
+    // has to stay valid for as long as anything may scrape.
+    void collect(std::function<void(std::ostream &)> collector) {
+      auto lock = std::lock_guard(mMutex);
+      mCollectors.push_back(std::move(collector));
+    }
+
+    // Everything in the Prometheus text format
+    std::string scrape() const {
+      std::ostringstream out{};
+      auto lock = std::lock_guard(mMutex);
+
+      // Samples of a family have to be together
+      std::vector<Entry const *> entries{};
+      for (Entry const &entry : mEntries) entries.push_back(&entry);
+      std::stable_sort(
+        entries.begin(), entries.end()
+      , [](Entry const *a, Entry const *b) { return a->name < b->name; }
+      );
+
+      std::string const *family = nullptr;
+      for (Entry const *entry : entries) {
+        if (family == nullptr || *family != entry->name) {
+          family = &entry->name;
+          char const *type = std::visit([](auto const &metric) {
+            using T = typename std::decay_t<decltype(metric)>::element_type;
+            if constexpr (std::is_same_v<T, Counter>) {
+              return "counter";
+            } else if constexpr (std::is_same_v<T, Gauge>) {
+              return "gauge";
+            } else {
+              return "histogram";
+            }
+          }, entry->metric);
+          out << "# HELP " << entry->name << " " << entry->help << "\n"
+              << "# TYPE " << entry->name << " " << type << "\n";
+        }
+
+        std::visit([&out, entry](auto const &metric) {
+          using T = typename std::decay_t<decltype(metric)>::element_type;
+          if constexpr (std::is_same_v<T, Histogram>) {
+            auto [counts, sum] = metric->values();
+            uint64_t cumulative = 0;
+            for (std::size_t i = 0; i < counts.size(); ++i) {
+              cumulative += counts[i];
+              std::ostringstream bound{};
+              bound << "le=\"";
+              if (i < Histogram::BOUNDS.size()) {
+                bound << Histogram::BOUNDS[i] / 1e9;
+              } else {
+                bound << "+Inf";
+              }
+              bound << "\"";
+              sample(out, entry->name + "_bucket", entry->labels, bound.str());
+              out << cumulative << "\n";
+            }
+            sample(out, entry->name + "_sum", entry->labels, {});
+            out << sum / 1e9 << "\n";
+            sample(out, entry->name + "_count", entry->labels, {});
+            out << cumulative << "\n";
+          } else {
+            sample(out, entry->name, entry->labels, {});
+            out << metric->value() << "\n";
+          }
+        }, entry->metric);
+      }
+
+      for (auto const &collector : mCollectors) collector(out);
+      return out.str();
+    }
+  };
+}}
+
+#endif
@@ -0,0 +1,1528 @@
+#ifndef UUID_20C9697D_2B55_422C_9903_5715AE060B43
+#define UUID_20C9697D_2B55_422C_9903_5715AE060B43
+
+#include <waypositor/allocations.hpp>
+#include <waypositor/arena.hpp>
+#include <waypositor/capture.hpp>
+#include <waypositor/coroutine.hpp>
+#include <waypositor/latency.hpp>
+#include <waypositor/logger.hpp>
+#include <waypositor/loop.hpp>
+#include <waypositor/metrics.hpp>
+#include <waypositor/recycle.hpp>
+#include <waypositor/scene.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <experimental/filesystem>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/local/connect_pair.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/container/small_vector.hpp>
+
+namespace waypositor {
+  namespace filesystem = std::experimental::filesystem;
+  namespace asio = boost::asio;
+  using Domain = asio::local::stream_protocol;
+
+  class Connection;
+
+  // Something clients can bind through the registry
+  struct Global {
+    uint32_t name;
+    std::string interface;
+    uint32_t version;
+    std::function<void(Connection &, uint32_t id, uint32_t version)> bind;
+  };
+
+  // What a connection is allowed. The sizes are checked as requests are
+  // decoded; a client that goes past them is hung up on.
+  struct Limits {
+    // In bytes, header included. libwayland won't send more either.
+    uint16_t message{4096};
+    // In bytes, for any one array argument
+    uint32_t array{4096};
+    // Requests a second, on average, with up to a burst's worth at once.
+    // No rate means no limit, which is the default: a client that's busy
+    // on purpose (a game, a video) goes past any rate that's easy to pick,
+    // and taking turns already keeps one from shutting out the rest.
+    double rate{0};
+    double burst{4096};
+    // Requests handled in a row before other connections get a turn
+    unsigned turn{16};
+
+    // The defaults, with the rate and burst from WAYPOSITOR_REQUEST_RATE
+    // and WAYPOSITOR_REQUEST_BURST, if set
+    static Limits from_environment() {
+      Limits limits{};
+      if (char const *value = std::getenv("WAYPOSITOR_REQUEST_RATE")) {
+        limits.rate = std::atof(value);
+      }
+      if (char const *value = std::getenv("WAYPOSITOR_REQUEST_BURST")) {
+        limits.burst = std::atof(value);
+      }
+      return limits;
+    }
+  };
+
+  // Reads the arguments of a request in order. Running off the end of the
+  // message marks the whole message as bad.
+  class Message final {
+  private:
+    uint16_t mOpcode;
+    uint32_t const *mWords;
+    std::size_t mSize;
+    std::size_t mOffset;
+    std::size_t mMaxArray;
+    bool mValid;
+
+    uint32_t const *take(std::size_t words) {
+      if (!mValid || mSize - mOffset < words) {
+        mValid = false;
+        return nullptr;
+      }
+      uint32_t const *result = mWords + mOffset;
+      mOffset += words;
+      return result;
+    }
+
+  public:
+    // The size is in 32-bit words. Arrays longer than the limit, in bytes,
+    // mark the message as bad.
+    Message(
+      uint16_t opcode, uint32_t const *words, std::size_t size
+    , std::size_t max_array = Limits{}.array
+    ) : mOpcode{opcode}, mWords{words}, mSize{size}, mOffset{0}
+      , mMaxArray{max_array}, mValid{true}
+    {}
+
+    explicit operator bool() const { return mValid; }
+
+    uint16_t opcode() const { return mOpcode; }
+
+    // In words, not counting the header
+    std::size_t size() const { return mSize; }
+
+    uint32_t uint() {
+      uint32_t const *word = this->take(1);
+      return word ? *word : 0;
+    }
+
+    int32_t integer() { return static_cast<int32_t>(this->uint()); }
+
+    // Objects and new ids are both plain ids on the wire
+    uint32_t id() { return this->uint(); }
+
+    std::string_view string() {
+      // The length includes the terminating null. It's checked against
+      // what's left before any arithmetic, so it can't wrap.
+      std::size_t length = this->uint();
+      if (length == 0) return {};
+      if (!mValid || length > (mSize - mOffset) * 4) {
+        mValid = false;
+        return {};
+      }
+      uint32_t const *words = this->take((length + 3) / 4);
+      if (words == nullptr) return {};
+      auto chars = reinterpret_cast<char const *>(words);
+      if (chars[length - 1] != '\0') {
+        mValid = false;
+        return {};
+      }
+      return {chars, length - 1};
+    }
+
+    // The bytes of an array, padding left out
+    std::basic_string_view<unsigned char> array() {
+      std::size_t length = this->uint();
+      if (length > mMaxArray || length > (mSize - mOffset) * 4) {
+        mValid = false;
+        return {};
+      }
+      uint32_t const *words = this->take((length + 3) / 4);
+      if (words == nullptr) return {};
+      return {reinterpret_cast<unsigned char const *>(words), length};
+    }
+  };
+
+  // An event on its way to the client. The size is filled in when it's sent.
+  class Event final {
+  public:
+    // Most events fit without going to the heap
+    using Words = boost::container::small_vector<uint32_t, 16>;
+  private:
+    Words mWords;
+  public:
+    Event(uint32_t object_id, uint16_t opcode) : mWords{object_id, opcode} {}
+
+    Event &uint(uint32_t value) {
+      mWords.push_back(value);
+      return *this;
+    }
+
+    Event &integer(int32_t value) {
+      return this->uint(static_cast<uint32_t>(value));
+    }
+
+    Event &string(std::string_view value) {
+      auto length = static_cast<uint32_t>(value.size() + 1);
+      this->uint(length);
+      std::size_t offset = mWords.size();
+      mWords.resize(offset + (length + 3) / 4, 0);
+      std::memcpy(&mWords[offset], value.data(), value.size());
+      return *this;
+    }
+
+    Words const &words() const { return mWords; }
+
+    // Put it on the wire, with its size
+    template <typename Words>
+    void append_to(Words &wire) const {
+      std::size_t start = wire.size();
+      wire.insert(wire.end(), mWords.begin(), mWords.end());
+      auto size = static_cast<uint32_t>(mWords.size() * sizeof(uint32_t));
+      wire[start + 1] = (size << 16) | (mWords[1] & 0xffff);
+    }
+  };
+
+  // What a connection holds on to, in bytes. Objects are counted as what
+  // they were made as, without anything they allocate themselves. The
+  // kernel's and asio's share of the socket isn't counted.
+  struct Footprint {
+    // The connection itself and what it always has
+    std::size_t connection{0};
+    // Protocol objects, and the table of them
+    std::size_t objects{0};
+    // Held in the connection's arena but not in use: freed, or not yet
+    // handed out. As of when the connection last went idle.
+    std::size_t slack{0};
+    // Events on their way out, or room for them
+    std::size_t buffers{0};
+    // The coroutine stack and request body, as of when the connection last
+    // went idle
+    std::size_t scratch{0};
+
+    std::size_t total() const {
+      return connection + objects + slack + buffers + scratch;
+    }
+
+    Footprint &operator+=(Footprint const &other) {
+      connection += other.connection;
+      objects += other.objects;
+      slack += other.slack;
+      buffers += other.buffers;
+      scratch += other.scratch;
+      return *this;
+    }
+  };
+
+  // What an idle connection with a registry should fit in, going by
+  // Footprint, arena included. ob-protocol-bench -i checks it. Ten thousand
+  // idle clients come to 13 MiB, which is what hosting thousands of them
+  // can afford. It's what's reachable and stays put: anything new an idle
+  // connection holds has to make room for itself in here.
+  constexpr std::size_t IDLE_CONNECTION_BUDGET = 1344;
+
+  // Kept by a Server for all of its connections. The counters are only there
+  // once the server has been instrumented.
+  struct ConnectionMetrics {
+    latency::Recorder latency{};
+    metrics::Counter *requests{nullptr};
+    metrics::Counter *received{nullptr};
+    metrics::Counter *events{nullptr};
+    metrics::Counter *sent{nullptr};
+    metrics::Counter *errors{nullptr};
+    // Bytes of events not yet written
+    metrics::Gauge *outgoing{nullptr};
+    // Connections waiting on their client
+    metrics::Gauge *parked{nullptr};
+    // Waits for a connection's request budget to fill back up
+    metrics::Counter *throttled{nullptr};
+    // Every connection's Footprint, added up. Connections add what changes
+    // as it changes, so that reading it takes no locks. Always there.
+    struct {
+      metrics::Gauge connections{};
+      metrics::Gauge objects{};
+      metrics::Gauge slack{};
+      metrics::Gauge buffers{};
+      metrics::Gauge scratch{};
+    } held{};
+  };
+
+  class Connection final {
+  public:
+    class Sync final {
+    private:
+      class Impl {
+      private:
+        std::atomic<uint32_t> mCallbackId{1};
+        Connection &mConnection;
+        // When the sync was asked for. Only read once every reference is
+        // gone.
+        latency::Clock::time_point mRequested{};
+
+      public:
+        Connection &get() { return mConnection; }
+        Connection const &get() const { return mConnection; }
+        void set_callback(uint32_t callback_id) {
+          mCallbackId = callback_id;
+          mRequested = latency::Clock::now();
+        }
+
+        Impl(Connection &connection) : mConnection{connection} {}
+        ~Impl() {
+          // This is owned by a std::shared_ptr: there can no longer be concurrent
+          // access
+          uint32_t callback_id = mCallbackId;
+          // 1 is the id of the display singleton, so we know it cannot be used
+          // for a callback id. This ensures that we don't attempt to emit an
+          // event on shutdown if none was requested.
+          if (callback_id == 1) return;
+          mConnection.log_trace("SYNC: ", callback_id);
+
+          // Emit the sync event. The callback is gone once it's done.
+          mConnection.send(
+            Event{callback_id, 0}.uint(mConnection.next_serial())
+          );
+          mConnection.send(Event{1, 1}.uint(callback_id));
+          mConnection.mMetrics.latency.record(
+            {"wl_display", 0, latency::Kind::REPLY}
+          , latency::Clock::now() - mRequested
+          );
+        }
+      };
+      std::shared_ptr<Impl> mImpl;
+
+      friend class Connection;
+      void set_callback(uint32_t callback_id) {
+        mImpl->set_callback(callback_id);
+      }
+    public:
+      Sync(Connection &connection)
+        : mImpl{std::allocate_shared<Impl>(
+            arena::Allocator<Impl>{connection.mArena}, connection
+          )}
+      {}
+      Connection *operator->() { return &mImpl->get(); }
+      Connection const *operator->() const { return &mImpl->get(); }
+      Connection &operator*() { return mImpl->get(); }
+      Connection const &operator*() const { return mImpl->get(); }
+    };
+
+    class Dispatchable {
+    public:
+      virtual void dispatch(Sync sync, Message message) = 0;
+      // For telling requests apart in latency histograms. A string literal.
+      virtual char const *interface() const = 0;
+      virtual ~Dispatchable() = default;
+    };
+
+    // Without arenas, objects come from the heap like anything else
+    Connection(
+      std::size_t id, Logger &log, asio::io_service &asio
+    , scene::Hub &scene, std::vector<Global> const &globals
+    , ConnectionMetrics &metrics, capture::Writer *capture, bool arenas
+    , Limits const &limits, Domain::socket socket
+    );
+    // An idle connection keeps buffers up to these sizes, in bytes, and gives
+    // back the rest
+    static constexpr std::size_t STACK_BUDGET = 256;
+    static constexpr std::size_t BODY_BUDGET = 256;
+    static constexpr std::size_t OUTGOING_BUDGET = 1024;
+
+    ~Connection() {
+      if (mParked && mMetrics.parked) mMetrics.parked->sub();
+      mMetrics.held.connections.sub();
+      {
+        auto lock = std::lock_guard(mDispatchablesMutex);
+        std::size_t objects = this->table_bytes();
+        for (auto const &entry : mDispatchables) {
+          objects += entry.second.get_deleter().size();
+        }
+        mMetrics.held.objects.sub(objects);
+      }
+      {
+        auto lock = std::lock_guard(mOutgoing->mutex);
+        mMetrics.held.buffers.sub(mOutgoing->capacity());
+      }
+      mMetrics.held.slack.sub(mSlack);
+      mMetrics.held.scratch.sub(mScratch);
+      // Hack to avoid honoring an outstanding sync if the entire connection is
+      // coming down
+      mSync.set_callback(1);
+      // Take this client's surfaces off screen
+      mScene.remove_client(mId);
+      for (std::size_t i = mFdsTaken; i < mFds.size(); ++i) ::close(mFds[i]);
+      if (mCapture) mCapture->close(mId);
+      this->log_info("Destroyed");
+    }
+
+    std::size_t id() const { return mId; }
+
+    // Where committed surface state goes to be drawn
+    scene::Hub &scene() { return mScene; }
+
+    std::vector<Global> const &globals() const { return mGlobals; }
+
+    template <typename Callback>
+    void post(Callback &&callback) {
+      loop::post(mMonitor, mAsio, recycle::bind(std::move(callback)));
+    }
+
+    template <typename Buffers, typename Continuation>
+    void async_read(Buffers &&buffers, Continuation continuation) {
+      if (mMonitor) {
+        this->read(buffers, mMonitor->completion(std::move(continuation)));
+      } else {
+        this->read(buffers, std::move(continuation));
+      }
+    }
+
+    template <typename Continuation>
+    void async_wait(latency::Clock::duration wait, Continuation continuation) {
+      auto lock = std::lock_guard(mSocketMutex);
+      // Shut down already
+      if (!mSocket) return;
+      // Most connections never wait, so they don't get a timer until they do
+      if (!mThrottle) mThrottle = std::make_unique<asio::steady_timer>(mAsio);
+      mThrottle->expires_after(wait);
+      if (mMonitor) {
+        mThrottle->async_wait(mMonitor->completion(std::move(continuation)));
+      } else {
+        mThrottle->async_wait(std::move(continuation));
+      }
+    }
+
+    Limits const &limits() const { return mLimits; }
+
+    // Takes one request out of the budget. If it's run out, how long until
+    // there's a turn's worth again. Only called on the connection's own
+    // strand of work.
+    latency::Clock::duration admit() {
+      if (mLimits.rate <= 0) return {};
+      auto now = latency::Clock::now();
+      std::chrono::duration<double> elapsed = now - mRefilled;
+      mRefilled = now;
+      mTokens = std::min(
+        mLimits.burst, mTokens + elapsed.count() * mLimits.rate
+      );
+      if (mTokens >= 1) {
+        mTokens -= 1;
+        return {};
+      }
+      if (mMetrics.throttled) mMetrics.throttled->add();
+      if (!mThrottled) {
+        mThrottled = true;
+        this->log_info(
+          "Throttled at ", mLimits.rate, " requests a second (said once)"
+        );
+      }
+      // Not just the one request, so that a throttled client isn't woken up
+      // for every request
+      double wanted = std::min<double>(mLimits.turn, mLimits.burst);
+      return std::chrono::duration_cast<latency::Clock::duration>(
+        std::chrono::duration<double>{(wanted - mTokens) / mLimits.rate}
+      );
+    }
+
+    // Between requests, the connection waits on its client, which may have
+    // nothing to say for a long while. It holds on to as little as possible
+    // until the next request comes in. The scratch is what the caller still
+    // holds on to meanwhile.
+    void park(std::size_t scratch) {
+      {
+        auto lock = std::lock_guard(mOutgoing->mutex);
+        std::size_t before = mOutgoing->capacity();
+        mOutgoing->trim(OUTGOING_BUDGET);
+        mMetrics.held.buffers.sub(before - mOutgoing->capacity());
+      }
+      auto [reserved, used] = mArena.usage();
+      std::size_t slack = reserved - used;
+      mMetrics.held.slack.add(
+        static_cast<int64_t>(slack) - static_cast<int64_t>(mSlack)
+      );
+      mSlack = slack;
+      mMetrics.held.scratch.add(
+        static_cast<int64_t>(scratch) - static_cast<int64_t>(mScratch)
+      );
+      mScratch = scratch;
+      if (mParked) return;
+      mParked = true;
+      if (mMetrics.parked) mMetrics.parked->add();
+    }
+
+    void unpark() {
+      if (!mParked) return;
+      mParked = false;
+      if (mMetrics.parked) mMetrics.parked->sub();
+    }
+
+    // What every connection holds, whatever it's doing
+    static std::size_t fixed_bytes() {
+      return sizeof(Connection) + sizeof(Outgoing) + sizeof(Sync::Impl);
+    }
+
+    // Events go out in the order they're sent. Whatever is sent while a
+    // write is in flight goes out together in the next one.
+    void send(Event const &event) {
+      auto lock = std::lock_guard(mOutgoing->mutex);
+      std::size_t before = mOutgoing->queued.capacity();
+      event.append_to(mOutgoing->queued);
+      if (std::size_t after = mOutgoing->queued.capacity(); after != before) {
+        mMetrics.held.buffers.add((after - before) * sizeof(uint32_t));
+      }
+      if (mMetrics.events) {
+        mMetrics.events->add();
+        mMetrics.outgoing->add(event.words().size() * sizeof(uint32_t));
+      }
+      if (mOutgoing->corked == 0 && mOutgoing->writing.empty()) {
+        this->flush();
+      }
+    }
+
+    // Hold events back until uncorked, so a batch of them goes out in a
+    // single write. Corks nest.
+    void cork() {
+      auto lock = std::lock_guard(mOutgoing->mutex);
+      mOutgoing->corked++;
+    }
+
+    void uncork() {
+      auto lock = std::lock_guard(mOutgoing->mutex);
+      assert(mOutgoing->corked > 0);
+      mOutgoing->corked--;
+      if (mOutgoing->corked == 0 && mOutgoing->writing.empty()) {
+        this->flush();
+      }
+    }
+
+    template <typename ...Args>
+    void log_info(Args&&... args) {
+      mLog.info("(Connection ", mId, ") ", std::forward<Args>(args)...);
+    }
+
+    // For every request, so only when tracing
+    template <typename ...Args>
+    void log_trace(Args&&... args) {
+      mLog.trace("(Connection ", mId, ") ", std::forward<Args>(args)...);
+    }
+
+    template <typename ...Args>
+    void log_error(Args&&... args) {
+      mLog.error("(Connection ", mId, ") ", std::forward<Args>(args)...);
+    }
+
+    // Tell the client it did something wrong. Protocol errors are fatal:
+    // nothing it sends from here on is dispatched, and it's hung up on once
+    // the error is out.
+    void post_error(uint32_t object_id, uint32_t code, std::string_view what) {
+      if (mMetrics.errors) mMetrics.errors->add();
+      this->log_error("Protocol error on object ", object_id, ": ", what);
+      mFailed = true;
+      this->send(Event{1, 0}.uint(object_id).uint(code).string(what));
+      auto lock = std::lock_guard(mOutgoing->mutex);
+      mOutgoing->hanging_up = true;
+      // Otherwise it's done when the last write is
+      if (mOutgoing->writing.empty() && mOutgoing->queued.empty()) {
+        this->shutdown();
+      }
+    }
+
+    void shutdown() {
+      auto lock = std::lock_guard(mSocketMutex);
+      mSocket = std::nullopt;
+      if (mThrottle) mThrottle->cancel();
+    }
+
+    // For what objects share that lives as long as they do. Thread safe.
+    arena::Arena &arena() { return mArena; }
+
+    // Objects live in the connection's arena. Null, with the client told
+    // off, if the id is null or still taken; nothing is made then.
+    template <typename T, typename ...Args>
+    T *create(uint32_t id, Args&&... args) {
+      bool taken = id == 0;
+      {
+        auto lock = std::lock_guard(mDispatchablesMutex);
+        taken = taken || mDispatchables.count(id) > 0;
+      }
+      if (taken) {
+        // invalid_object, as libwayland has it
+        this->post_error(1, 0, "Invalid new id");
+        return nullptr;
+      }
+      // Not under the lock, as constructors may look objects up. Only the
+      // connection's own requests make objects, so the id stays free.
+      arena::Pointer<Dispatchable> object = arena::make<T>(
+        mArena, std::forward<Args>(args)...
+      );
+      T *result = static_cast<T *>(object.get());
+      auto lock = std::lock_guard(mDispatchablesMutex);
+      std::size_t before = this->table_bytes();
+      {
+        allocations::Allow growing{};
+        mDispatchables.emplace(id, std::move(object));
+      }
+      mMetrics.held.objects.add(sizeof(T) + this->table_bytes() - before);
+      return result;
+    }
+
+    // The client is told the id is free again, if there was anything there
+    void destroy(uint32_t id) {
+      {
+        auto lock = std::lock_guard(mDispatchablesMutex);
+        auto it = mDispatchables.find(id);
+        if (it == mDispatchables.end()) return;
+        std::size_t before =
+          this->table_bytes() + it->second.get_deleter().size();
+        mDispatchables.erase(it);
+        mMetrics.held.objects.sub(before - this->table_bytes());
+      }
+      this->send(Event{1, 1}.uint(id));
+    }
+
+    // Null if there's no such object, or it isn't a T
+    template <typename T>
+    T *find(uint32_t id) {
+      auto lock = std::lock_guard(mDispatchablesMutex);
+      auto it = mDispatchables.find(id);
+      if (it == mDispatchables.end()) return nullptr;
+      return dynamic_cast<T *>(it->second.get());
+    }
+
+    void sync(uint32_t callback_id) {
+      // Signal which callback id to use for emitting a sync event.
+      mSync.set_callback(callback_id);
+      // Destroy the previous Sync instance and replace it with a new one. Every
+      // dispatch has shared ownership of a Sync instance via a shared_ptr.
+      // Destroying the Connection's Sync pointer means that the moment all
+      // outstanding dispatches complete, a sync event will be emitted.
+      mSync = Sync(*this);
+    }
+
+    // Timed from when the request's header was decoded
+    void dispatch(
+      uint32_t object_id, Message message, latency::Clock::time_point decoded
+    ) {
+      // Making objects is allowed to grow the arena and the table, and
+      // nothing else. The sync's event is sent in here too.
+      allocations::Forbid forbid{"dispatching a request"};
+      Dispatchable *object = nullptr;
+      {
+        auto lock = std::lock_guard(mDispatchablesMutex);
+        if (auto it = mDispatchables.find(object_id);
+            it != mDispatchables.end()) {
+          object = it->second.get();
+        }
+      }
+      // Not under the lock, as requests may create or destroy objects. An
+      // object destroying itself must do so last thing.
+      if (mFailed) return;
+      if (object == nullptr) {
+        this->log_error("Request for unknown object ", object_id);
+        return;
+      }
+      // The object may be gone by the time dispatch returns
+      latency::Key key{object->interface(), message.opcode()
+                      , latency::Kind::HANDLER};
+      if (mMetrics.requests) {
+        mMetrics.requests->add();
+        // The header is two words
+        mMetrics.received->add((message.size() + 2) * sizeof(uint32_t));
+      }
+      object->dispatch(mSync, std::move(message));
+      mMetrics.latency.record(key, latency::Clock::now() - decoded);
+    }
+
+    uint32_t next_serial() { return mEventSerial++; }
+
+    // The next file descriptor the client sent, for requests with an fd
+    // argument, which come in the order the fds do. The caller owns it. -1
+    // if the client didn't send one.
+    int take_fd() {
+      if (mFdsTaken == mFds.size()) return -1;
+      int fd = mFds[mFdsTaken++];
+      if (mFdsTaken == mFds.size()) {
+        mFds.clear();
+        mFdsTaken = 0;
+      }
+      return fd;
+    }
+
+    // More than this waiting to be taken and the client is hung up on, so
+    // it can't run the compositor out of descriptors
+    static constexpr std::size_t MAX_FDS = 64;
+
+  private:
+    // Reads from the socket like the socket itself would, for asio::async_read,
+    // but keeps the file descriptors that come along with the bytes. Like
+    // asio, it reads straight away and only waits if there's nothing there.
+    class Receiver final {
+    private:
+      Connection &mConnection;
+      // As many as libwayland sends with one message
+      static constexpr std::size_t MAX_FDS_PER_READ = 28;
+
+      // Should be synchronized by mSocketMutex, with the socket still
+      // there. False if there's nothing to read yet.
+      bool receive(
+        asio::mutable_buffer buffer, boost::system::error_code &error
+      , std::size_t &size
+      ) {
+        alignas(cmsghdr) char control[CMSG_SPACE(
+          MAX_FDS_PER_READ * sizeof(int)
+        )];
+        iovec iov{buffer.data(), buffer.size()};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t received = ::recvmsg(
+          mConnection.mSocket->native_handle(), &message
+        , MSG_DONTWAIT | MSG_CMSG_CLOEXEC
+        );
+        size = 0;
+        if (received < 0) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return false;
+          }
+          error = {errno, boost::system::system_category()};
+          return true;
+        }
+        if (received == 0) {
+          error = asio::error::eof;
+          return true;
+        }
+        std::size_t count = 0;
+        for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr;
+             header = CMSG_NXTHDR(&message, header)) {
+          if (header->cmsg_level != SOL_SOCKET
+           || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+          }
+          std::size_t fds = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+          for (std::size_t i = 0; i < fds; ++i) {
+            int fd;
+            std::memcpy(
+              &fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int)
+            );
+            mConnection.mFds.push_back(fd);
+          }
+          count += fds;
+        }
+        if (count > 0 && mConnection.mCapture) {
+          mConnection.mCapture->fds(mConnection.mId, count);
+        }
+        if ((message.msg_flags & MSG_CTRUNC)
+         || mConnection.mFds.size() - mConnection.mFdsTaken > MAX_FDS) {
+          mConnection.log_error("Too many file descriptors");
+          error = asio::error::no_buffer_space;
+          return true;
+        }
+        error = {};
+        size = static_cast<std::size_t>(received);
+        return true;
+      }
+
+      template <typename Handler>
+      void wait(asio::mutable_buffer buffer, Handler &&handler) {
+        auto readable = [
+          this, buffer, handler = std::forward<Handler>(handler)
+        ](boost::system::error_code error) mutable {
+          std::size_t size = 0;
+          if (!error) {
+            auto lock = std::lock_guard(mConnection.mSocketMutex);
+            if (!mConnection.mSocket) {
+              error = asio::error::operation_aborted;
+            } else if (!this->receive(buffer, error, size)) {
+              this->wait(buffer, std::move(handler));
+              return;
+            }
+          }
+          handler(error, size);
+        };
+        mConnection.mSocket->async_wait(
+          Domain::socket::wait_read, recycle::bind(std::move(readable))
+        );
+      }
+
+    public:
+      using executor_type = Domain::socket::executor_type;
+
+      explicit Receiver(Connection &connection) : mConnection{connection} {}
+
+      executor_type get_executor() {
+        return executor_type{mConnection.mAsio.get_executor()};
+      }
+
+      template <typename Buffers, typename Handler>
+      void async_read_some(Buffers const &buffers, Handler &&handler) {
+        asio::mutable_buffer buffer{*asio::buffer_sequence_begin(buffers)};
+        boost::system::error_code error{};
+        std::size_t size = 0;
+        {
+          auto lock = std::lock_guard(mConnection.mSocketMutex);
+          if (!mConnection.mSocket) {
+            error = asio::error::operation_aborted;
+          } else if (!this->receive(buffer, error, size)) {
+            this->wait(buffer, std::forward<Handler>(handler));
+            return;
+          }
+        }
+        // Never from in here, as the caller may not expect it
+        mConnection.mAsio.post(recycle::bind(
+          [handler = std::forward<Handler>(handler), error, size]() mutable {
+            handler(error, size);
+          }
+        ));
+      }
+    };
+
+    // Records what was read before passing it on
+    template <typename Buffers, typename Continuation>
+    class Captured final {
+    private:
+      Connection *mConnection;
+      Buffers mBuffers;
+      Continuation mContinuation;
+    public:
+      Captured(
+        Connection &connection, Buffers buffers, Continuation continuation
+      ) : mConnection{&connection}, mBuffers{std::move(buffers)}
+        , mContinuation{std::move(continuation)}
+      {}
+      // Declared but not defined, like the continuations themselves
+      Captured(Captured const &);
+      Captured &operator=(Captured const &);
+      Captured(Captured &&) = default;
+      Captured &operator=(Captured &&) = default;
+
+      void operator()(
+        boost::system::error_code const &error, std::size_t size
+      ) {
+        std::size_t left = size;
+        for (
+          auto it = asio::buffer_sequence_begin(mBuffers);
+          left > 0 && it != asio::buffer_sequence_end(mBuffers); ++it
+        ) {
+          asio::const_buffer buffer{*it};
+          std::size_t taken = std::min(left, buffer.size());
+          mConnection->mCapture->data(
+            mConnection->mId, buffer.data(), taken
+          );
+          left -= taken;
+        }
+        mContinuation(error, size);
+      }
+    };
+
+    // Buffers stay out of the arena: it never gives memory back, and trim
+    // has to.
+    struct Outgoing {
+      std::mutex mutex{};
+      std::vector<uint32_t> queued{};
+      std::vector<uint32_t> writing{};
+      std::size_t corked{0};
+      // The connection goes once everything's written
+      bool hanging_up{false};
+      metrics::Gauge *bytes{nullptr};
+
+      // In bytes, used or not. Should be synchronized by mutex.
+      std::size_t capacity() const {
+        return (queued.capacity() + writing.capacity()) * sizeof(uint32_t);
+      }
+
+      // Should be synchronized by mutex
+      void written() {
+        if (bytes) bytes->sub(writing.size() * sizeof(uint32_t));
+        writing.clear();
+      }
+
+      // Give back whatever room isn't in use, if there's more than the
+      // budget. Should be synchronized by mutex.
+      void trim(std::size_t budget) {
+        if (this->capacity() <= budget) return;
+        if (queued.empty()) std::vector<uint32_t>{}.swap(queued);
+        if (writing.empty()) std::vector<uint32_t>{}.swap(writing);
+      }
+
+      ~Outgoing() {
+        if (bytes) {
+          bytes->sub((queued.size() + writing.size()) * sizeof(uint32_t));
+        }
+      }
+    };
+
+    // Should be synchronized by mOutgoing->mutex
+    void flush() {
+      auto &outgoing = *mOutgoing;
+      if (outgoing.queued.empty()) return;
+      std::swap(outgoing.queued, outgoing.writing);
+
+      auto lock = std::lock_guard(mSocketMutex);
+      if (!mSocket) {
+        outgoing.written();
+        return;
+      }
+      if (mMetrics.sent) {
+        mMetrics.sent->add(outgoing.writing.size() * sizeof(uint32_t));
+      }
+      auto written = [this, maybe_outgoing = std::weak_ptr{mOutgoing}](
+        boost::system::error_code const &error, std::size_t
+      ) {
+        // The connection may have gone away in the meantime
+        auto outgoing = maybe_outgoing.lock();
+        if (!outgoing) return;
+        auto lock = std::lock_guard(outgoing->mutex);
+        outgoing->written();
+        if (error) {
+          this->log_error("ASIO error: ", error.message());
+        } else if (outgoing->corked == 0) {
+          this->flush();
+        }
+        if (outgoing->hanging_up && (error || outgoing->writing.empty())) {
+          this->shutdown();
+        }
+      };
+      asio::async_write(
+        *mSocket, asio::buffer(outgoing.writing)
+      , recycle::bind(std::move(written))
+      );
+    }
+
+    // The receiver takes the socket's lock itself
+    template <typename Buffers, typename Continuation>
+    void read(Buffers &&buffers, Continuation continuation) {
+      if (mCapture) {
+        asio::async_read(
+          mReceiver, buffers
+        , recycle::bind(Captured<std::decay_t<Buffers>, Continuation>{
+            *this, buffers, std::move(continuation)
+          })
+        );
+        return;
+      }
+      asio::async_read(
+        mReceiver, buffers, recycle::bind(std::move(continuation))
+      );
+    }
+
+    std::size_t mId;
+    Logger &mLog;
+    asio::io_service &mAsio;
+    // Null if the loop isn't being watched
+    loop::Monitor *mMonitor;
+    scene::Hub &mScene;
+    std::vector<Global> const &mGlobals;
+    ConnectionMetrics &mMetrics;
+    capture::Writer *mCapture;
+    std::optional<Domain::socket> mSocket;
+    std::mutex mSocketMutex{};
+    Receiver mReceiver{*this};
+    // Sent by the client and not yet taken by a request. Only touched on
+    // the connection's own strand of work.
+    std::vector<int> mFds{};
+    std::size_t mFdsTaken{0};
+    // Should be synchronized by mSocketMutex
+    std::unique_ptr<asio::steady_timer> mThrottle{};
+    Limits mLimits;
+    // The request budget, as of when it was last refilled
+    double mTokens;
+    latency::Clock::time_point mRefilled{latency::Clock::now()};
+    // Write completions may outlive the connection and keep mOutgoing
+    std::shared_ptr<Outgoing> mOutgoing{std::make_shared<Outgoing>()};
+    // Goes after everything in it
+    arena::Arena mArena;
+    using Objects = std::unordered_map<
+      uint32_t, arena::Pointer<Dispatchable>
+    , std::hash<uint32_t>, std::equal_to<uint32_t>
+    , arena::Allocator<std::pair<uint32_t const, arena::Pointer<Dispatchable>>>
+    >;
+    // An idle connection has two objects, and the table would otherwise
+    // start out with thirteen buckets for them
+    Objects mDispatchables{
+      2, Objects::hasher{}, Objects::key_equal{}
+    , Objects::allocator_type{mArena}
+    };
+    std::mutex mDispatchablesMutex{};
+    Sync mSync{*this};
+    std::atomic<uint32_t> mEventSerial{0};
+    // Only touched on the connection's own strand of work
+    bool mParked{false};
+    // Told of a protocol error, and being hung up on. Only touched on the
+    // connection's own strand of work.
+    bool mFailed{false};
+    // Whether being throttled has been said. Only touched on the
+    // connection's own strand of work.
+    bool mThrottled{false};
+    // What was last added to mMetrics.held for these. Only touched on the
+    // connection's own strand of work.
+    std::size_t mSlack{0};
+    std::size_t mScratch{0};
+
+    // What the table of objects holds besides the objects: a node is an
+    // entry and the pointer to the next one. Should be synchronized by
+    // mDispatchablesMutex.
+    std::size_t table_bytes() const {
+      return mDispatchables.bucket_count() * sizeof(void *)
+        + mDispatchables.size() * (
+            sizeof(Objects::value_type) + sizeof(void *)
+          );
+    }
+  };
+
+  // It might be more efficient to read this in one fell swoop instead of one
+  // field at a time, but for now this both readable and portable.
+  class HeaderParser final : private coroutine::FrameMixin<HeaderParser> {
+  private:
+    enum class State { OBJECT_ID, OPCODE, MESSAGE_SIZE, FINISHED };
+    State mState{State::OBJECT_ID};
+    uint32_t mObjectId;
+    uint16_t mOpcode;
+    uint16_t mMessageSize;
+
+  public:
+    template <typename StackPointer>
+    class Logic : public LogicMixin<StackPointer> {
+    public:
+      Logic(StackPointer frame) : LogicMixin<StackPointer>(std::move(frame)) {}
+
+      void resume() {
+        switch (this->frame().mState) {
+        case State::OBJECT_ID:
+          this->frame().mState = State::OPCODE;
+          this->async_read(this->frame().mObjectId);
+          return;
+        case State::OPCODE:
+          this->frame().mState = State::MESSAGE_SIZE;
+          this->async_read(this->frame().mOpcode);
+          return;
+        case State::MESSAGE_SIZE:
+          this->frame().mState = State::FINISHED;
+          this->async_read(this->frame().mMessageSize);
+          return;
+        case State::FINISHED:
+          this->frame().mState = State::OBJECT_ID;
+          this->coreturn(
+            this->frame().mObjectId, this->frame().mOpcode
+          , this->frame().mMessageSize
+          );
+          return;
+        }
+      }
+    };
+  };
+
+  class Registry final : public Connection::Dispatchable {
+  private:
+    Connection &mConnection;
+    uint32_t mId;
+  public:
+    Registry(Connection &connection, uint32_t id)
+      : mConnection{connection}, mId{id}
+    {
+      // Announce everything up front
+      for (Global const &global : mConnection.globals()) {
+        mConnection.send(
+          Event{mId, 0}
+            .uint(global.name).string(global.interface).uint(global.version)
+        );
+      }
+    }
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: { // bind
+        uint32_t name = message.uint();
+        std::string_view interface = message.string();
+        uint32_t version = message.uint();
+        uint32_t id = message.id();
+        if (!message) break;
+        sync->log_trace("registry::bind ", interface, " v", version);
+        for (Global const &global : mConnection.globals()) {
+          if (global.name != name) continue;
+          if (global.interface != interface || version > global.version) {
+            break;
+          }
+          global.bind(mConnection, id, version);
+          return;
+        }
+        // invalid_object
+        sync->post_error(mId, 0, "Bad global");
+        return;
+      }
+      default:
+        break;
+      }
+      sync->log_error("Bad request for registry: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wl_registry"; }
+  };
+
+  class Display final : public Connection::Dispatchable {
+  public:
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: { // sync
+        uint32_t callback_id = message.id();
+        if (!message) break;
+        sync->log_trace("Sync requested: ", callback_id);
+        sync->sync(callback_id);
+        return;
+      }
+      case 1: { // get registry
+        uint32_t registry_id = message.id();
+        if (!message) break;
+        sync->log_trace("display::get_registry");
+        sync->template create<Registry>(registry_id, *sync, registry_id);
+        return;
+      }
+      default:
+        break;
+      }
+      sync->log_error("Invalid request for Display: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wl_display"; }
+  };
+
+  inline Connection::Connection(
+    std::size_t id, Logger &log, asio::io_service &asio
+  , scene::Hub &scene, std::vector<Global> const &globals
+  , ConnectionMetrics &metrics, capture::Writer *capture, bool arenas
+  , Limits const &limits, Domain::socket socket
+  ) : mId{id}, mLog{log}, mAsio{asio}, mMonitor{loop::Monitor::find(asio)}
+    , mScene{scene}, mGlobals{globals}, mMetrics{metrics}, mCapture{capture}
+    , mSocket{std::move(socket)}, mLimits{limits}, mTokens{limits.burst}
+    , mArena{arenas}
+  {
+    mOutgoing->bytes = mMetrics.outgoing;
+    mMetrics.held.connections.add();
+    // The table starts out with buckets of its own
+    mMetrics.held.objects.add(this->table_bytes());
+    if (mCapture) mCapture->open(mId);
+    this->create<Display>(1);
+    this->log_info("Accepted");
+  }
+
+  class Dispatcher final : private coroutine::FrameMixin<Dispatcher> {
+  private:
+    struct HeaderResult {};
+
+    enum class State { PARSE, GOT_HEADER, GOT_BODY, ADMIT, ERROR };
+    State mState{State::PARSE};
+    uint32_t mObjectId;
+    uint16_t mOpcode;
+    uint16_t mMessageSize;
+    // Requests handled since other connections last had a turn
+    unsigned mTurn{0};
+    latency::Clock::time_point mDecoded{};
+    std::vector<uint32_t> mBody{};
+  public:
+    template <typename StackPointer>
+    class Logic : public LogicMixin<StackPointer> {
+    public:
+      Logic(StackPointer frame) : LogicMixin<StackPointer>(std::move(frame)) {}
+
+      void resume() {
+        auto header_size = static_cast<uint16_t>(
+          sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint16_t)
+        );
+        switch (this->frame().mState) {
+        case State::GOT_HEADER:
+          this->unpark();
+          if (
+            this->frame().mMessageSize < header_size
+         || this->frame().mMessageSize % sizeof(uint32_t) != 0
+          ) {
+            // We've lost track of where messages start. Give up on the
+            // connection.
+            this->log_error("Malformed message");
+            this->frame().mState = State::ERROR;
+            return;
+          }
+          if (this->frame().mMessageSize > this->limits().message) {
+            // Reading it all in is what a flooding client would want
+            this->log_error(
+              "Message too big: ", this->frame().mMessageSize, " bytes"
+            );
+            this->frame().mState = State::ERROR;
+            return;
+          }
+          this->frame().mBody.resize(
+            (this->frame().mMessageSize - header_size) / sizeof(uint32_t)
+          );
+          this->frame().mState = State::GOT_BODY;
+          if (!this->frame().mBody.empty()) {
+            this->async_read_buffer(asio::buffer(this->frame().mBody));
+            return;
+          }
+          // Fall through
+        case State::GOT_BODY:
+          this->log_trace(
+            "Request ["
+          , "object: ", this->frame().mObjectId, ", "
+          , "opcode: ", this->frame().mOpcode
+          , "]"
+          );
+          this->dispatch(
+            this->frame().mObjectId
+          , Message{
+              this->frame().mOpcode
+            , this->frame().mBody.data(), this->frame().mBody.size()
+            , this->limits().array
+            }
+          , this->frame().mDecoded
+          );
+          // Fall through
+        case State::ADMIT: {
+          // A client that's used up its budget isn't read from until it's
+          // back, so what it sends piles up on its side of the socket
+          auto wait = this->admit();
+          if (wait > latency::Clock::duration::zero()) {
+            this->frame().mState = State::ADMIT;
+            this->async_wait(wait);
+            return;
+          }
+          // Round robin: a client with plenty to say goes to the back of the
+          // queue every so often, behind other connections and new I/O
+          if (++this->frame().mTurn >= this->limits().turn) {
+            this->frame().mTurn = 0;
+            this->frame().mState = State::PARSE;
+            this->suspend();
+            return;
+          }
+        }
+          // Fall through
+        case State::PARSE: {
+          // Nothing bigger than the budget is kept for the next body
+          auto &body = this->frame().mBody;
+          if (body.capacity() * sizeof(uint32_t) > Connection::BODY_BUDGET) {
+            std::vector<uint32_t>{}.swap(body);
+          }
+          std::size_t scratch = body.capacity() * sizeof(uint32_t);
+          this->frame().mState = State::ERROR;
+          // This may move the frame
+          this->park(Connection::STACK_BUDGET, scratch);
+          this->template coinvoke<HeaderParser, HeaderResult>();
+          return;
+        }
+        case State::ERROR:
+          // Do nothing;
+          return;
+        }
+      }
+    };
+
+    void coreturn(
+      HeaderResult, uint32_t object_id, uint16_t opcode, uint16_t size
+    ) {
+      mObjectId = object_id;
+      mOpcode = opcode;
+      mMessageSize = size;
+      mDecoded = latency::Clock::now();
+      mState = State::GOT_HEADER;
+    }
+  };
+
+  // Serves connections handed to it, however they were made: accepted by a
+  // Listener, or made in process (e.g. for benchmarks and replays).
+  class Server final {
+  private:
+    Logger &mLog;
+    asio::io_service &mAsio;
+    scene::Hub &mScene;
+    std::vector<Global> mGlobals;
+    ConnectionMetrics mMetrics;
+    capture::Writer *mCapture;
+    bool mArenas{true};
+    Limits mLimits{};
+    std::optional<coroutine::Forker<Connection>> mConnections;
+
+  public:
+    Server(
+      Logger &log, asio::io_service &asio, scene::Hub &scene
+    , std::vector<Global> globals
+    ) : mLog{log}, mAsio{asio}, mScene{scene}, mGlobals{std::move(globals)}
+      , mMetrics{}, mCapture{nullptr}
+      , mConnections{std::make_optional<coroutine::Forker<Connection>>()}
+    {}
+
+    explicit operator bool() const { return static_cast<bool>(mConnections); }
+
+    // How long requests take, from every thread serving connections
+    latency::Recorder const &latency() const { return mMetrics.latency; }
+
+    // Count connections and their traffic. Call this before serving anything.
+    // Scraping reads the server's latency histograms, so the server has to
+    // outlive whatever scrapes the registry.
+    void instrument(metrics::Registry &registry) {
+      mMetrics.requests = &registry.counter(
+        "waypositor_requests_total", "Requests dispatched"
+      );
+      mMetrics.received = &registry.counter(
+        "waypositor_received_bytes_total", "Bytes of requests dispatched"
+      );
+      mMetrics.events = &registry.counter(
+        "waypositor_events_total", "Events sent to clients"
+      );
+      mMetrics.sent = &registry.counter(
+        "waypositor_sent_bytes_total", "Bytes of events written"
+      );
+      mMetrics.errors = &registry.counter(
+        "waypositor_protocol_errors_total", "Protocol errors sent to clients"
+      );
+      mMetrics.outgoing = &registry.gauge(
+        "waypositor_outgoing_bytes", "Bytes of events not yet written"
+      );
+      mMetrics.parked = &registry.gauge(
+        "waypositor_parked_connections", "Connections waiting on the client"
+      );
+      mMetrics.throttled = &registry.counter(
+        "waypositor_throttled_total"
+      , "Times a connection ran out of requests and had to wait"
+      );
+      mConnections->instrument(
+        registry.gauge("waypositor_connections", "Connections open")
+      , registry.counter(
+          "waypositor_connections_total", "Connections accepted"
+        )
+      );
+      registry.collect([this](std::ostream &out) {
+        latency::expose(out, mMetrics.latency.snapshot());
+      });
+      registry.collect([this](std::ostream &out) {
+        Footprint footprint = this->footprint().first;
+        char const *name = "waypositor_connection_bytes";
+        out << "# HELP " << name << " Memory held by connections\n"
+            << "# TYPE " << name << " gauge\n";
+        for (auto [part, bytes] : {
+          std::pair{"connection", footprint.connection}
+        , std::pair{"objects", footprint.objects}
+        , std::pair{"slack", footprint.slack}
+        , std::pair{"buffers", footprint.buffers}
+        , std::pair{"scratch", footprint.scratch}
+        }) {
+          out << name << "{part=\"" << part << "\"} " << bytes << "\n";
+        }
+      });
+    }
+
+    // Every connection's footprint added up, and how many there are. Takes
+    // no locks, so it never holds up a connection. Thread safe.
+    std::pair<Footprint, std::size_t> footprint() const {
+      auto const &held = mMetrics.held;
+      auto connections = static_cast<std::size_t>(held.connections.value());
+      Footprint result{};
+      result.connection = connections * Connection::fixed_bytes();
+      result.objects = static_cast<std::size_t>(held.objects.value());
+      result.slack = static_cast<std::size_t>(held.slack.value());
+      result.buffers = static_cast<std::size_t>(held.buffers.value());
+      result.scratch = static_cast<std::size_t>(held.scratch.value());
+      return {result, connections};
+    }
+
+    // A table of request latencies so far, to the log
+    void log_latency() {
+      std::ostringstream table{};
+      latency::print(table, mMetrics.latency.snapshot());
+      mLog.info("Request latencies:\n", table.str());
+    }
+
+    // Record what clients send from now on. The writer has to outlive any
+    // connections adopted from here on.
+    void record(capture::Writer &writer) { mCapture = &writer; }
+
+    // Whether connections adopted from here on keep their objects in arenas
+    // of their own. They do unless told otherwise.
+    void use_arenas(bool enabled) { mArenas = enabled; }
+
+    // What connections adopted from here on are allowed
+    void limit(Limits const &limits) { mLimits = limits; }
+
+    // Serve a connected socket on this server's io_service. Thread safe: the
+    // connection starts on the io_service's thread, with the settings as
+    // they are now.
+    void adopt(Domain::socket socket) {
+      // The socket has to go through a copyable handler
+      mAsio.post([
+        this, arenas = mArenas, limits = mLimits
+      , socket = std::make_shared<Domain::socket>(std::move(socket))
+      ] {
+        if (!mConnections) return;
+        mConnections->fork<Dispatcher>(
+          std::piecewise_construct
+        , std::forward_as_tuple(
+            mLog, mAsio, mScene, mGlobals, mMetrics, mCapture, arenas
+          , limits, std::move(*socket)
+          )
+        , std::forward_as_tuple()
+        );
+      });
+    }
+
+    // A new connection from within this process. The server gets one end
+    // of a socket pair, and the client's end is returned on the given
+    // io_service. Thread safe.
+    Domain::socket connect(asio::io_service &client) {
+      Domain::socket ours{client};
+      Domain::socket theirs{mAsio};
+      asio::local::connect_pair(ours, theirs);
+      this->adopt(std::move(theirs));
+      return ours;
+    }
+
+    // Shut down every connection. Call this on the io_service's thread.
+    void stop() { mConnections = std::nullopt; }
+  };
+
+  class Listener final {
+  private:
+    enum class State { STOPPED, LISTENING, ACCEPTED };
+    Logger &mLog;
+    asio::io_service &mAsio;
+    Server mServer;
+    Domain::acceptor mAcceptor;
+    Domain::socket mSocket;
+    State mState;
+
+    class Worker final {
+    private:
+      Listener *self;
+    public:
+      Worker(Listener &self_) : self{&self_} {}
+      Worker(Worker const &);
+      Worker &operator=(Worker const &);
+      Worker(Worker &&other) noexcept : self{other.self} {
+        other.self = nullptr;
+      }
+      Worker &operator=(Worker &&other) {
+        if (this == &other) return *this;
+        self = other.self;
+        other.self = nullptr;
+        return *this;
+      }
+      ~Worker() = default;
+
+      void operator()(boost::system::error_code const &error = {}) {
+        assert(*this);
+        if (error) {
+          self->mLog.error("(Listener) ASIO error: ", error.message());
+          return;
+        }
+
+        switch (self->mState) {
+        case State::STOPPED:
+          self->mLog.info("(Listener) stopped by request");
+          return;
+        case State::LISTENING:
+          self->mState = State::ACCEPTED;
+          self->mAcceptor.async_accept(self->mSocket, std::move(*this));
+          return;
+        case State::ACCEPTED:
+          self->mServer.adopt(std::move(self->mSocket));
+          self->mState = State::LISTENING;
+          self->mAsio.post(std::move(*this));
+          return;
+        }
+      }
+
+      explicit operator bool() const { return self != nullptr && *self; }
+    };
+
+    struct Private {};
+  public:
+    void launch() { Worker{*this}(); }
+
+    // Record what clients send from now on. The writer has to outlive any
+    // connections accepted from here on.
+    void record(capture::Writer &writer) { mServer.record(writer); }
+
+    // Connections can be added in process as well
+    Server &server() { return mServer; }
+    Server const &server() const { return mServer; }
+
+    void stop() {
+      mState = State::STOPPED;
+      mServer.stop();
+
+      boost::system::error_code error;
+      mAcceptor.cancel(error);
+      if (error) {
+        mLog.error("ASIO: ", error.message());
+      }
+    }
+
+    explicit operator bool() const {
+      return mState == State::STOPPED || static_cast<bool>(mServer);
+    }
+
+    Listener(
+      Private // effectively make this constructor private
+    , Logger &log, asio::io_service &asio, scene::Hub &scene
+    , std::vector<Global> globals, filesystem::path const &path
+    ) : mLog{log}, mAsio{asio}, mServer{log, asio, scene, std::move(globals)}
+      , mAcceptor{asio, path.native()}, mSocket{asio}
+      , mState{State::LISTENING}
+    {}
+
+    template <typename Name>
+    static std::optional<Listener> create(
+      Logger &log, asio::io_service &asio, scene::Hub &scene
+    , std::vector<Global> globals, Name &&socket_name
+    ) {
+      char const *xdg_runtime = std::getenv("XDG_RUNTIME_DIR");
+      if (xdg_runtime == nullptr) {
+        log.error("XDG_RUNTIME_DIR must be set");
+        return std::nullopt;
+      }
+      filesystem::path socket{xdg_runtime};
+      socket /= socket_name;
+
+      if (filesystem::exists(socket)) {
+        std::error_code error;
+        filesystem::remove(socket, error);
+        if (error) {
+          log.error("Couldn't remove existing socket");
+          return std::nullopt;
+        }
+      }
+
+      log.info("Listening on ", socket);
+
+      return std::make_optional<Listener>(
+        Private{}, log, asio, scene, std::move(globals), socket
+      );
+    }
+  };
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef UUID_3E7A91C4_58B2_4F0D_A6E3_C19D27B48F05
+#define UUID_3E7A91C4_58B2_4F0D_A6E3_C19D27B48F05
+
+#include <array>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Memory for asio's handlers. asio keeps one freed handler per thread for the
+// next, but a connection has a read, a write and a post in flight at once,
+// so most of them missed it and went to the heap. These keep a few per
+// thread instead.
+namespace waypositor { namespace recycle {
+  namespace detail {
+    // Every cached piece of memory is this big, so any of them fits
+    constexpr std::size_t LARGEST = 512;
+    constexpr std::size_t SLOTS = 4;
+
+    struct Cache {
+      std::array<void *, SLOTS> free{};
+      Cache() = default;
+      Cache(Cache const &) = delete;
+      Cache &operator=(Cache const &) = delete;
+      ~Cache() {
+        for (void *memory : free) ::operator delete(memory);
+      }
+    };
+
+    inline thread_local Cache cache{};
+
+    inline void *allocate(std::size_t size) {
+      if (size > LARGEST) return ::operator new(size);
+      for (void *&slot : cache.free) {
+        if (slot == nullptr) continue;
+        return std::exchange(slot, nullptr);
+      }
+      return ::operator new(LARGEST);
+    }
+
+    // Possibly on another thread than it was allocated on
+    inline void deallocate(void *memory, std::size_t size) {
+      if (size <= LARGEST) {
+        for (void *&slot : cache.free) {
+          if (slot != nullptr) continue;
+          slot = memory;
+          return;
+        }
+      }
+      ::operator delete(memory);
+    }
+  }
+
+  template <typename T>
+  class Allocator {
+  public:
+    using value_type = T;
+
+    Allocator() noexcept = default;
+    template <typename U>
+    Allocator(Allocator<U> const &) noexcept {}
+
+    T *allocate(std::size_t count) {
+      static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+      return static_cast<T *>(detail::allocate(count * sizeof(T)));
+    }
+
+    void deallocate(T *pointer, std::size_t count) {
+      detail::deallocate(pointer, count * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(Allocator<U> const &) const { return true; }
+
+    template <typename U>
+    bool operator!=(Allocator<U> const &) const { return false; }
+  };
+
+  // A handler whose operations asio allocates through a recycle::Allocator
+  template <typename Handler>
+  class Bound final {
+  private:
+    Handler mHandler;
+  public:
+    using allocator_type = Allocator<void>;
+
+    explicit Bound(Handler handler) : mHandler{std::move(handler)} {}
+    // Declared but not defined, so that move-only handlers get through asio
+    Bound(Bound const &);
+    Bound &operator=(Bound const &);
+    Bound(Bound &&) = default;
+    Bound &operator=(Bound &&) = default;
+
+    allocator_type get_allocator() const noexcept { return {}; }
+
+    template <typename ...Args>
+    void operator()(Args&&... args) {
+      mHandler(std::forward<Args>(args)...);
+    }
+  };
+
+  template <typename Handler>
+  Bound<std::decay_t<Handler>> bind(Handler &&handler) {
+    return Bound<std::decay_t<Handler>>{std::forward<Handler>(handler)};
+  }
+}}
+
+#endif
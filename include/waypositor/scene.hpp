@@ -0,0 +1,454 @@
+#ifndef UUID_7623334C_3A1C_438B_833F_F93AB39F1B60
+#define UUID_7623334C_3A1C_438B_833F_F93AB39F1B60
+
+#include <waypositor/arena.hpp>
+#include <waypositor/detail/triplebuffer.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace waypositor { namespace scene {
+  using Clock = std::chrono::steady_clock;
+
+  // What an output needs to know to show a committed surface
+  struct Surface {
+    // Which connection the surface belongs to, and its id there
+    std::size_t client;
+    uint32_t id;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    // Whatever the client attached. This is shared between snapshots, never
+    // copied.
+    std::shared_ptr<void const> buffer;
+  };
+
+  // Surfaces by slot, in slot order. Tables share whatever they have in
+  // common, and changing a slot only copies the nodes on the way down to it,
+  // so it costs the same however many surfaces there are. Whatever shares
+  // the old table keeps seeing what it saw. Nodes come from the arena the
+  // table was made with, if any, and the heap otherwise.
+  class Surfaces final {
+  private:
+    static constexpr unsigned BITS = 4;
+    static constexpr std::size_t WIDTH = std::size_t{1} << BITS;
+    static constexpr std::size_t MASK = WIDTH - 1;
+
+    struct Leaf {
+      std::array<Surface, WIDTH> surfaces{};
+      // Which of them are there
+      uint32_t used{0};
+    };
+    // Its children are leaves if it's right above them, and branches
+    // otherwise. Null children have nothing in them.
+    struct Branch {
+      std::array<std::shared_ptr<void const>, WIDTH> children{};
+    };
+
+    std::shared_ptr<void const> mRoot{};
+    // Levels of branches above the leaves
+    unsigned mDepth{0};
+    std::size_t mSize{0};
+    arena::Arena *mNodes{nullptr};
+
+    template <typename T, typename ...Args>
+    static std::shared_ptr<T> make(arena::Arena *nodes, Args&&... args) {
+      if (nodes == nullptr) {
+        return std::make_shared<T>(std::forward<Args>(args)...);
+      }
+      return std::allocate_shared<T>(
+        arena::Allocator<T>{*nodes}, std::forward<Args>(args)...
+      );
+    }
+
+    std::size_t capacity() const {
+      return std::size_t{1} << (BITS * (mDepth + 1));
+    }
+
+    // A copy of the node, at the given height above the leaves, with the
+    // slot changed. A null surface clears it.
+    static std::shared_ptr<void const> assign(
+      arena::Arena *nodes, std::shared_ptr<void const> const &node
+    , unsigned height, std::size_t slot, Surface const *surface
+    ) {
+      if (height == 0) {
+        auto leaf = node
+          ? make<Leaf>(nodes, *static_cast<Leaf const *>(node.get()))
+          : make<Leaf>(nodes);
+        std::size_t index = slot & MASK;
+        leaf->surfaces[index] = surface ? *surface : Surface{};
+        if (surface) {
+          leaf->used |= uint32_t{1} << index;
+        } else {
+          leaf->used &= ~(uint32_t{1} << index);
+        }
+        return leaf;
+      }
+      auto branch = node
+        ? make<Branch>(nodes, *static_cast<Branch const *>(node.get()))
+        : make<Branch>(nodes);
+      auto &child = branch->children[(slot >> (BITS * height)) & MASK];
+      child = assign(nodes, child, height - 1, slot, surface);
+      return branch;
+    }
+
+    // Null if nothing's been put in that slot's leaf
+    Leaf const *leaf(std::size_t slot) const {
+      if (slot >= this->capacity()) return nullptr;
+      void const *node = mRoot.get();
+      for (unsigned height = mDepth; node != nullptr && height > 0; --height) {
+        node = static_cast<Branch const *>(node)->children[
+          (slot >> (BITS * height)) & MASK
+        ].get();
+      }
+      return static_cast<Leaf const *>(node);
+    }
+
+    bool used(std::size_t slot) const {
+      Leaf const *leaf = this->leaf(slot);
+      return leaf != nullptr && (leaf->used >> (slot & MASK)) & 1;
+    }
+
+  public:
+    class const_iterator final {
+    private:
+      Surfaces const *mTable;
+      std::size_t mSlot;
+      Leaf const *mLeaf;
+
+      // Onto the first slot in use from here on, a leaf at a time
+      void settle() {
+        std::size_t end = mTable->capacity();
+        while (mSlot < end) {
+          if (mLeaf == nullptr || (mSlot & MASK) == 0) {
+            mLeaf = mTable->leaf(mSlot);
+          }
+          if (mLeaf == nullptr) {
+            mSlot = (mSlot | MASK) + 1;
+            continue;
+          }
+          if ((mLeaf->used >> (mSlot & MASK)) & 1) return;
+          ++mSlot;
+        }
+        mLeaf = nullptr;
+      }
+
+    public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = Surface;
+      using difference_type = std::ptrdiff_t;
+      using pointer = Surface const *;
+      using reference = Surface const &;
+
+      const_iterator(Surfaces const &table, std::size_t slot)
+        : mTable{&table}, mSlot{slot}, mLeaf{nullptr}
+      { this->settle(); }
+
+      reference operator*() const { return mLeaf->surfaces[mSlot & MASK]; }
+      pointer operator->() const { return &**this; }
+
+      const_iterator &operator++() {
+        ++mSlot;
+        this->settle();
+        return *this;
+      }
+
+      const_iterator operator++(int) {
+        const_iterator result = *this;
+        ++*this;
+        return result;
+      }
+
+      bool operator==(const_iterator const &other) const {
+        return mSlot == other.mSlot;
+      }
+      bool operator!=(const_iterator const &other) const {
+        return mSlot != other.mSlot;
+      }
+    };
+
+    Surfaces() = default;
+    // Everything in it has to be gone before the arena goes
+    explicit Surfaces(arena::Arena &nodes) : mNodes{&nodes} {}
+
+    std::size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+
+    const_iterator begin() const { return {*this, 0}; }
+    const_iterator end() const { return {*this, this->capacity()}; }
+
+    Surfaces with(std::size_t slot, Surface const &surface) const {
+      Surfaces result = *this;
+      while (slot >= result.capacity()) {
+        // What's there already goes at the front of a new root
+        auto root = make<Branch>(mNodes);
+        root->children[0] = std::move(result.mRoot);
+        result.mRoot = std::move(root);
+        ++result.mDepth;
+      }
+      if (!result.used(slot)) ++result.mSize;
+      result.mRoot = assign(
+        mNodes, result.mRoot, result.mDepth, slot, &surface
+      );
+      return result;
+    }
+
+    Surfaces without(std::size_t slot) const {
+      if (!this->used(slot)) return *this;
+      Surfaces result = *this;
+      --result.mSize;
+      result.mRoot = assign(
+        mNodes, result.mRoot, result.mDepth, slot, nullptr
+      );
+      return result;
+    }
+  };
+
+  // Everything on screen at one point in time. Snapshots are never modified
+  // once published, so any number of outputs can look at one at once.
+  struct Snapshot {
+    uint64_t generation;
+    // When the newest commit in this snapshot happened
+    Clock::time_point committed;
+    Surfaces surfaces;
+  };
+
+  // Which surfaces an output put on screen with one flip, and when
+  struct Presentation {
+    // Which output (e.g. its CRTC)
+    uint32_t output;
+    // The snapshot that was shown
+    uint64_t generation;
+    Clock::time_point time;
+    // How long the output's frames last, or zero if unknown
+    Clock::duration refresh;
+    // The output's vblank counter
+    unsigned int sequence;
+    // Surfaces at least partly on the output, as (client, id). Shared
+    // between presentations of the same snapshot.
+    std::shared_ptr<std::vector<std::pair<std::size_t, uint32_t>> const>
+      visible;
+  };
+
+  // Collects surface state committed by the protocol side and hands
+  // snapshots of it to the outputs. Outputs never wait on the protocol side
+  // (or each other) to pick up the latest snapshot.
+  class Hub final {
+  private:
+    using Buffer = detail::TripleBuffer<std::shared_ptr<Snapshot const>>;
+
+    // The table's nodes and the snapshots, so that committing reuses what
+    // the outputs are done with rather than allocating. First, as it has to
+    // go last.
+    arena::Arena mNodes;
+    // Serializes the writers. Readers never take it.
+    std::mutex mMutex;
+    // Each surface's slot in the table, and the slots given back
+    std::map<std::pair<std::size_t, uint32_t>, std::size_t> mSlots;
+    std::vector<std::size_t> mFreeSlots;
+    std::size_t mNextSlot;
+    Surfaces mSurfaces;
+    std::shared_ptr<Snapshot const> mLatest;
+    // Subscriptions that went away are dropped on the next publish
+    std::vector<std::weak_ptr<Buffer>> mSubscribers;
+    // Presentations waiting for the protocol side to pick them up
+    std::mutex mPresentedMutex;
+    std::vector<Presentation> mPresented;
+    std::function<void()> mOnPresented;
+
+    // Should be synchronized by mMutex
+    uint64_t next_generation() const {
+      return mLatest ? mLatest->generation + 1 : 1;
+    }
+
+    // Should be synchronized by mMutex
+    void put(Surface surface) {
+      auto key = std::make_pair(surface.client, surface.id);
+      auto [it, added] = mSlots.try_emplace(key, 0);
+      if (added) {
+        if (mFreeSlots.empty()) {
+          it->second = mNextSlot++;
+        } else {
+          it->second = mFreeSlots.back();
+          mFreeSlots.pop_back();
+        }
+      }
+      mSurfaces = mSurfaces.with(it->second, surface);
+    }
+
+    // Should be synchronized by mMutex. Says whether it was there.
+    bool erase(std::size_t client, uint32_t id) {
+      auto it = mSlots.find(std::make_pair(client, id));
+      if (it == mSlots.end()) return false;
+      mSurfaces = mSurfaces.without(it->second);
+      mFreeSlots.push_back(it->second);
+      mSlots.erase(it);
+      return true;
+    }
+
+    // Should be synchronized by mMutex. The table is shared with the
+    // snapshot, not copied.
+    void publish(Clock::time_point committed) {
+      mLatest = std::allocate_shared<Snapshot const>(
+        arena::Allocator<Snapshot>{mNodes}
+      , Snapshot{this->next_generation(), committed, mSurfaces}
+      );
+
+      auto it = mSubscribers.begin();
+      while (it != mSubscribers.end()) {
+        if (auto buffer = it->lock()) {
+          buffer->back() = mLatest;
+          buffer->publish();
+          ++it;
+        } else {
+          it = mSubscribers.erase(it);
+        }
+      }
+    }
+
+  public:
+    // One output's view of the scene. Only use it on one thread.
+    class Subscription final {
+    private:
+      std::shared_ptr<Buffer> mBuffer;
+      Hub *mHub{nullptr};
+    public:
+      Subscription() = default;
+      Subscription(std::shared_ptr<Buffer> buffer, Hub &hub)
+        : mBuffer{std::move(buffer)}, mHub{&hub}
+      {}
+
+      explicit operator bool() const { return mBuffer != nullptr; }
+
+      // Picks up the latest snapshot, and says whether there was a new one
+      bool update() { return *this && mBuffer->update(); }
+
+      // Null until anything has been committed
+      Snapshot const *current() const {
+        return *this ? mBuffer->front().get() : nullptr;
+      }
+
+      // Tell the protocol side a snapshot made it on screen
+      void present(Presentation presentation) {
+        if (*this) mHub->present(std::move(presentation));
+      }
+    };
+
+    // Changes to any number of surfaces that go out together in one
+    // snapshot, when this goes. Other writers wait until then, so keep it
+    // short, and don't use the hub any other way on this thread meanwhile.
+    class Transaction final {
+    private:
+      Hub &mHub;
+      std::unique_lock<std::mutex> mLock;
+      Clock::time_point mCommitted;
+      bool mChanged;
+    public:
+      Transaction(Hub &hub, Clock::time_point committed = Clock::now())
+        : mHub{hub}, mLock{hub.mMutex}, mCommitted{committed}, mChanged{false}
+      {}
+      Transaction(Transaction const &) = delete;
+      Transaction &operator=(Transaction const &) = delete;
+      ~Transaction() {
+        if (mChanged) mHub.publish(mCommitted);
+      }
+
+      // Returns the generation of the snapshot the surface will be in
+      uint64_t commit(Surface surface) {
+        mHub.put(std::move(surface));
+        mChanged = true;
+        return mHub.next_generation();
+      }
+
+      void remove(std::size_t client, uint32_t id) {
+        if (mHub.erase(client, id)) mChanged = true;
+      }
+    };
+
+    // Everything it hands out has to be gone before it goes
+    Hub()
+      : mNodes{}, mMutex{}, mSlots{}, mFreeSlots{}, mNextSlot{0}
+      , mSurfaces{mNodes}
+      , mLatest{}, mSubscribers{}
+      , mPresentedMutex{}, mPresented{}, mOnPresented{}
+    {}
+    Hub(Hub const &) = delete;
+    Hub &operator=(Hub const &) = delete;
+
+    // Thread safe. The latest snapshot is there straight away.
+    Subscription subscribe() {
+      auto buffer = std::make_shared<Buffer>();
+      auto lock = std::lock_guard(mMutex);
+      if (mLatest) {
+        buffer->back() = mLatest;
+        buffer->publish();
+      }
+      mSubscribers.push_back(buffer);
+      return Subscription{std::move(buffer), *this};
+    }
+
+    // Thread safe. Returns the generation of the snapshot the surface is in.
+    uint64_t commit(
+      Surface surface, Clock::time_point committed = Clock::now()
+    ) {
+      return Transaction{*this, committed}.commit(std::move(surface));
+    }
+
+    // Thread safe
+    void remove(std::size_t client, uint32_t id) {
+      Transaction{*this}.remove(client, id);
+    }
+
+    // Thread safe. For when a connection goes away.
+    void remove_client(std::size_t client) {
+      auto lock = std::lock_guard(mMutex);
+      auto first = mSlots.lower_bound({client, 0});
+      auto last = mSlots.lower_bound({client + 1, 0});
+      if (first == last) return;
+      for (auto it = first; it != last; ++it) {
+        mSurfaces = mSurfaces.without(it->second);
+        mFreeSlots.push_back(it->second);
+      }
+      mSlots.erase(first, last);
+      this->publish(Clock::now());
+    }
+
+    // Thread safe. Called whenever presentations arrive after all earlier
+    // ones were taken, from whichever thread presented. Presentations are
+    // dropped while nobody is listening.
+    void on_presented(std::function<void()> callback) {
+      auto lock = std::lock_guard(mPresentedMutex);
+      mOnPresented = std::move(callback);
+      mPresented.clear();
+    }
+
+    // Thread safe
+    void present(Presentation presentation) {
+      auto lock = std::lock_guard(mPresentedMutex);
+      if (!mOnPresented) return;
+      mPresented.push_back(std::move(presentation));
+      if (mPresented.size() == 1) mOnPresented();
+    }
+
+    // Thread safe. They're swapped into the vector, which is emptied first,
+    // so that neither side has to allocate room for them again.
+    void take_presented(std::vector<Presentation> &presented) {
+      presented.clear();
+      auto lock = std::lock_guard(mPresentedMutex);
+      std::swap(presented, mPresented);
+    }
+  };
+}}
+
+#endif
@@ -0,0 +1,197 @@
+#ifndef UUID_A94E71C3_2F05_4B6D_8C1A_D3E6B25F0874
+#define UUID_A94E71C3_2F05_4B6D_8C1A_D3E6B25F0874
+
+#include <waypositor/detail/raiithread.hpp>
+#include <waypositor/logger.hpp>
+#include <waypositor/metrics.hpp>
+
+#include <cstdlib>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <experimental/filesystem>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+
+namespace waypositor { namespace stats {
+  namespace asio = boost::asio;
+  namespace filesystem = std::experimental::filesystem;
+  using Domain = asio::local::stream_protocol;
+
+  // Serves snapshots of a metrics registry on a socket in XDG_RUNTIME_DIR,
+  // from a thread of its own so that a scrape never holds anything else up.
+  // A client sends a line and gets the metrics in the Prometheus text
+  // format. If the line is an HTTP request, the answer is an HTTP response,
+  // so e.g. `curl --unix-socket` works too.
+  class Endpoint final {
+  private:
+    enum class State { LISTENING, ACCEPTED };
+    Logger &mLog;
+    metrics::Registry const &mRegistry;
+    asio::io_service mAsio;
+    Domain::acceptor mAcceptor;
+    Domain::socket mSocket;
+    State mState;
+    detail::RAIIThread mThread;
+
+    // One client, answered once. Kept alive by its handlers.
+    struct Session {
+      Domain::socket socket;
+      asio::streambuf request{4096};
+      std::string response{};
+      explicit Session(Domain::socket socket_) : socket{std::move(socket_)} {}
+    };
+
+    void answer(std::shared_ptr<Session> session) {
+      auto body = mRegistry.scrape();
+      std::istream request{&session->request};
+      std::string line{};
+      std::getline(request, line);
+      if (line.compare(0, 4, "GET ") != 0) {
+        session->response = std::move(body);
+      } else {
+        session->response =
+          "HTTP/1.0 200 OK\r\n"
+          "Content-Type: text/plain; version=0.0.4\r\n"
+          "Content-Length: " + std::to_string(body.size()) + "\r\n"
+          "Connection: close\r\n\r\n" + body;
+      }
+      asio::async_write(
+        session->socket, asio::buffer(session->response)
+      , [session](boost::system::error_code const &, std::size_t) {
+          // Nothing more to say either way
+        }
+      );
+    }
+
+    void serve(Domain::socket socket) {
+      auto session = std::make_shared<Session>(std::move(socket));
+      asio::async_read_until(
+        session->socket, session->request, '\n'
+      , [this, session](
+          boost::system::error_code const &error, std::size_t
+        ) {
+          if (error) return;
+          std::string_view start{
+            static_cast<char const *>(session->request.data().data())
+          , session->request.size()
+          };
+          if (start.compare(0, 4, "GET ") != 0) {
+            this->answer(session);
+            return;
+          }
+          // Headers follow an HTTP request line; wait for the end of them
+          asio::async_read_until(
+            session->socket, session->request, "\r\n\r\n"
+          , [this, session](
+              boost::system::error_code const &error, std::size_t
+            ) {
+              if (!error) this->answer(session);
+            }
+          );
+        }
+      );
+    }
+
+    class Worker final {
+    private:
+      Endpoint *self;
+    public:
+      Worker(Endpoint &self_) : self{&self_} {}
+      Worker(Worker const &);
+      Worker &operator=(Worker const &);
+      Worker(Worker &&other) noexcept : self{other.self} {
+        other.self = nullptr;
+      }
+      Worker &operator=(Worker &&other) {
+        if (this == &other) return *this;
+        self = other.self;
+        other.self = nullptr;
+        return *this;
+      }
+      ~Worker() = default;
+
+      void operator()(boost::system::error_code const &error = {}) {
+        if (error) {
+          self->mLog.error("(Stats) ASIO error: ", error.message());
+          return;
+        }
+
+        switch (self->mState) {
+        case State::ACCEPTED:
+          self->serve(std::move(self->mSocket));
+          // Fall through
+        case State::LISTENING:
+          self->mState = State::ACCEPTED;
+          self->mAcceptor.async_accept(self->mSocket, std::move(*this));
+          return;
+        }
+      }
+    };
+
+    struct Private {};
+  public:
+    Endpoint(
+      Private, Logger &log, metrics::Registry &registry
+    , filesystem::path const &path
+    ) : mLog{log}, mRegistry{registry}, mAsio{}
+      , mAcceptor{mAsio, path.native()}, mSocket{mAsio}
+      , mState{State::LISTENING}
+      , mThread{
+          detail::ThreadPolicy::from_environment("STATS")
+        , [this] {
+            Worker{*this}();
+            mAsio.run();
+          }
+        }
+    {
+      mLog.register_thread(mThread.get_id(), "Stats");
+      mLog.info("Stats thread scheduling: ", mThread.policy().description);
+      detail::export_policy(registry, "Stats", mThread.policy());
+    }
+
+    ~Endpoint() {
+      // Clients that never say anything would keep it running otherwise.
+      // Their sessions go with the io_service.
+      mAsio.stop();
+      mLog.unregister_thread(mThread.get_id());
+      // The thread is joined first, as it's the last member
+    }
+
+    // The socket goes next to the Wayland one, in XDG_RUNTIME_DIR
+    static std::optional<Endpoint> create(
+      Logger &log, metrics::Registry &registry
+    , std::string_view socket_name
+    ) {
+      char const *xdg_runtime = std::getenv("XDG_RUNTIME_DIR");
+      if (xdg_runtime == nullptr) {
+        log.error("XDG_RUNTIME_DIR must be set");
+        return std::nullopt;
+      }
+      filesystem::path socket{xdg_runtime};
+      socket /= std::string{socket_name};
+
+      if (filesystem::exists(socket)) {
+        std::error_code error;
+        filesystem::remove(socket, error);
+        if (error) {
+          log.error("Couldn't remove existing stats socket");
+          return std::nullopt;
+        }
+      }
+
+      log.info("Serving stats on ", socket);
+      return std::make_optional<Endpoint>(Private{}, log, registry, socket);
+    }
+  };
+}}
+
+#endif
@@ -0,0 +1,1253 @@
+#ifndef UUID_B47EA2DB_BAC9_4A92_BFD4_A2B267B033B6
+#define UUID_B47EA2DB_BAC9_4A92_BFD4_A2B267B033B6
+
+#include <waypositor/protocol.hpp>
+#include <waypositor/scene.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/intrusive/list.hpp>
+
+namespace waypositor {
+  struct Rect {
+    int32_t x{0};
+    int32_t y{0};
+    int32_t width{0};
+    int32_t height{0};
+
+    bool empty() const { return width <= 0 || height <= 0; }
+
+    bool contains(int32_t px, int32_t py) const {
+      return px >= x && py >= y && px - x < width && py - y < height;
+    }
+
+    // The smallest rectangle covering both
+    Rect united(Rect const &other) const {
+      if (empty()) return other;
+      if (other.empty()) return *this;
+      int32_t left = std::min(x, other.x);
+      int32_t top = std::min(y, other.y);
+      int32_t right = std::max(x + width, other.x + other.width);
+      int32_t bottom = std::max(y + height, other.y + other.height);
+      return {left, top, right - left, bottom - top};
+    }
+  };
+
+  // A region is kept as the list of rectangles added and subtracted, in
+  // order. The last one covering a point decides whether it's inside.
+  struct RegionData {
+    std::vector<std::pair<Rect, bool>> operations{};
+
+    bool contains(int32_t x, int32_t y) const {
+      for (auto it = operations.rbegin(); it != operations.rend(); ++it) {
+        if (it->first.contains(x, y)) return it->second;
+      }
+      return false;
+    }
+  };
+
+  // When a content update of a surface made it on screen
+  struct Frame {
+    scene::Clock::time_point time;
+    // Zero if unknown
+    scene::Clock::duration refresh;
+    // The output's vblank counter
+    unsigned int sequence;
+  };
+
+  // Something waiting for a surface's content update to be shown, i.e. a
+  // frame callback or presentation feedback. Listeners live in the
+  // connection's object map like any other object, and are linked into
+  // their surface's lists without any allocation of their own. They unlink
+  // themselves when destroyed.
+  class FrameListener
+    : public Connection::Dispatchable
+    , public boost::intrusive::list_base_hook<
+        boost::intrusive::link_mode<boost::intrusive::auto_unlink>
+      >
+  {
+  private:
+    // The snapshot with the content update in it
+    uint64_t mGeneration{0};
+    // The snapshot with the surface's next content update, if any
+    uint64_t mSuperseded{0};
+  public:
+    uint64_t generation() const { return mGeneration; }
+    void set_generation(uint64_t generation) { mGeneration = generation; }
+
+    // Whether the content update was replaced before (or when) the
+    // generation was shown
+    bool superseded(uint64_t generation) const {
+      return mSuperseded != 0 && mSuperseded <= generation;
+    }
+    bool superseded() const { return mSuperseded != 0; }
+    void set_superseded(uint64_t generation) { mSuperseded = generation; }
+
+    // Both of these destroy the listener
+    virtual void presented(Frame const &frame) = 0;
+    // The content update never made it on screen
+    virtual void discarded(Frame const &frame) = 0;
+  };
+
+  using FrameListeners = boost::intrusive::list<
+    FrameListener, boost::intrusive::constant_time_size<false>
+  >;
+
+  // A wl_callback from wl_surface.frame. Clients only want to know when to
+  // draw next, so it makes no difference whether their update was shown.
+  class FrameCallback final : public FrameListener {
+  private:
+    Connection &mConnection;
+    uint32_t mId;
+
+    void done(Frame const &frame) {
+      auto milliseconds = static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+          frame.time.time_since_epoch()
+        ).count()
+      );
+      mConnection.send(Event{mId, 0}.uint(milliseconds));
+      mConnection.destroy(mId);
+    }
+  public:
+    FrameCallback(Connection &connection, uint32_t id)
+      : mConnection{connection}, mId{id}
+    {}
+
+    void presented(Frame const &frame) override { this->done(frame); }
+    void discarded(Frame const &frame) override { this->done(frame); }
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      // wl_callback has no requests
+      sync->log_error("Bad request for callback: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wl_callback"; }
+  };
+
+  // A wp_presentation_feedback
+  class PresentationFeedback final : public FrameListener {
+  private:
+    Connection &mConnection;
+    uint32_t mId;
+  public:
+    enum Flags : uint32_t {
+      VSYNC = 0x1
+    , HW_CLOCK = 0x2
+    , HW_COMPLETION = 0x4
+    , ZERO_COPY = 0x8
+    };
+
+    PresentationFeedback(Connection &connection, uint32_t id)
+      : mConnection{connection}, mId{id}
+    {}
+
+    void presented(Frame const &frame) override {
+      using namespace std::chrono;
+      auto since_epoch = frame.time.time_since_epoch();
+      auto seconds = duration_cast<std::chrono::seconds>(since_epoch);
+      auto nanoseconds = duration_cast<std::chrono::nanoseconds>(
+        since_epoch - seconds
+      );
+      auto refresh = duration_cast<std::chrono::nanoseconds>(frame.refresh);
+      auto tv_sec = static_cast<uint64_t>(seconds.count());
+      // Flips land on a vblank, and their time comes from the kernel's
+      // record of the flip completing. Outputs composite every surface, so
+      // nothing is zero copy.
+      mConnection.send(
+        Event{mId, 1}
+          .uint(static_cast<uint32_t>(tv_sec >> 32))
+          .uint(static_cast<uint32_t>(tv_sec))
+          .uint(static_cast<uint32_t>(nanoseconds.count()))
+          .uint(static_cast<uint32_t>(refresh.count()))
+          .uint(0).uint(frame.sequence)
+          .uint(VSYNC | HW_CLOCK | HW_COMPLETION)
+      );
+      mConnection.destroy(mId);
+    }
+
+    void discarded(Frame const &) override {
+      mConnection.send(Event{mId, 2});
+      mConnection.destroy(mId);
+    }
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      // wp_presentation_feedback has no requests
+      sync->log_error("Bad request for feedback: ", message.opcode());
+    }
+
+    char const *interface() const override {
+      return "wp_presentation_feedback";
+    }
+  };
+
+  // Anything that can be attached to a surface (e.g. a wl_shm or dmabuf
+  // buffer)
+  class Buffer : public Connection::Dispatchable {
+  public:
+    char const *interface() const override { return "wl_buffer"; }
+
+    virtual int32_t width() const = 0;
+    virtual int32_t height() const = 0;
+    // Shared with the renderer, never copied
+    virtual std::shared_ptr<void const> contents() const = 0;
+    // The client may write to it again
+    virtual void release() = 0;
+  };
+
+  // One slot of double-buffered surface state. Requests fill in the pending
+  // slot and flag what they touched. Committing moves only the flagged
+  // fields into the next slot, and every field moves in constant time, so a
+  // commit costs the same however much state the surface carries.
+  struct SurfaceState {
+    enum Field : uint32_t {
+      BUFFER = 1 << 0
+    , SURFACE_DAMAGE = 1 << 1
+    , BUFFER_DAMAGE = 1 << 2
+    , FRAME = 1 << 3
+    , OPAQUE_REGION = 1 << 4
+    , INPUT_REGION = 1 << 5
+    , TRANSFORM = 1 << 6
+    , SCALE = 1 << 7
+    };
+    uint32_t dirty{0};
+
+    std::shared_ptr<void const> buffer{};
+    // The wl_buffer it came from, to be released once it's replaced
+    uint32_t buffer_id{0};
+    int32_t buffer_width{0};
+    int32_t buffer_height{0};
+    // How far the surface moves, from wl_surface.attach
+    int32_t dx{0};
+    int32_t dy{0};
+    // Only the extents of the damage are kept
+    Rect surface_damage{};
+    Rect buffer_damage{};
+    // Frame callbacks and presentation feedback
+    FrameListeners frame_listeners{};
+    // Regions are shared with the wl_region they came from until it
+    // changes. No opaque region means nothing is opaque; no input region
+    // means all of the surface takes input.
+    std::shared_ptr<RegionData const> opaque_region{};
+    std::shared_ptr<RegionData const> input_region{};
+    int32_t transform{0};
+    int32_t scale{1};
+
+    // Move the dirty fields into next, merging with whatever is there
+    // already, and leave this slot clean
+    void commit_to(SurfaceState &next) {
+      if (dirty & BUFFER) {
+        next.buffer = std::move(buffer);
+        next.buffer_id = buffer_id;
+        next.buffer_width = buffer_width;
+        next.buffer_height = buffer_height;
+        next.dx += dx;
+        next.dy += dy;
+        dx = dy = 0;
+      }
+      if (dirty & SURFACE_DAMAGE) {
+        next.surface_damage = next.surface_damage.united(surface_damage);
+        surface_damage = {};
+      }
+      if (dirty & BUFFER_DAMAGE) {
+        next.buffer_damage = next.buffer_damage.united(buffer_damage);
+        buffer_damage = {};
+      }
+      if (dirty & FRAME) {
+        next.frame_listeners.splice(
+          next.frame_listeners.end(), frame_listeners
+        );
+      }
+      if (dirty & OPAQUE_REGION) {
+        next.opaque_region = std::move(opaque_region);
+      }
+      if (dirty & INPUT_REGION) next.input_region = std::move(input_region);
+      if (dirty & TRANSFORM) next.transform = transform;
+      if (dirty & SCALE) next.scale = scale;
+      next.dirty |= dirty;
+      dirty = 0;
+    }
+  };
+
+  class Region final : public Connection::Dispatchable {
+  private:
+    Connection &mConnection;
+    uint32_t mId;
+    std::shared_ptr<RegionData> mData;
+
+    void change(Rect rect, bool add) {
+      // Copy on write, as surfaces may be sharing the old state
+      if (mData.use_count() > 1) {
+        mData = std::allocate_shared<RegionData>(
+          arena::Allocator<RegionData>{mConnection.arena()}, *mData
+        );
+      }
+      mData->operations.emplace_back(rect, add);
+    }
+  public:
+    Region(Connection &connection, uint32_t id)
+      : mConnection{connection}, mId{id}
+      , mData{std::allocate_shared<RegionData>(
+          arena::Allocator<RegionData>{connection.arena()}
+        )}
+    {}
+
+    std::shared_ptr<RegionData const> snapshot() const { return mData; }
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: // destroy
+        mConnection.destroy(mId);
+        return;
+      case 1: // add
+      case 2: { // subtract
+        Rect rect{};
+        rect.x = message.integer();
+        rect.y = message.integer();
+        rect.width = message.integer();
+        rect.height = message.integer();
+        if (!message) break;
+        this->change(rect, message.opcode() == 1);
+        return;
+      }
+      default:
+        break;
+      }
+      sync->log_error("Bad request for region: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wl_region"; }
+  };
+
+  class Subsurface;
+  class Surface;
+
+  // Answers frame callbacks. An output presenting a snapshot answers the
+  // callbacks of the surfaces it showed that were committed in time for it,
+  // all at once, right after its flip. Each client gets all of its events in
+  // one write. Surfaces that aren't on any output get theirs at a low rate
+  // instead, so their clients don't spin.
+  class FrameClock final {
+  private:
+    enum class State { STOPPED, RUNNING };
+    Logger &mLog;
+    asio::io_service &mAsio;
+    scene::Hub &mScene;
+    asio::steady_timer mTimer;
+    asio::steady_timer::duration mHiddenInterval;
+    using Surfaces = std::map<std::pair<std::size_t, uint32_t>, Surface *>;
+    Surfaces mSurfaces;
+    // Nodes of surfaces that are gone, for the next ones, so that surfaces
+    // coming and going don't allocate
+    std::vector<Surfaces::node_type> mSpare;
+    // Kept from one frame to the next, so that answering frame callbacks
+    // doesn't allocate
+    std::vector<Connection *> mCorked;
+    std::vector<scene::Presentation> mPresented;
+    State mState;
+
+    // Corks each connection it sees until it goes away. Only one at a time.
+    class Batch final {
+    private:
+      std::vector<Connection *> &mCorked;
+    public:
+      explicit Batch(std::vector<Connection *> &corked) : mCorked{corked} {}
+      Batch(Batch const &) = delete;
+      Batch &operator=(Batch const &) = delete;
+      ~Batch() {
+        for (Connection *connection : mCorked) connection->uncork();
+        mCorked.clear();
+      }
+
+      void include(Connection &connection) {
+        if (std::find(
+          mCorked.begin(), mCorked.end(), &connection
+        ) != mCorked.end()) {
+          return;
+        }
+        connection.cork();
+        mCorked.push_back(&connection);
+      }
+    };
+
+    class Worker final {
+    private:
+      FrameClock *self;
+    public:
+      Worker(FrameClock &self_) : self{&self_} {}
+      Worker(Worker const &);
+      Worker &operator=(Worker const &);
+      Worker(Worker &&other) noexcept : self{other.self} {
+        other.self = nullptr;
+      }
+      Worker &operator=(Worker &&other) {
+        if (this == &other) return *this;
+        self = other.self;
+        other.self = nullptr;
+        return *this;
+      }
+      ~Worker() = default;
+
+      void operator()(boost::system::error_code const &error = {}) {
+        if (error == asio::error::operation_aborted) return;
+        if (error) {
+          self->mLog.error("(Frame clock) ASIO error: ", error.message());
+          return;
+        }
+        if (self->mState == State::STOPPED) return;
+        self->throttled();
+        self->mTimer.expires_from_now(self->mHiddenInterval);
+        self->mTimer.async_wait(std::move(*this));
+      }
+    };
+
+    void presented();
+    void throttled();
+
+  public:
+    FrameClock(
+      Logger &log, asio::io_service &asio, scene::Hub &scene
+    , asio::steady_timer::duration hidden_interval = std::chrono::seconds{1}
+    ) : mLog{log}, mAsio{asio}, mScene{scene}, mTimer{asio}
+      , mHiddenInterval{hidden_interval}, mSurfaces{}, mSpare{}
+      , mCorked{}, mPresented{}
+      , mState{State::STOPPED}
+    {}
+    FrameClock(FrameClock const &) = delete;
+    FrameClock &operator=(FrameClock const &) = delete;
+    ~FrameClock() { this->stop(); }
+
+    // Call these on the protocol thread
+    void launch() {
+      mState = State::RUNNING;
+      mScene.on_presented([this] {
+        mAsio.post([this] { this->presented(); });
+      });
+      mTimer.expires_from_now(mHiddenInterval);
+      mTimer.async_wait(Worker{*this});
+    }
+
+    void stop() {
+      if (mState == State::STOPPED) return;
+      mState = State::STOPPED;
+      mScene.on_presented(nullptr);
+      boost::system::error_code error;
+      mTimer.cancel(error);
+    }
+
+    // Only for Surface
+    void add(std::size_t client, uint32_t id, Surface &surface) {
+      if (mSpare.empty()) {
+        mSurfaces.insert_or_assign({client, id}, &surface);
+        return;
+      }
+      Surfaces::node_type node = std::move(mSpare.back());
+      mSpare.pop_back();
+      node.key() = {client, id};
+      node.mapped() = &surface;
+      auto result = mSurfaces.insert(std::move(node));
+      if (result.inserted) return;
+      result.position->second = &surface;
+      mSpare.push_back(std::move(result.node));
+    }
+
+    void remove(std::size_t client, uint32_t id) {
+      if (auto node = mSurfaces.extract({client, id})) {
+        mSpare.push_back(std::move(node));
+      }
+    }
+  };
+
+  class Surface final : public Connection::Dispatchable {
+  private:
+    Connection &mConnection;
+    FrameClock &mFrames;
+    uint32_t mId;
+    SurfaceState mPending;
+    // Commits of synchronized subsurfaces wait here for the parent's commit
+    SurfaceState mCached;
+    SurfaceState mCurrent;
+    // On screen, or relative to the parent for subsurfaces
+    int32_t mX;
+    int32_t mY;
+    // Frame listeners waiting for their snapshot to be shown, oldest first
+    FrameListeners mWaiting;
+    // When listeners were last answered (or the surface was last shown)
+    scene::Clock::time_point mLastFrame;
+    // The wl_buffer in the scene, if any
+    uint32_t mShownBuffer;
+
+    // Only for subsurfaces
+    Surface *mParent;
+    Subsurface *mRole;
+    bool mSynchronized;
+    // Applied on the parent's commit
+    std::optional<std::pair<int32_t, int32_t>> mPendingPosition;
+
+    // Subsurfaces, bottom to top. Restacking applies on this surface's
+    // commit.
+    std::vector<Surface *> mChildren;
+    std::vector<Surface *> mPendingChildren;
+    bool mChildrenChanged;
+
+    bool synchronized() const {
+      for (Surface const *surface = this; surface->mParent != nullptr;
+           surface = surface->mParent) {
+        if (surface->mSynchronized) return true;
+      }
+      return false;
+    }
+
+    std::pair<int32_t, int32_t> position() const {
+      if (mParent == nullptr) return {mX, mY};
+      auto [x, y] = mParent->position();
+      return {x + mX, y + mY};
+    }
+
+    // Returns the generation of the snapshot with the surface in it, or 0
+    // if it was taken off screen
+    uint64_t publish(scene::Hub::Transaction &scene) {
+      if (!mCurrent.buffer) {
+        scene.remove(mConnection.id(), mId);
+        return 0;
+      }
+      auto [x, y] = this->position();
+      int32_t scale = std::max(mCurrent.scale, 1);
+      return scene.commit(scene::Surface{
+        mConnection.id(), mId, x, y
+      , mCurrent.buffer_width / scale, mCurrent.buffer_height / scale
+      , mCurrent.buffer
+      });
+    }
+
+    // Make the current state visible, along with whatever synchronized
+    // subsurfaces had cached. A surface without new content is only put in
+    // the scene again if it moved (or an ancestor did), and what's waiting
+    // to be shown of it is still the latest.
+    void apply(scene::Hub::Transaction &scene, bool updated, bool moved) {
+      if (mCurrent.dx != 0 || mCurrent.dy != 0) moved = true;
+      mX += mCurrent.dx;
+      mY += mCurrent.dy;
+      mCurrent.dx = mCurrent.dy = 0;
+      if (updated) {
+        if (mChildrenChanged) {
+          mChildren = mPendingChildren;
+          mChildrenChanged = false;
+        }
+        uint64_t generation = this->publish(scene);
+        // Nothing reads the pixels of the buffer that was shown before (the
+        // renderer only has its size), so it can go back to the client as
+        // soon as it's replaced
+        if (mCurrent.buffer_id != mShownBuffer) {
+          if (auto shown = mConnection.find<Buffer>(mShownBuffer)) {
+            shown->release();
+          }
+          mShownBuffer = mCurrent.buffer_id;
+        }
+        // This replaces the content updates still waiting to be shown. Only
+        // the ones at the back haven't been replaced yet.
+        for (auto it = mWaiting.rbegin();
+             it != mWaiting.rend() && !it->superseded(); ++it) {
+          it->set_superseded(generation);
+        }
+        // The listeners of this commit are done once the snapshot is shown
+        for (FrameListener &listener : mCurrent.frame_listeners) {
+          listener.set_generation(generation);
+        }
+        mWaiting.splice(mWaiting.end(), mCurrent.frame_listeners);
+        // Damage has been handed on with the buffer
+        mCurrent.surface_damage = {};
+        mCurrent.buffer_damage = {};
+      } else if (moved) {
+        this->publish(scene);
+      }
+
+      for (Surface *child : mChildren) {
+        bool child_moved = moved;
+        if (child->mPendingPosition) {
+          std::tie(child->mX, child->mY) = *child->mPendingPosition;
+          child->mPendingPosition = std::nullopt;
+          child_moved = true;
+        }
+        bool child_updated = updated && child->synchronized()
+                          && child->mCached.dirty != 0;
+        if (child_updated) child->mCached.commit_to(child->mCurrent);
+        if (child_updated || child_moved) {
+          child->apply(scene, child_updated, child_moved);
+        }
+      }
+    }
+
+    void commit() {
+      if (this->synchronized()) {
+        mPending.commit_to(mCached);
+        return;
+      }
+      // Anything cached while synchronized goes first
+      mCached.commit_to(mCurrent);
+      mPending.commit_to(mCurrent);
+      // Everything it brings along goes out in one snapshot
+      scene::Hub::Transaction scene{mConnection.scene()};
+      this->apply(scene, true, false);
+    }
+
+    void remove_child(Surface *child) {
+      auto erase = [child](std::vector<Surface *> &children) {
+        children.erase(
+          std::remove(children.begin(), children.end(), child)
+        , children.end()
+        );
+      };
+      erase(mChildren);
+      erase(mPendingChildren);
+    }
+
+  public:
+    Surface(Connection &connection, FrameClock &frames, uint32_t id)
+      : mConnection{connection}, mFrames{frames}, mId{id}
+      , mPending{}, mCached{}, mCurrent{}, mX{0}, mY{0}
+      , mWaiting{}, mLastFrame{scene::Clock::now()}, mShownBuffer{0}
+      , mParent{nullptr}, mRole{nullptr}, mSynchronized{true}
+      , mPendingPosition{std::nullopt}
+      , mChildren{}, mPendingChildren{}, mChildrenChanged{false}
+    { mFrames.add(mConnection.id(), mId, *this); }
+    Surface(Surface const &) = delete;
+    Surface &operator=(Surface const &) = delete;
+    ~Surface();
+
+    uint32_t id() const { return mId; }
+    Connection &connection() { return mConnection; }
+    Surface *parent() const { return mParent; }
+
+    // Whether any listeners are done once the generation is shown
+    bool waiting(uint64_t generation) const {
+      return !mWaiting.empty() && mWaiting.front().generation() <= generation;
+    }
+
+    scene::Clock::time_point last_frame() const { return mLastFrame; }
+
+    // The generation was shown in the given frame. Answer the listeners that
+    // were waiting for it.
+    void shown(uint64_t generation, Frame const &frame) {
+      mLastFrame = frame.time;
+      while (this->waiting(generation)) {
+        FrameListener &listener = mWaiting.front();
+        mWaiting.pop_front();
+        if (listener.superseded(generation)) {
+          listener.discarded(frame);
+        } else {
+          listener.presented(frame);
+        }
+      }
+    }
+
+    // The surface isn't on any output. Answer every listener.
+    void hidden(Frame const &frame) {
+      mLastFrame = frame.time;
+      while (!mWaiting.empty()) {
+        FrameListener &listener = mWaiting.front();
+        mWaiting.pop_front();
+        listener.discarded(frame);
+      }
+    }
+
+    // wl_surface.frame and wp_presentation.feedback
+    void listen(FrameListener &listener) {
+      mPending.frame_listeners.push_back(listener);
+      mPending.dirty |= SurfaceState::FRAME;
+    }
+
+    bool has_role() const { return mRole != nullptr; }
+
+    // Only for Subsurface
+    void make_subsurface(Surface &parent, Subsurface &role) {
+      mParent = &parent;
+      mRole = &role;
+      mSynchronized = true;
+      parent.mPendingChildren.push_back(this);
+      parent.mChildrenChanged = true;
+    }
+
+    void unmake_subsurface() {
+      if (mParent != nullptr) {
+        mParent->remove_child(this);
+        mParent = nullptr;
+      }
+      mRole = nullptr;
+      mConnection.scene().remove(mConnection.id(), mId);
+    }
+
+    void set_position(int32_t x, int32_t y) { mPendingPosition = {x, y}; }
+
+    void set_synchronized(bool synchronized) { mSynchronized = synchronized; }
+
+    // Put a subsurface right above or below a sibling (or the parent)
+    bool place(Surface &sibling, bool above) {
+      if (mParent == nullptr) return false;
+      auto &children = mParent->mPendingChildren;
+      children.erase(
+        std::remove(children.begin(), children.end(), this), children.end()
+      );
+      auto it = children.begin();
+      if (&sibling != mParent) {
+        it = std::find(children.begin(), children.end(), &sibling);
+        if (it == children.end()) {
+          children.push_back(this);
+          return false;
+        }
+        if (above) ++it;
+      }
+      // Relative to the parent, which is at the bottom of its own stack,
+      // both go to the bottom
+      children.insert(it, this);
+      mParent->mChildrenChanged = true;
+      return true;
+    }
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: // destroy
+        mConnection.destroy(mId);
+        return;
+      case 1: { // attach
+        uint32_t buffer_id = message.id();
+        int32_t dx = message.integer();
+        int32_t dy = message.integer();
+        if (!message) break;
+        mPending.buffer = nullptr;
+        mPending.buffer_id = 0;
+        mPending.buffer_width = mPending.buffer_height = 0;
+        if (auto buffer = mConnection.find<Buffer>(buffer_id)) {
+          mPending.buffer = buffer->contents();
+          mPending.buffer_id = buffer_id;
+          mPending.buffer_width = buffer->width();
+          mPending.buffer_height = buffer->height();
+        } else if (buffer_id != 0) {
+          sync->log_error("Can't attach object ", buffer_id);
+        }
+        mPending.dx += dx;
+        mPending.dy += dy;
+        mPending.dirty |= SurfaceState::BUFFER;
+        return;
+      }
+      case 2: // damage
+      case 9: { // damage_buffer
+        Rect rect{};
+        rect.x = message.integer();
+        rect.y = message.integer();
+        rect.width = message.integer();
+        rect.height = message.integer();
+        if (!message) break;
+        if (message.opcode() == 2) {
+          mPending.surface_damage = mPending.surface_damage.united(rect);
+          mPending.dirty |= SurfaceState::SURFACE_DAMAGE;
+        } else {
+          mPending.buffer_damage = mPending.buffer_damage.united(rect);
+          mPending.dirty |= SurfaceState::BUFFER_DAMAGE;
+        }
+        return;
+      }
+      case 3: { // frame
+        uint32_t callback_id = message.id();
+        if (!message) break;
+        if (auto callback = mConnection.create<FrameCallback>(
+              callback_id, mConnection, callback_id
+            )) {
+          this->listen(*callback);
+        }
+        return;
+      }
+      case 4: // set_opaque_region
+      case 5: { // set_input_region
+        uint32_t region_id = message.id();
+        if (!message) break;
+        std::shared_ptr<RegionData const> region{};
+        if (auto object = mConnection.find<Region>(region_id)) {
+          region = object->snapshot();
+        }
+        if (message.opcode() == 4) {
+          mPending.opaque_region = std::move(region);
+          mPending.dirty |= SurfaceState::OPAQUE_REGION;
+        } else {
+          mPending.input_region = std::move(region);
+          mPending.dirty |= SurfaceState::INPUT_REGION;
+        }
+        return;
+      }
+      case 6: // commit
+        this->commit();
+        return;
+      case 7: // set_buffer_transform
+        mPending.transform = message.integer();
+        if (!message) break;
+        mPending.dirty |= SurfaceState::TRANSFORM;
+        return;
+      case 8: // set_buffer_scale
+        mPending.scale = message.integer();
+        if (!message) break;
+        mPending.dirty |= SurfaceState::SCALE;
+        return;
+      default:
+        break;
+      }
+      sync->log_error("Bad request for surface: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wl_surface"; }
+  };
+  // Surfaces come and go with every window, menu and tooltip
+  static_assert(
+    sizeof(Surface) <= arena::Arena::CLASSES.back()
+  , "A surface has to fit in a connection's arena"
+  );
+
+  class Subsurface final : public Connection::Dispatchable {
+  private:
+    Connection &mConnection;
+    uint32_t mId;
+    // Null once the surface is gone
+    Surface *mSurface;
+  public:
+    Subsurface(
+      Connection &connection, uint32_t id, Surface &surface, Surface &parent
+    ) : mConnection{connection}, mId{id}, mSurface{&surface}
+    { surface.make_subsurface(parent, *this); }
+    Subsurface(Subsurface const &) = delete;
+    Subsurface &operator=(Subsurface const &) = delete;
+    ~Subsurface() { if (mSurface) mSurface->unmake_subsurface(); }
+
+    // Only for Surface
+    void forget_surface() { mSurface = nullptr; }
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: // destroy
+        mConnection.destroy(mId);
+        return;
+      case 1: { // set_position
+        int32_t x = message.integer();
+        int32_t y = message.integer();
+        if (!message) break;
+        if (mSurface) mSurface->set_position(x, y);
+        return;
+      }
+      case 2: // place_above
+      case 3: { // place_below
+        uint32_t sibling_id = message.id();
+        if (!message) break;
+        auto sibling = mConnection.find<Surface>(sibling_id);
+        if (!mSurface || !sibling || !mSurface->place(
+          *sibling, message.opcode() == 2
+        )) {
+          // bad_surface
+          sync->post_error(mId, 0, "Not a sibling or parent");
+        }
+        return;
+      }
+      case 4: // set_sync
+      case 5: // set_desync
+        if (mSurface) mSurface->set_synchronized(message.opcode() == 4);
+        return;
+      default:
+        break;
+      }
+      sync->log_error("Bad request for subsurface: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wl_subsurface"; }
+  };
+
+  inline Surface::~Surface() {
+    mFrames.remove(mConnection.id(), mId);
+    if (mRole != nullptr) mRole->forget_surface();
+    if (mParent != nullptr) mParent->remove_child(this);
+    for (Surface *child : mPendingChildren) child->mParent = nullptr;
+    mConnection.scene().remove(mConnection.id(), mId);
+  }
+
+  inline void FrameClock::presented() {
+    if (mState == State::STOPPED) return;
+    allocations::Forbid forbid{"answering frame callbacks"};
+    Batch batch{mCorked};
+    mScene.take_presented(mPresented);
+    for (scene::Presentation const &presentation : mPresented) {
+      if (!presentation.visible) continue;
+      for (auto const &key : *presentation.visible) {
+        auto it = mSurfaces.find(key);
+        if (it == mSurfaces.end()) continue;
+        Surface &surface = *it->second;
+        if (surface.waiting(presentation.generation)) {
+          batch.include(surface.connection());
+        }
+        surface.shown(
+          presentation.generation
+        , Frame{presentation.time, presentation.refresh, presentation.sequence}
+        );
+      }
+    }
+  }
+
+  inline void FrameClock::throttled() {
+    auto now = scene::Clock::now();
+    Batch batch{mCorked};
+    for (auto const &pair : mSurfaces) {
+      Surface &surface = *pair.second;
+      if (!surface.waiting(std::numeric_limits<uint64_t>::max())) continue;
+      if (now - surface.last_frame() < mHiddenInterval) continue;
+      batch.include(surface.connection());
+      surface.hidden(Frame{now, {}, 0});
+    }
+  }
+
+  class Compositor final : public Connection::Dispatchable {
+  private:
+    Connection &mConnection;
+    FrameClock &mFrames;
+  public:
+    Compositor(Connection &connection, FrameClock &frames)
+      : mConnection{connection}, mFrames{frames}
+    {}
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: { // create_surface
+        uint32_t id = message.id();
+        if (!message) break;
+        mConnection.create<Surface>(id, mConnection, mFrames, id);
+        return;
+      }
+      case 1: { // create_region
+        uint32_t id = message.id();
+        if (!message) break;
+        mConnection.create<Region>(id, mConnection, id);
+        return;
+      }
+      default:
+        break;
+      }
+      sync->log_error("Bad request for compositor: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wl_compositor"; }
+  };
+
+  class Subcompositor final : public Connection::Dispatchable {
+  private:
+    Connection &mConnection;
+    uint32_t mId;
+  public:
+    Subcompositor(Connection &connection, uint32_t id)
+      : mConnection{connection}, mId{id}
+    {}
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: // destroy
+        mConnection.destroy(mId);
+        return;
+      case 1: { // get_subsurface
+        uint32_t id = message.id();
+        uint32_t surface_id = message.id();
+        uint32_t parent_id = message.id();
+        if (!message) break;
+        auto surface = mConnection.find<Surface>(surface_id);
+        auto parent = mConnection.find<Surface>(parent_id);
+        bool cycle = false;
+        for (Surface *ancestor = parent; ancestor != nullptr;
+             ancestor = ancestor->parent()) {
+          if (ancestor == surface) cycle = true;
+        }
+        if (!surface || !parent || surface->has_role() || cycle) {
+          // bad_surface
+          sync->post_error(mId, 0, "Can't make that a subsurface");
+          return;
+        }
+        mConnection.create<Subsurface>(
+          id, mConnection, id, *surface, *parent
+        );
+        return;
+      }
+      default:
+        break;
+      }
+      sync->log_error("Bad request for subcompositor: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wl_subcompositor"; }
+  };
+
+  // wp_presentation. Feedback is timed by the outputs' page flips.
+  class PresentationTime final : public Connection::Dispatchable {
+  private:
+    Connection &mConnection;
+    uint32_t mId;
+  public:
+    PresentationTime(Connection &connection, uint32_t id)
+      : mConnection{connection}, mId{id}
+    {
+      // Flip times come from CLOCK_MONOTONIC
+      mConnection.send(Event{mId, 0}.uint(CLOCK_MONOTONIC));
+    }
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: // destroy
+        mConnection.destroy(mId);
+        return;
+      case 1: { // feedback
+        uint32_t surface_id = message.id();
+        uint32_t id = message.id();
+        if (!message) break;
+        auto feedback = mConnection.create<PresentationFeedback>(
+          id, mConnection, id
+        );
+        if (!feedback) return;
+        if (auto surface = mConnection.find<Surface>(surface_id)) {
+          surface->listen(*feedback);
+        } else {
+          // Not much else to say about a surface that's gone
+          feedback->discarded(Frame{scene::Clock::now(), {}, 0});
+        }
+        return;
+      }
+      default:
+        break;
+      }
+      sync->log_error("Bad request for presentation: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wp_presentation"; }
+  };
+
+  // wl_buffer, for a piece of a wl_shm_pool
+  class ShmBuffer final : public Buffer {
+  private:
+    Connection &mConnection;
+    uint32_t mId;
+    std::shared_ptr<void const> mContents;
+    int32_t mWidth;
+    int32_t mHeight;
+    int32_t mStride;
+    uint32_t mFormat;
+  public:
+    ShmBuffer(
+      Connection &connection, uint32_t id
+    , std::shared_ptr<void const> contents
+    , int32_t width, int32_t height, int32_t stride, uint32_t format
+    ) : mConnection{connection}, mId{id}, mContents{std::move(contents)}
+      , mWidth{width}, mHeight{height}, mStride{stride}, mFormat{format}
+    {}
+
+    int32_t width() const override { return mWidth; }
+    int32_t height() const override { return mHeight; }
+    std::shared_ptr<void const> contents() const override {
+      return mContents;
+    }
+    int32_t stride() const { return mStride; }
+    uint32_t format() const { return mFormat; }
+
+    void release() override { mConnection.send(Event{mId, 0}); }
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: // destroy
+        mConnection.destroy(mId);
+        return;
+      default:
+        break;
+      }
+      sync->log_error("Bad request for buffer: ", message.opcode());
+    }
+  };
+
+  // wl_shm_pool. The pool is mapped read only; buffers keep the mapping
+  // they were made from, so it outlives the pool if it has to.
+  class ShmPool final : public Connection::Dispatchable {
+  private:
+    Connection &mConnection;
+    uint32_t mId;
+    int mFd;
+    std::shared_ptr<void const> mMapping;
+    std::size_t mSize;
+  public:
+    // Null if it can't be mapped
+    static std::shared_ptr<void const> map(int fd, std::size_t size) {
+      void *data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED) return nullptr;
+      return std::shared_ptr<void const>{
+        data, [size](void const *mapped) {
+          ::munmap(const_cast<void *>(mapped), size);
+        }
+      };
+    }
+
+    // Takes the fd
+    ShmPool(
+      Connection &connection, uint32_t id, int fd
+    , std::shared_ptr<void const> mapping, std::size_t size
+    ) : mConnection{connection}, mId{id}, mFd{fd}
+      , mMapping{std::move(mapping)}, mSize{size}
+    {}
+    ShmPool(ShmPool const &) = delete;
+    ShmPool &operator=(ShmPool const &) = delete;
+    ~ShmPool() { ::close(mFd); }
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: { // create_buffer
+        uint32_t id = message.id();
+        int32_t offset = message.integer();
+        int32_t width = message.integer();
+        int32_t height = message.integer();
+        int32_t stride = message.integer();
+        uint32_t format = message.uint();
+        if (!message) break;
+        // argb8888 and xrgb8888, the two every compositor has
+        if (format > 1) {
+          sync->post_error(mId, 0, "Unsupported format");
+          return;
+        }
+        if (offset < 0 || width <= 0 || height <= 0
+         || int64_t{stride} < int64_t{width} * 4
+         || int64_t{offset} + int64_t{stride} * height
+          > static_cast<int64_t>(mSize)) {
+          sync->post_error(mId, 1, "Buffer doesn't fit the pool");
+          return;
+        }
+        mConnection.create<ShmBuffer>(
+          id, mConnection, id
+        , std::shared_ptr<void const>{
+            mMapping, static_cast<char const *>(mMapping.get()) + offset
+          }
+        , width, height, stride, format
+        );
+        return;
+      }
+      case 1: // destroy
+        mConnection.destroy(mId);
+        return;
+      case 2: { // resize
+        int32_t size = message.integer();
+        if (!message) break;
+        if (size <= 0 || static_cast<std::size_t>(size) < mSize) {
+          // Pools only grow
+          sync->post_error(mId, 1, "Can't shrink a pool");
+          return;
+        }
+        auto mapping = map(mFd, static_cast<std::size_t>(size));
+        if (!mapping) {
+          sync->post_error(mId, 2, "Can't map the pool");
+          return;
+        }
+        mMapping = std::move(mapping);
+        mSize = static_cast<std::size_t>(size);
+        return;
+      }
+      default:
+        break;
+      }
+      sync->log_error("Bad request for pool: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wl_shm_pool"; }
+  };
+
+  class Shm final : public Connection::Dispatchable {
+  private:
+    Connection &mConnection;
+    uint32_t mId;
+  public:
+    Shm(Connection &connection, uint32_t id)
+      : mConnection{connection}, mId{id}
+    {
+      mConnection.send(Event{mId, 0}.uint(0)); // argb8888
+      mConnection.send(Event{mId, 0}.uint(1)); // xrgb8888
+    }
+
+    void dispatch(Connection::Sync sync, Message message) override {
+      switch (message.opcode()) {
+      case 0: { // create_pool
+        uint32_t id = message.id();
+        int fd = mConnection.take_fd();
+        int32_t size = message.integer();
+        if (!message) {
+          if (fd >= 0) ::close(fd);
+          break;
+        }
+        if (fd < 0) {
+          sync->post_error(mId, 2, "No fd for the pool");
+          return;
+        }
+        auto mapping = size > 0
+          ? ShmPool::map(fd, static_cast<std::size_t>(size))
+          : nullptr;
+        if (!mapping) {
+          ::close(fd);
+          sync->post_error(mId, 2, "Can't map the pool");
+          return;
+        }
+        auto pool = mConnection.create<ShmPool>(
+          id, mConnection, id, fd, std::move(mapping)
+        , static_cast<std::size_t>(size)
+        );
+        if (!pool) ::close(fd);
+        return;
+      }
+      default:
+        break;
+      }
+      sync->log_error("Bad request for shm: ", message.opcode());
+    }
+
+    char const *interface() const override { return "wl_shm"; }
+  };
+
+  // What a compositor offers through the registry
+  inline std::vector<Global> surface_globals(FrameClock &frames) {
+    return {
+      Global{
+        1, "wl_compositor", 4
+      , [&frames](
+          Connection &connection, uint32_t id, uint32_t /*version*/
+        ) {
+          connection.create<Compositor>(id, connection, frames);
+        }
+      }
+    , Global{
+        2, "wl_subcompositor", 1
+      , [](Connection &connection, uint32_t id, uint32_t /*version*/) {
+          connection.create<Subcompositor>(id, connection, id);
+        }
+      }
+    , Global{
+        3, "wp_presentation", 1
+      , [](Connection &connection, uint32_t id, uint32_t /*version*/) {
+          connection.create<PresentationTime>(id, connection, id);
+        }
+      }
+    , Global{
+        4, "wl_shm", 1
+      , [](Connection &connection, uint32_t id, uint32_t /*version*/) {
+          connection.create<Shm>(id, connection, id);
+        }
+      }
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,53 @@
+// Counts every allocation for waypositor/allocations.hpp. Only linked in with
+// -Dallocation_tracking=true. glibc still does the allocating; operator new
+// comes through malloc, so it's counted too.
+
+#include <waypositor/allocations.hpp>
+
+#include <cerrno>
+#include <cstdlib>
+
+#include <malloc.h>
+
+extern "C" {
+  void *__libc_malloc(std::size_t size);
+  void *__libc_calloc(std::size_t count, std::size_t size);
+  void *__libc_realloc(void *pointer, std::size_t size);
+  void *__libc_memalign(std::size_t alignment, std::size_t size);
+
+  void *malloc(std::size_t size) noexcept {
+    waypositor::allocations::detail::allocated(size);
+    return __libc_malloc(size);
+  }
+
+  void *calloc(std::size_t count, std::size_t size) noexcept {
+    waypositor::allocations::detail::allocated(count * size);
+    return __libc_calloc(count, size);
+  }
+
+  void *realloc(void *pointer, std::size_t size) noexcept {
+    waypositor::allocations::detail::allocated(size);
+    return __libc_realloc(pointer, size);
+  }
+
+  void *memalign(std::size_t alignment, std::size_t size) noexcept {
+    waypositor::allocations::detail::allocated(size);
+    return __libc_memalign(alignment, size);
+  }
+
+  void *aligned_alloc(std::size_t alignment, std::size_t size) noexcept {
+    return memalign(alignment, size);
+  }
+
+  int posix_memalign(
+    void **result, std::size_t alignment, std::size_t size
+  ) noexcept {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1))) {
+      return EINVAL;
+    }
+    void *pointer = memalign(alignment, size);
+    if (pointer == nullptr) return ENOMEM;
+    *result = pointer;
+    return 0;
+  }
+}
@@ -1,16 +1,28 @@
 #include <waypositor/logger.hpp>
+#include <waypositor/loop.hpp>
+#include <waypositor/metrics.hpp>
+#include <waypositor/protocol.hpp>
+#include <waypositor/scene.hpp>
+#include <waypositor/stats.hpp>
+#include <waypositor/surface.hpp>
 #include <waypositor/detail/raiithread.hpp>
 
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <set>
 #include <sstream>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/read.hpp>
@@ -24,9 +36,11 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/resource.h>
 #include <linux/vt.h>
 
 #include <gbm.h>
+#include <libudev.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -41,18 +55,50 @@ namespace waypositor {
   class LoggedThread {
   private:
     Logger &mLog;
+    detail::AppliedPolicy mPolicy;
     std::thread mThread;
   public:
-    template <typename ...Args>
-    LoggedThread(std::string name, Logger &log, Args&&... args)
-      : mLog{log}, mThread{std::forward<Args>(args)...}
-    { mLog.register_thread(mThread.get_id(), std::move(name)); }
+    template <typename Function>
+    LoggedThread(
+      std::string name, Logger &log, detail::ThreadPolicy policy
+    , Function function
+    ) : mLog{log}
+      , mPolicy{}
+      , mThread{
+          detail::launch(std::move(policy), std::move(function), mPolicy)
+        }
+    {
+      mLog.info(name, " thread scheduling: ", mPolicy.description);
+      mLog.register_thread(mThread.get_id(), std::move(name));
+    }
     ~LoggedThread() {
       // Keep the logger around until the thread is done
       mThread.join();
       mLog.unregister_thread(mThread.get_id());
     }
     explicit operator bool() const { return mThread.joinable(); }
+    detail::AppliedPolicy const &policy() const { return mPolicy; }
+  };
+
+  // Logs how long a bring-up phase took when it goes out of scope. This is
+  // the startup trace.
+  class PhaseTimer final {
+  private:
+    using Clock = std::chrono::steady_clock;
+    Logger &mLog;
+    std::string mName;
+    Clock::time_point mStart;
+  public:
+    PhaseTimer(Logger &log, std::string name)
+      : mLog{log}, mName{std::move(name)}, mStart{Clock::now()}
+    {}
+    PhaseTimer(PhaseTimer const &) = delete;
+    PhaseTimer &operator=(PhaseTimer const &) = delete;
+    ~PhaseTimer() {
+      using Milliseconds = std::chrono::duration<double, std::milli>;
+      Milliseconds elapsed = Clock::now() - mStart;
+      mLog.info("(Startup) ", mName, ": ", elapsed.count(), "ms");
+    }
   };
 
   template <typename T>
@@ -192,21 +238,40 @@ namespace waypositor {
         mHandle
       ;
     public:
+      // drmModeGetConnector makes the kernel probe the connector (reading
+      // EDID etc.), which can take hundreds of milliseconds per output.
+      // drmModeGetConnectorCurrent just reports the last known state.
+      enum class Probe { FULL, CURRENT };
+
       Connector() : mHandle{nullptr, &safe_delete} {}
-      Connector(Logger &log, drm::Descriptor const &gpu, uint32_t connector_id)
-        : mHandle{
-            drmModeGetConnector(gpu.get(), connector_id)
+      Connector(
+        Logger &log, drm::Descriptor const &gpu, uint32_t connector_id
+      , Probe probe = Probe::FULL
+      ) : mHandle{
+            probe == Probe::FULL
+              ? drmModeGetConnector(gpu.get(), connector_id)
+              : drmModeGetConnectorCurrent(gpu.get(), connector_id)
           , &safe_delete
           }
       { if (!mHandle) log.error("Couldn't get connector"); }
 
       explicit operator bool() const { return mHandle != nullptr; }
 
+      drmModeConnection connection() const {
+        assert(*this);
+        return mHandle->connection;
+      }
+
       bool is_connected() const {
         assert(*this);
         return mHandle->connection == DRM_MODE_CONNECTED;
       }
 
+      int mode_count() const {
+        assert(*this);
+        return mHandle->count_modes;
+      }
+
       uint32_t id() const {
         assert(*this);
         return mHandle->connector_id;
@@ -270,6 +335,127 @@ namespace waypositor {
       }
     };
 
+    class Crtc final {
+    private:
+      // I'm not sure what guarantees we have -- better safe than sorry
+      static void safe_delete(drmModeCrtc *crtc) {
+        if (crtc != nullptr) drmModeFreeCrtc(crtc);
+      }
+      std::unique_ptr<drmModeCrtc, decltype(&safe_delete)> mHandle;
+    public:
+      Crtc(Logger &log, drm::Descriptor const &gpu, uint32_t crtc_id)
+        : mHandle{drmModeGetCrtc(gpu.get(), crtc_id), &safe_delete}
+      { if (!mHandle) log.perror("Couldn't get crtc"); }
+
+      explicit operator bool() const { return mHandle != nullptr; }
+
+      // Whether the crtc is still scanning out the given framebuffer with the
+      // given mode
+      bool is_showing(
+        uint32_t framebuffer_id, drmModeModeInfo const &mode
+      ) const {
+        assert(*this);
+        return mHandle->buffer_id == framebuffer_id && mHandle->mode_valid
+            && memcmp(&mHandle->mode, &mode, sizeof(mode)) == 0
+        ;
+      }
+    };
+
+    // Encoders are fixed for the lifetime of the device, so there is no need
+    // to ask the kernel about them more than once.
+    class EncoderCache final {
+    private:
+      std::map<uint32_t, uint32_t> mPossibleCrtcs;
+    public:
+      // Returns a bitmask of the crtc indices the encoder can drive, or
+      // std::nullopt if the encoder couldn't be queried.
+      std::optional<uint32_t> possible_crtcs(
+        Logger &log, drm::Descriptor const &gpu, uint32_t encoder_id
+      ) {
+        if (
+          auto it = mPossibleCrtcs.find(encoder_id);
+          it != mPossibleCrtcs.end()
+        ) return it->second;
+
+        drm::Encoder encoder{log, gpu, encoder_id};
+        if (!encoder) return std::nullopt;
+        uint32_t mask = 0;
+        for (int i = 0; i < 32; ++i) if (encoder.has_crtc(i)) mask |= 1u << i;
+        mPossibleCrtcs.emplace(encoder_id, mask);
+        return mask;
+      }
+    };
+
+    // Remembers what we last learned about each connector, so that only
+    // connectors whose state changed (or that someone told us about) pay for
+    // a full probe.
+    class ConnectorCache final {
+    private:
+      struct Entry {
+        drmModeConnection connection;
+        int mode_count;
+        // Bumped by invalidate(). A connector is re-probed whenever its epoch
+        // is newer than the one it was last probed at.
+        std::size_t epoch;
+        std::size_t probed_epoch;
+      };
+      std::map<uint32_t, Entry> mEntries;
+
+      static bool is_trustworthy(Connector const &current) {
+        // The kernel reports an unknown status for connectors it hasn't
+        // probed yet, and a connected output without modes is just as
+        // useless.
+        switch (current.connection()) {
+        case DRM_MODE_CONNECTED: return current.mode_count() > 0;
+        case DRM_MODE_DISCONNECTED: return true;
+        default: return false;
+        }
+      }
+
+    public:
+      // Force a probe of this connector the next time it is queried
+      void invalidate(uint32_t connector_id) {
+        if (
+          auto it = mEntries.find(connector_id); it != mEntries.end()
+        ) it->second.epoch++;
+      }
+
+      // Get a connector, probing only if the last known state can't be used
+      Connector query(
+        Logger &log, drm::Descriptor const &gpu, uint32_t connector_id
+      ) {
+        Connector current{log, gpu, connector_id, Connector::Probe::CURRENT};
+        auto it = mEntries.find(connector_id);
+
+        bool probe = !current || !is_trustworthy(current);
+        if (!probe && it != mEntries.end()) {
+          Entry const &entry = it->second;
+          probe = entry.epoch != entry.probed_epoch
+               || entry.connection != current.connection()
+               || entry.mode_count != current.mode_count()
+          ;
+        }
+
+        Connector result{};
+        if (probe) {
+          log.info("Probing connector ", connector_id);
+          result = Connector{log, gpu, connector_id, Connector::Probe::FULL};
+        } else {
+          result = std::move(current);
+        }
+        if (!result) return result;
+
+        if (it == mEntries.end()) {
+          it = mEntries.emplace(connector_id, Entry{}).first;
+        }
+        Entry &entry = it->second;
+        entry.connection = result.connection();
+        entry.mode_count = result.mode_count();
+        entry.probed_epoch = entry.epoch;
+        return result;
+      }
+    };
+
     class FrameBuffer final {
     private:
       class Handle {
@@ -339,6 +525,98 @@ namespace waypositor {
         return true;
       }
     }
+
+    // Outputs that are brought up together prepare their first frame in
+    // parallel on their own threads, then have their modes set back to back
+    // by whichever of them gets there last.
+    class ModesetBatch final {
+    private:
+      struct Request {
+        FrameBuffer const *framebuffer;
+        uint32_t connector_id;
+        uint32_t crtc_id;
+        drmModeModeInfo *mode;
+        bool result;
+      };
+
+      Logger &mLog;
+      Descriptor const &mGPU;
+      std::mutex mMutex;
+      std::condition_variable mDone;
+      std::size_t mOutstanding;
+      std::vector<Request *> mRequests;
+
+      // Should be synchronized by mMutex
+      void leave(std::unique_lock<std::mutex> &lock) {
+        assert(mOutstanding > 0);
+        if (--mOutstanding > 0) {
+          mDone.wait(lock, [this] { return mOutstanding == 0; });
+          return;
+        }
+
+        if (!mRequests.empty()) {
+          std::stringstream name{};
+          name << "modeset (" << mRequests.size() << " outputs)";
+          PhaseTimer timer{mLog, name.str()};
+          for (Request *request : mRequests) {
+            request->result = drm::set_mode(
+              mLog, mGPU, *request->framebuffer
+            , request->connector_id, request->crtc_id, *request->mode
+            );
+          }
+        }
+        mDone.notify_all();
+      }
+
+    public:
+      ModesetBatch(Logger &log, Descriptor const &gpu, std::size_t outputs)
+        : mLog{log}, mGPU{gpu}, mMutex{}, mDone{}
+        , mOutstanding{outputs}, mRequests{}
+      {}
+
+      // Every output in the batch holds one of these. Dropping it without
+      // setting a mode withdraws the output so the others aren't kept
+      // waiting.
+      class Ticket final {
+      private:
+        std::shared_ptr<ModesetBatch> mBatch;
+      public:
+        Ticket() = default;
+        explicit Ticket(std::shared_ptr<ModesetBatch> batch)
+          : mBatch{std::move(batch)}
+        {}
+        Ticket(Ticket const &) = delete;
+        Ticket &operator=(Ticket const &) = delete;
+        Ticket(Ticket &&) = default;
+        Ticket &operator=(Ticket &&other) noexcept {
+          if (this == &other) return *this;
+          this->~Ticket();
+          new (this) Ticket{std::move(other)};
+          return *this;
+        }
+        ~Ticket() {
+          if (!*this) return;
+          std::unique_lock lock{mBatch->mMutex};
+          mBatch->leave(lock);
+        }
+
+        explicit operator bool() const { return mBatch != nullptr; }
+
+        // Blocks until every output in the batch is ready (or has given up)
+        bool set_mode(
+          FrameBuffer const &framebuffer
+        , uint32_t connector_id, uint32_t crtc_id, drmModeModeInfo &mode
+        ) {
+          assert(*this);
+          auto batch = std::move(mBatch);
+          Request request{&framebuffer, connector_id, crtc_id, &mode, false};
+          std::unique_lock lock{batch->mMutex};
+          batch->mRequests.push_back(&request);
+          batch->leave(lock);
+          return request.result;
+        }
+      };
+    };
   }
 
   namespace gbm {
@@ -807,6 +1085,15 @@ namespace waypositor {
         assert(*this);
         eglSwapBuffers(display.get(), mSurface.get());
       }
+
+      // Only needed when several contexts take turns on the same thread
+      void make_current(Display const &display) const {
+        assert(*this);
+        if (eglGetCurrentContext() == mContext.get()) return;
+        eglMakeCurrent(
+          display.get(), mSurface.get(), mSurface.get(), mContext.get()
+        );
+      }
     };
 
     // Note that this class assumes that the EGL_KHR_surfaceless_context
@@ -870,13 +1157,27 @@ namespace waypositor {
     egl::Display const &egl() const { return mEGL; }
 
     static GPU create(Logger &log, char const *path) {
-      drm::Descriptor drm{log, path};
+      PhaseTimer timer{log, "GPU::create"};
+
+      drm::Descriptor drm{};
+      {
+        PhaseTimer timer{log, "DRM open"};
+        drm = drm::Descriptor{log, path};
+      }
       if (!drm) return {};
 
-      gbm::Device gbm{log, drm};
+      gbm::Device gbm{};
+      {
+        PhaseTimer timer{log, "GBM device"};
+        gbm = gbm::Device{log, drm};
+      }
       if (!gbm) return {};
 
-      auto egl = egl::Display::create(log, gbm);
+      egl::Display egl{};
+      {
+        PhaseTimer timer{log, "EGL init"};
+        egl = egl::Display::create(log, gbm);
+      }
       if (!egl) return {};
 
       return {std::move(drm), std::move(gbm), std::move(egl)};
@@ -915,6 +1216,10 @@ namespace waypositor {
     , uint32_t width, uint32_t height
     , uint32_t crtc_id // TODO - needed?
     ) {
+      std::stringstream name{};
+      name << "context creation (crtc " << crtc_id << ")";
+      PhaseTimer timer{log, name.str()};
+
       gbm::Surface gbm_surface{log, gbm, width, height};
       if (!gbm_surface) return std::nullopt;
 
@@ -933,12 +1238,20 @@ namespace waypositor {
 
     uint32_t crtc_id() const { assert(*this); return mCrtcId; }
 
+    void make_current(egl::Display const &egl_display) const {
+      assert(*this);
+      mEGL.make_current(egl_display);
+    }
+
+    // The mode isn't actually set until every other output in the batch is
+    // ready for it too
     bool set_mode(
       Logger &log
     , drm::Descriptor const &gpu
     , egl::Display const &egl_display
     , uint32_t connector_id
     , drmModeModeInfo &mode
+    , drm::ModesetBatch::Ticket ticket
     ) {
       assert(*this);
       glClearColor(0.5, 0.5, 0.5, 1.0);
@@ -948,9 +1261,11 @@ namespace waypositor {
       if (!front) return false;
       auto framebuffer = front.ensure_framebuffer(log, gpu);
       if (!framebuffer) return false;
-      if (drm::set_mode(
-        log, gpu, *framebuffer, connector_id, mCrtcId, mode
-      )) {
+      bool success = ticket
+        ? ticket.set_mode(*framebuffer, connector_id, mCrtcId, mode)
+        : drm::set_mode(log, gpu, *framebuffer, connector_id, mCrtcId, mode)
+      ;
+      if (success) {
         mCurrentFrontBuffer = std::move(front);
         return true;
       } else {
@@ -958,6 +1273,28 @@ namespace waypositor {
       }
     }
 
+    // Put the last frame we showed back on screen, e.g. after a VT switch. If
+    // nobody touched the crtc while we were away there's nothing to do.
+    bool restore_mode(
+      Logger &log
+    , drm::Descriptor const &gpu
+    , uint32_t connector_id
+    , drmModeModeInfo &mode
+    ) {
+      assert(*this && mCurrentFrontBuffer);
+      auto framebuffer = mCurrentFrontBuffer.ensure_framebuffer(log, gpu);
+      if (!framebuffer) return false;
+      if (drm::Crtc crtc{log, gpu, mCrtcId}; crtc) {
+        if (crtc.is_showing(framebuffer->get(), mode)) {
+          log.info("Crtc ", mCrtcId, " is unchanged, skipping modeset");
+          return true;
+        }
+      }
+      return drm::set_mode(
+        log, gpu, *framebuffer, connector_id, mCrtcId, mode
+      );
+    }
+
     bool begin_swap_buffers(
       Logger &log
     , drm::Descriptor const &gpu
@@ -968,7 +1305,9 @@ namespace waypositor {
       mEGL.swap_buffers(egl_display);
       auto front = mSurface.lock_front_buffer(log);
       if (!front) return false;
-      auto framebuffer = mCurrentFrontBuffer.ensure_framebuffer(log, gpu);
+      // The current front buffer stays locked until the flip away from it
+      // has landed
+      auto framebuffer = front.ensure_framebuffer(log, gpu);
       if (!framebuffer) return false;
       bool error = drmModePageFlip(
         gpu.get(), mCrtcId, framebuffer->get()
@@ -1002,18 +1341,19 @@ namespace waypositor {
     static std::optional<uint32_t> find_crtc(
       Logger &log
     , drm::Descriptor const &drm
+    , drm::EncoderCache &encoders
     , drm::Connector const &connector
     , drm::Resources const &resources
     , std::set<uint32_t> const &available_crtcs
     ) {
       for (uint32_t encoder_id : connector.encoders()) {
-        drm::Encoder encoder{log, drm, encoder_id};
-        if (!encoder) continue;
+        auto possible_crtcs = encoders.possible_crtcs(log, drm, encoder_id);
+        if (!possible_crtcs) continue;
         int i = 0;
         for (uint32_t crtc_id : resources.crtcs()) {
           bool unused = available_crtcs.find(crtc_id) != available_crtcs.end();
-          if (encoder.has_crtc(i) && unused) {
-            log.info("Chose crtc ", crtc_id, " for encoder ", encoder.id());
+          if ((*possible_crtcs & (1u << i)) && unused) {
+            log.info("Chose crtc ", crtc_id, " for encoder ", encoder_id);
             return crtc_id;
           }
           ++i;
@@ -1035,9 +1375,21 @@ namespace waypositor {
     uint32_t width() const { assert(*this); return mMode->hdisplay; }
     uint32_t height() const { assert(*this); return mMode->vdisplay; }
 
+    // How long a frame lasts. The pixel clock is in kHz.
+    std::chrono::nanoseconds refresh() const {
+      assert(*this);
+      if (mMode->clock == 0) return {};
+      uint64_t pixels = uint64_t{mMode->htotal} * mMode->vtotal;
+      if (mMode->flags & DRM_MODE_FLAG_INTERLACE) pixels /= 2;
+      if (mMode->flags & DRM_MODE_FLAG_DBLSCAN) pixels *= 2;
+      if (mMode->vscan > 1) pixels *= mMode->vscan;
+      return std::chrono::nanoseconds{pixels * 1000000 / mMode->clock};
+    }
+
     static DisplayMode create(
       Logger &log
     , drm::Descriptor const &drm
+    , drm::EncoderCache &encoders
     , drm::Resources const &resources
     , std::set<uint32_t> const &available_crtcs
     , drm::Connector connector
@@ -1045,7 +1397,9 @@ namespace waypositor {
       drmModeModeInfo *mode = connector.find_best_mode(log);
       if (!mode) return {};
 
-      auto crtc_id = find_crtc(log, drm, connector, resources, available_crtcs);
+      auto crtc_id = find_crtc(
+        log, drm, encoders, connector, resources, available_crtcs
+      );
       if (!crtc_id) return {};
 
       log.info(
@@ -1057,13 +1411,168 @@ namespace waypositor {
     }
   };
 
+  // Counts how often the process is switched out, relative to the number of
+  // frames shown on all outputs combined. On small machines this is a good
+  // part of what repainting costs.
+  class ContextSwitchMeter final {
+  private:
+    Logger &mLog;
+    metrics::Registry &mRegistry;
+    asio::steady_timer mTimer;
+    asio::steady_timer::duration mDelta;
+    // Across every output
+    metrics::Counter &mFrames;
+    metrics::Counter &mMissed;
+    metrics::Histogram &mCommitToFlip;
+    metrics::Histogram &mDrawing;
+    std::size_t mLastFrames;
+    long mLastVoluntary;
+    long mLastInvoluntary;
+    bool mStopped;
+
+    void report() {
+      rusage usage{};
+      if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        mLog.perror("Failed to get resource usage");
+        return;
+      }
+      std::size_t frames = mFrames.value();
+      std::size_t new_frames = frames - mLastFrames;
+      long voluntary = usage.ru_nvcsw - mLastVoluntary;
+      long involuntary = usage.ru_nivcsw - mLastInvoluntary;
+      mLastFrames = frames;
+      mLastVoluntary = usage.ru_nvcsw;
+      mLastInvoluntary = usage.ru_nivcsw;
+      // Nothing on screen, e.g. while switched away
+      if (new_frames == 0) return;
+
+      double per_frame = static_cast<double>(voluntary + involuntary)
+                       / new_frames;
+      mLog.info(
+        "Context switches per frame: ", per_frame
+      , " (", voluntary, " voluntary, ", involuntary, " involuntary over "
+      , new_frames, " frames)"
+      );
+    }
+
+    class Worker {
+    private:
+      ContextSwitchMeter *self;
+    public:
+      Worker(ContextSwitchMeter &state) : self{&state} {}
+      Worker(Worker const &);
+      Worker &operator=(Worker const &);
+      Worker(Worker &&other) noexcept : self{other.self} {
+        other.self = nullptr;
+      }
+      Worker &operator=(Worker &&other) {
+        if (this == &other) return *this;
+        self = other.self;
+        other.self = nullptr;
+        return *this;
+      }
+      ~Worker() = default;
+
+      void operator()(boost::system::error_code const &error = {}) {
+        // Cancelled by stop(). The meter may be gone already.
+        if (error == asio::error::operation_aborted) return;
+        if (error) {
+          self->mLog.error("ASIO error", error.message());
+          return;
+        }
+        if (self->mStopped) return;
+
+        self->report();
+        self->mTimer.expires_at(self->mTimer.expires_at() + self->mDelta);
+        self->mTimer.async_wait(std::move(*this));
+      }
+    };
+  public:
+    ContextSwitchMeter(
+      Logger &log, asio::io_service &asio, metrics::Registry &registry
+    , asio::steady_timer::duration delta = std::chrono::seconds{5}
+    ) : mLog{log}, mRegistry{registry}, mTimer{asio}, mDelta{delta}
+      , mFrames{registry.counter(
+          "waypositor_frames_total", "Page flips on every output"
+        )}
+      , mMissed{registry.counter(
+          "waypositor_missed_vblanks_total", "Vblanks that went by unflipped"
+        )}
+      , mCommitToFlip{registry.histogram(
+          "waypositor_commit_to_flip_seconds"
+        , "From a scene commit to the flip that showed it"
+        )}
+      , mDrawing{registry.histogram(
+          "waypositor_draw_seconds", "From starting to draw to the flip request"
+        )}
+      , mLastFrames{0}, mLastVoluntary{0}, mLastInvoluntary{0}, mStopped{false}
+    {
+      // Read at scrape time; there's nothing to keep up to date
+      registry.collect([](std::ostream &out) {
+        rusage usage{};
+        if (getrusage(RUSAGE_SELF, &usage) != 0) return;
+        char const *name = "waypositor_context_switches_total";
+        out << "# HELP " << name << " Context switches of the whole process\n"
+            << "# TYPE " << name << " counter\n"
+            << name << "{kind=\"voluntary\"} " << usage.ru_nvcsw << "\n"
+            << name << "{kind=\"involuntary\"} " << usage.ru_nivcsw << "\n";
+      });
+    }
+
+    // These are thread safe
+    void frame() { mFrames.add(); }
+    void missed(std::size_t vblanks) { mMissed.add(vblanks); }
+    void latency(std::chrono::steady_clock::duration elapsed) {
+      mCommitToFlip.record(elapsed);
+    }
+    void drawn(std::chrono::steady_clock::duration elapsed) {
+      mDrawing.record(elapsed);
+    }
+
+    // Export how a thread of the given role ended up scheduled
+    metrics::Gauge &policy(
+      std::string_view role, detail::AppliedPolicy const &policy
+    ) {
+      return detail::export_policy(mRegistry, role, policy);
+    }
+
+    // Time the handlers run on a loop. Call this before the loop is in use.
+    void watch(asio::io_service &loop, std::string name) {
+      loop::Monitor::install(
+        loop, mRegistry, std::move(name), mLog.slow_handlers()
+      );
+    }
+
+    // Not thread safe
+    void start() {
+      this->report();
+      mTimer.expires_from_now(mDelta);
+      mTimer.async_wait(Worker{*this});
+    }
+
+    // Not thread safe
+    void stop() {
+      mStopped = true;
+      boost::system::error_code error;
+      mTimer.cancel(error);
+    }
+  };
+
   class FPSTimer final {
   private:
-    enum class State { STARTING, RUNNING, STOPPED };
+    enum class State { STOPPED, RUNNING, PAUSED };
     using Clock = std::chrono::high_resolution_clock;
     Logger &mLog;
+    ContextSwitchMeter &mMeter;
     asio::steady_timer mTimer;
     std::size_t mFrameCount;
+    // Vblanks that went by without a flip, going by the DRM sequence
+    std::size_t mMissedCount;
+    std::optional<unsigned int> mLastSequence;
+    // Time from a commit to the flip that put it on screen
+    std::size_t mLatencyCount;
+    std::chrono::steady_clock::duration mLatencyTotal;
+    std::chrono::steady_clock::duration mLatencyMax;
     asio::steady_timer::duration mDelta;
     std::chrono::time_point<Clock> mThen;
     State mState;
@@ -1093,55 +1602,131 @@ namespace waypositor {
         self->mThen = now;
         double fps = self->mFrameCount / delta.count();
 
-        self->mLog.info("FPS: ", fps, " Delta: ", delta.count(), " seconds");
+        self->mLog.info(
+          "FPS: ", fps, " Delta: ", delta.count(), " seconds"
+        , " Missed vblanks: ", self->mMissedCount
+        );
+        if (self->mLatencyCount > 0) {
+          using Milliseconds = std::chrono::duration<double, std::milli>;
+          Milliseconds total = self->mLatencyTotal;
+          Milliseconds max = self->mLatencyMax;
+          self->mLog.info(
+            "Commit to flip: ", total.count() / self->mLatencyCount
+          , "ms average, ", max.count(), "ms worst over "
+          , self->mLatencyCount, " commits"
+          );
+        }
         self->mFrameCount = 0;
+        self->mMissedCount = 0;
+        self->mLatencyCount = 0;
+        self->mLatencyTotal = {};
+        self->mLatencyMax = {};
 
         self->mTimer.expires_at(self->mTimer.expires_at() + self->mDelta);
         self->mTimer.async_wait(std::move(*this));
       }
 
       void operator()(boost::system::error_code const &error = {}) {
+        // Cancelled by stop() or pause(). The timer may be gone already if
+        // it was stopped.
+        if (error == asio::error::operation_aborted) return;
         if (error) {
           self->mLog.error("ASIO error", error.message());
           return;
         }
 
         switch (self->mState) {
-        case State::STARTING:
-          self->mState = State::RUNNING;
-          self->mTimer.async_wait(std::move(*this));
-          return;
         case State::RUNNING:
           run();
           return;
+        case State::PAUSED:
         case State::STOPPED:
-          self->mLog.info("Stopping FPS timer");
           return;
         }
       }
     };
   public:
+    // Not thread safe. The sequence is the vblank counter the flip landed
+    // on; every vblank skipped between two flips is a missed frame.
+    void tick(unsigned int sequence) {
+      mFrameCount++;
+      mMeter.frame();
+      if (mLastSequence && sequence - *mLastSequence > 1) {
+        mMissedCount += sequence - *mLastSequence - 1;
+        mMeter.missed(sequence - *mLastSequence - 1);
+      }
+      mLastSequence = sequence;
+    }
+
     // Not thread safe
-    void tick() { mFrameCount++; }
+    void latency(std::chrono::steady_clock::duration elapsed) {
+      mMeter.latency(elapsed);
+      mLatencyCount++;
+      mLatencyTotal += elapsed;
+      mLatencyMax = std::max(mLatencyMax, elapsed);
+    }
+
+    // Not thread safe
+    void drawn(std::chrono::steady_clock::duration elapsed) {
+      mMeter.drawn(elapsed);
+    }
 
     // Not thread safe
-    void stop() { mState = State::STOPPED; }
+    void start() {
+      mState = State::PAUSED;
+      this->resume();
+    }
+
+    // Not thread safe. Cancels the wait so the io_service can run dry
+    // straight away.
+    void stop() {
+      if (mState == State::STOPPED) return;
+      mLog.info("Stopping FPS timer");
+      mState = State::STOPPED;
+      boost::system::error_code error;
+      mTimer.cancel(error);
+    }
+
+    // Not thread safe. No wakeups while paused.
+    void pause() {
+      if (mState == State::STOPPED) return;
+      mState = State::PAUSED;
+      boost::system::error_code error;
+      mTimer.cancel(error);
+    }
+
+    // Not thread safe
+    void resume() {
+      if (mState != State::PAUSED) return;
+      mState = State::RUNNING;
+      mFrameCount = 0;
+      // The vblanks that went by while paused weren't missed
+      mMissedCount = 0;
+      mLastSequence = std::nullopt;
+      mThen = Clock::now();
+      mTimer.expires_from_now(mDelta);
+      mTimer.async_wait(Worker{*this});
+    }
 
     FPSTimer(
-      Logger &log, asio::io_service &asio
+      Logger &log, ContextSwitchMeter &meter, asio::io_service &asio
     , asio::steady_timer::duration delta = std::chrono::seconds{1}
-    ) : mLog{log}, mTimer{asio, delta}, mFrameCount{0}, mDelta{delta}
-      , mThen{Clock::now()}, mState{State::STARTING}
-    { asio.post([this] { Worker{*this}(); }); }
+    ) : mLog{log}, mMeter{meter}, mTimer{asio}, mFrameCount{0}
+      , mMissedCount{0}, mLastSequence{std::nullopt}
+      , mLatencyCount{0}, mLatencyTotal{}, mLatencyMax{}, mDelta{delta}
+      , mThen{Clock::now()}, mState{State::STOPPED}
+    {}
   };
 
+  // Repaints one output. The routine is kept alive by its workers, so that
+  // it outlasts any page flip in flight even if the output goes away.
   class DrawRoutine final {
   private:
     class Worker final {
     private:
-      DrawRoutine *self;
+      std::shared_ptr<DrawRoutine> self;
     public:
-      Worker(DrawRoutine &state) : self{&state} {}
+      Worker(std::shared_ptr<DrawRoutine> state) : self{std::move(state)} {}
 
       // Declare but don't define copy semantics. We're using the boost copy of
       // asio for now for convenience, but it doesn't want to accept move-only
@@ -1149,15 +1734,8 @@ namespace waypositor {
       // https://stackoverflow.com/questions/17211263/how-to-trick-boostasio-to-allow-move-only-handlers)
       Worker(Worker const &);
       Worker &operator=(Worker const &);
-      Worker(Worker &&other) noexcept : self{other.self} {
-        other.self = nullptr;
-      }
-      Worker &operator=(Worker &&other) {
-        if (this == &other) return *this;
-        self = other.self;
-        other.self = nullptr;
-        return *this;
-      }
+      Worker(Worker &&other) noexcept = default;
+      Worker &operator=(Worker &&other) = default;
       ~Worker() = default;
 
       explicit operator bool() const { return self != nullptr; }
@@ -1175,101 +1753,275 @@ namespace waypositor {
 
         switch (self->mState) {
         case State::MODE_SET:
+          if (self->mPaused) {
+            // Don't hold up the rest of the batch while we're away. The mode
+            // is set on its own when we come back.
+            self->mModeset = drm::ModesetBatch::Ticket{};
+            self->park(std::move(*this));
+            return;
+          }
+
+          self->mDisplay->make_current(self->mGPU.egl());
           if (!self->mDisplay->set_mode(
             self->mLog
           , self->mGPU.drm(), self->mGPU.egl()
           , self->mMode.connector_id(), self->mMode.info()
+          , std::move(self->mModeset)
           )) {
             self->mLog.error("Thread exiting due to error");
             return;
           }
 
           self->mState = State::DRAWING;
-          self->mASIO.post(std::move(*this));
+          loop::post(self->mMonitor, self->mASIO, std::move(*this));
+          return;
+        case State::RESTORE:
+          if (!self->mDisplay->restore_mode(
+            self->mLog, self->mGPU.drm()
+          , self->mMode.connector_id(), self->mMode.info()
+          )) {
+            self->mLog.error("Thread exiting due to error");
+            return;
+          }
+
+          self->mState = State::DRAWING;
+          loop::post(self->mMonitor, self->mASIO, std::move(*this));
           return;
         case State::PAGE_FLIP:
           // Complete the flip
           self->mDisplay->finish_swap_buffers();
-          self->mFPS.tick();
+          self->mFPS.tick(self->mFlipSequence);
+          self->mFlipPending = std::nullopt;
+          if (self->mShowing) {
+            self->mFPS.latency(self->mFlipTime - *self->mShowing);
+            self->mShowing = std::nullopt;
+          }
+          // Let the clients that were shown know, so that they can start
+          // on their next frame straight away
+          if (self->mVisible) {
+            self->mScene.present(scene::Presentation{
+              self->mMode.crtc_id(), self->mDrawnGeneration
+            , self->mFlipTime, self->mMode.refresh(), self->mFlipSequence
+            , self->mVisible
+            });
+          }
+          if (self->mRequested) {
+            using Milliseconds = std::chrono::duration<double, std::milli>;
+            Milliseconds elapsed = Clock::now() - *self->mRequested;
+            self->mLog.info(
+              "First flip on crtc ", self->mMode.crtc_id()
+            , " after ", elapsed.count(), "ms"
+            );
+            self->mRequested = std::nullopt;
+          }
 
           // Fall through
         case State::DRAWING:
-          // Do the drawing
-          self->mDrawCallback();
+          if (!self->mRunning) {
+            self->mLog.info("Stopping draw routine");
+            return;
+          }
+          if (self->mPaused) {
+            self->mState = State::RESTORE;
+            self->park(std::move(*this));
+            return;
+          }
+
+          // Do the drawing. Other outputs may have had the thread in the
+          // meantime.
+          auto drawing = Clock::now();
+          self->mDisplay->make_current(self->mGPU.egl());
+          if (self->mScene.update()) {
+            // Something new goes on screen with this flip
+            self->mShowing = self->mScene.current()->committed;
+            self->find_visible();
+          }
+          self->mDrawCallback(self->mScene.current());
 
           // Begin the flip
           if (!self->mDisplay->begin_swap_buffers(
-            self->mLog, self->mGPU.drm(), self->mGPU.egl(), self
+            self->mLog, self->mGPU.drm(), self->mGPU.egl(), self.get()
           )) {
             self->mLog.error("Thread exiting due to error");
             return;
           }
-
-          // Pause the worker until the flip happens. This io_service is
-          // single-threaded, so this can happen after beginning the flip
+          self->mFPS.drawn(Clock::now() - drawing);
+
+          // Pause the worker until the flip happens. The io_service runs
+          // on a single thread, so this can happen after beginning the
+          // flip. The kernel will call back into this routine when the flip
+          // lands, so the dormant worker keeps the routine alive, and the
+          // work keeps the io_service running, until then, even if we're
+          // asked to stop.
           self->mState = State::PAGE_FLIP;
+          self->mFlipPending.emplace(self->mASIO);
           self->mDormantWorker = std::move(*this);
           return;
         }
       }
     };
 
-    enum class State { MODE_SET, DRAWING, PAGE_FLIP };
+    enum class State { MODE_SET, RESTORE, DRAWING, PAGE_FLIP };
+    using Clock = std::chrono::steady_clock;
     Logger &mLog;
     asio::io_service &mASIO;
+    // Null if the loop isn't being watched
+    loop::Monitor *mMonitor;
+    bool mRunning;
     GPU const &mGPU;
-    FPSTimer &mFPS;
+    FPSTimer mFPS;
     DisplayMode mMode;
     std::optional<ActiveDisplay> mDisplay;
-    std::function<void()> mDrawCallback;
+    std::function<void(scene::Snapshot const *)> mDrawCallback;
+    scene::Hub::Subscription mScene;
+    // When the snapshot going on screen with the next flip was committed
+    std::optional<Clock::time_point> mShowing;
+    // Which snapshot is being drawn, and which of its surfaces are on this
+    // output. Only worked out again when the snapshot changes.
+    uint64_t mDrawnGeneration;
+    std::shared_ptr<
+      std::vector<std::pair<std::size_t, uint32_t>> const
+    > mVisible;
     State mState;
     std::optional<Worker> mDormantWorker;
+    std::optional<asio::io_service::work> mFlipPending;
+    // The vblank sequence and time the last flip landed on
+    unsigned int mFlipSequence;
+    Clock::time_point mFlipTime;
+    // While paused (e.g. VT switched away) the worker waits here instead
+    bool mPaused;
+    std::optional<Worker> mParkedWorker;
+    std::function<void()> mOnParked;
+    drm::ModesetBatch::Ticket mModeset;
+    // When this output was asked for. Cleared once the first flip lands.
+    std::optional<Clock::time_point> mRequested;
+    // Released when the routine is gone
+    std::shared_ptr<void> mOnFinished;
+
+    static void drm_event_callback(
+      int /*gpu descriptor*/
+    , unsigned int frame
+    , unsigned int seconds
+    , unsigned int microseconds
+    , void *user_data
+    ) {
+      auto self = static_cast<DrawRoutine *>(user_data);
+      assert(self != nullptr);
+      // DRM timestamps come from CLOCK_MONOTONIC, as does steady_clock
+      Clock::time_point time{
+        std::chrono::seconds{seconds} + std::chrono::microseconds{microseconds}
+      };
+      loop::post(self->mMonitor, self->mASIO, [self, frame, time]() {
+        self->mFlipSequence = frame;
+        self->mFlipTime = time;
+        // Restart the worker
+        Worker worker = std::move(*self->mDormantWorker);
+        self->mDormantWorker = std::nullopt;
+        self->mASIO.dispatch(std::move(worker));
+      });
+    }
 
+    void find_visible() {
+      scene::Snapshot const *snapshot = mScene.current();
+      mDrawnGeneration = snapshot->generation;
+      auto visible = std::make_shared<
+        std::vector<std::pair<std::size_t, uint32_t>>
+      >();
+      auto width = static_cast<int32_t>(mMode.width());
+      auto height = static_cast<int32_t>(mMode.height());
+      for (scene::Surface const &surface : snapshot->surfaces) {
+        if (
+          surface.x < width && surface.y < height
+       && surface.x + surface.width > 0 && surface.y + surface.height > 0
+        ) {
+          visible->emplace_back(surface.client, surface.id);
+        }
+      }
+      mVisible = std::move(visible);
+    }
+
+    void park(Worker worker) {
+      mParkedWorker = std::move(worker);
+      if (mOnParked) {
+        auto on_parked = std::move(mOnParked);
+        mOnParked = nullptr;
+        on_parked();
+      }
+    }
+
+    static drmEventContext make_event_context() {
+      drmEventContext context;
+      context.version = 3;
+      context.page_flip_handler = &drm_event_callback;
+      return context;
+    }
+
+    struct Private {};
+  public:
     DrawRoutine(
-      Logger &log
+      Private
+    , Logger &log
     , asio::io_service &asio
     , GPU const &gpu
-    , FPSTimer &fps
+    , ContextSwitchMeter &meter
     , egl::SurfacelessContext const &master_context
     , DisplayMode mode
-    , std::function<void()> draw_callback
+    , std::function<void(scene::Snapshot const *)> draw_callback
+    , scene::Hub::Subscription scene
+    , drm::ModesetBatch::Ticket modeset
+    , Clock::time_point requested
     ) : mLog{log}
       , mASIO{asio}
+      , mMonitor{loop::Monitor::find(asio)}
+      , mRunning{true}
       , mGPU{gpu}
-      , mFPS{fps}
+      , mFPS{log, meter, asio}
       , mMode{std::move(mode)}
       , mDisplay{ActiveDisplay::create(
           log, mGPU.gbm(), mGPU.egl(), master_context
         , mMode.width(), mMode.height(), mMode.crtc_id()
         )}
       , mDrawCallback{std::move(draw_callback)}
+      , mScene{std::move(scene)}
+      , mShowing{std::nullopt}
+      , mDrawnGeneration{0}
+      , mVisible{}
       , mState{State::MODE_SET}
       , mDormantWorker{std::nullopt}
+      , mFlipPending{std::nullopt}
+      , mFlipSequence{0}
+      , mFlipTime{}
+      , mPaused{false}
+      , mParkedWorker{std::nullopt}
+      , mOnParked{}
+      , mModeset{std::move(modeset)}
+      , mRequested{requested}
+      , mOnFinished{}
     { /* No assertion, could be invalid */ }
 
-    static void drm_event_callback(
-      int /*gpu descriptor*/
-    , unsigned int /*frame*/
-    , unsigned int /*seconds*/
-    , unsigned int /*microseconds*/
-    , void *user_data
+    // Call this on the thread that runs the io_service. Returns null if the
+    // output couldn't be brought up.
+    static std::shared_ptr<DrawRoutine> create(
+      Logger &log
+    , asio::io_service &asio
+    , GPU const &gpu
+    , ContextSwitchMeter &meter
+    , egl::SurfacelessContext const &master_context
+    , DisplayMode mode
+    , std::function<void(scene::Snapshot const *)> draw_callback
+    , scene::Hub::Subscription scene
+    , drm::ModesetBatch::Ticket modeset
+    , Clock::time_point requested
     ) {
-      auto self = static_cast<DrawRoutine *>(user_data);
-      assert(self != nullptr);
-      self->mASIO.post([self]() {
-        // Restart the worker
-        self->mASIO.dispatch(std::move(*self->mDormantWorker));
-      });
-    }
-
-    static drmEventContext make_event_context() {
-      drmEventContext context;
-      context.version = 3;
-      context.page_flip_handler = &drm_event_callback;
-      return context;
+      auto routine = std::make_shared<DrawRoutine>(
+        Private{}, log, asio, gpu, meter, master_context
+      , std::move(mode), std::move(draw_callback), std::move(scene)
+      , std::move(modeset), requested
+      );
+      if (!*routine) return nullptr;
+      return routine;
     }
 
-  public:
     static bool handle_event(drm::Descriptor const &drm) {
       static drmEventContext context = make_event_context();
       return drmHandleEvent(drm.get(), &context) == 0;
@@ -1279,123 +2031,257 @@ namespace waypositor {
       return static_cast<bool>(mDisplay);
     }
 
-    static void begin(
-      Logger &log
-    , asio::io_service &asio
-    , GPU const &gpu
-    , FPSTimer &fps
-    , egl::SurfacelessContext const &master_context
-    , DisplayMode mode
-    , std::function<void()> draw_callback
-    ) {
-      DrawRoutine state{
-        log, asio, gpu, fps, master_context
-      , std::move(mode), std::move(draw_callback)
-      };
-      if (!state) return;
-      Worker{state}();
-      asio.run();
+    // Should only be called once, with the routine's own shared pointer!
+    static void start(std::shared_ptr<DrawRoutine> const &routine) {
+      assert(routine && *routine);
+      routine->mFPS.start();
+      Worker{routine}();
+    }
+
+    // The routine finishes once any outstanding page flip has landed.
+    // Dropping the last copy of on_finished tells whoever is interested.
+    void stop(std::shared_ptr<void> on_finished = {}) {
+      mRunning = false;
+      mOnFinished = std::move(on_finished);
+      mFPS.stop();
+      // A parked worker would keep the routine alive forever
+      mParkedWorker = std::nullopt;
+      if (mOnParked) {
+        auto on_parked = std::move(mOnParked);
+        mOnParked = nullptr;
+        on_parked();
+      }
+    }
+
+    // Stop repainting. The callback is called once the routine is idle, i.e.
+    // once any page flip in flight has landed (possibly straight away). Call
+    // this on the drawing thread.
+    void pause(std::function<void()> on_parked) {
+      mPaused = true;
+      mFPS.pause();
+      // Nothing is running on the hardware unless a flip is in flight, and
+      // if a worker is queued up it will park itself before touching the
+      // hardware.
+      if (mParkedWorker || !mFlipPending) {
+        on_parked();
+      } else {
+        mOnParked = std::move(on_parked);
+      }
+    }
+
+    // Pick up where we left off. Call this on the drawing thread.
+    void resume() {
+      if (!mPaused) return;
+      mPaused = false;
+      mFPS.resume();
+      if (mParkedWorker) {
+        Worker worker = std::move(*mParkedWorker);
+        mParkedWorker = std::nullopt;
+        loop::post(mMonitor, mASIO, std::move(worker));
+      }
     }
   };
 
+  // Runs one output's draw routine, either on a thread of its own or on an
+  // io_service shared with everything else.
   class DrawThread final {
   private:
-    asio::io_service mASIO;
+    // Only used with a thread of its own
+    std::optional<asio::io_service> mOwnASIO;
+    asio::io_service &mASIO;
     std::optional<asio::io_service::work> mWork;
-    FPSTimer mFPS;
     uint32_t mCrtcID;
-    LoggedThread mThread;
+    // Only touched on the thread running mASIO
+    std::shared_ptr<DrawRoutine> mRoutine;
+    std::optional<LoggedThread> mThread;
+    // Only with a thread of its own
+    metrics::Gauge *mPolicy;
 
     static std::string thread_name(uint32_t crtc_id) {
       std::stringstream name{};
       name << "Draw " << crtc_id;
       return name.str();
     }
-  public:
+
     // Run something on the drawing thread
     template <typename Callback>
-    void post(Callback &&callback) {
-      mASIO.post(std::forward<Callback>(callback));
+    void run(Callback &&callback) {
+      if (mOwnASIO) {
+        mASIO.post(std::forward<Callback>(callback));
+      } else {
+        // We're already on it
+        callback();
+      }
     }
-
+  public:
     uint32_t crtc_id() const { return mCrtcID; }
 
-    void stop() {
+    // The routine finishes once any outstanding page flip has landed.
+    // Dropping the last copy of on_finished says so.
+    void stop(std::shared_ptr<void> on_finished = {}) {
+      this->run([this, on_finished = std::move(on_finished)]() mutable {
+        if (!mRoutine) return;
+        mRoutine->stop(std::move(on_finished));
+        mRoutine = nullptr;
+      });
       mWork = std::nullopt;
-      mASIO.post([this] { mFPS.stop(); });
     }
 
-    explicit operator bool() const { return static_cast<bool>(mThread); }
+    // The callback is called once the output has nothing in flight on the
+    // hardware. It's called on the drawing thread.
+    void pause(std::function<void()> on_parked) {
+      this->run([this, on_parked = std::move(on_parked)]() mutable {
+        if (mRoutine) {
+          mRoutine->pause(std::move(on_parked));
+        } else {
+          on_parked();
+        }
+      });
+    }
+
+    void resume() {
+      this->run([this] { if (mRoutine) mRoutine->resume(); });
+    }
+
+    explicit operator bool() const {
+      return mThread ? static_cast<bool>(*mThread) : mRoutine != nullptr;
+    }
+
+    // Stop before the thread is joined, so that outputs can be unplugged
+    // individually
+    ~DrawThread() {
+      this->stop();
+      if (mPolicy) mPolicy->sub();
+    }
 
+    // Without a shared io_service the output gets a thread of its own. With
+    // one, this must be called on the thread running it.
     DrawThread(
       Logger &log
+    , asio::io_service *shared
     , GPU const &gpu
+    , ContextSwitchMeter &meter
     , egl::SurfacelessContext const &master_context
     , DisplayMode mode
-    , std::function<void()> draw_callback
-    ) : mASIO{}
+    , std::function<void(scene::Snapshot const *)> draw_callback
+    , scene::Hub::Subscription scene
+    , drm::ModesetBatch::Ticket modeset
+    , std::chrono::steady_clock::time_point requested
+    ) : mOwnASIO{}
+      , mASIO{shared ? *shared : mOwnASIO.emplace()}
       , mWork{std::make_optional<asio::io_service::work>(mASIO)}
-      , mFPS{log, mASIO}
       , mCrtcID{mode.crtc_id()}
-      , mThread{
-          thread_name(mCrtcID), log
-        , [ this, &log, &gpu, &master_context
-          , mode = std::move(mode)
-          , draw_callback = std::move(draw_callback)
-          ]() mutable {
-            DrawRoutine::begin(
-              log
-            , mASIO
-            , gpu
-            , mFPS
-            , master_context
-            , std::move(mode)
-            , std::move(draw_callback)
-            );
-          }
+      , mRoutine{}
+      , mThread{}
+      , mPolicy{nullptr}
+    {
+      if (shared) {
+        mRoutine = DrawRoutine::create(
+          log, mASIO, gpu, meter, master_context, std::move(mode)
+        , std::move(draw_callback), std::move(scene), std::move(modeset)
+        , requested
+        );
+        if (mRoutine) DrawRoutine::start(mRoutine);
+        return;
+      }
+
+      meter.watch(mASIO, thread_name(mCrtcID));
+      mThread.emplace(
+        thread_name(mCrtcID), log
+      , detail::ThreadPolicy::from_environment("DRAW")
+      , [ this, &log, &gpu, &meter, &master_context
+        , mode = std::move(mode)
+        , draw_callback = std::move(draw_callback)
+        , scene = std::move(scene)
+        , modeset = std::move(modeset)
+        , requested
+        ]() mutable {
+          mRoutine = DrawRoutine::create(
+            log, mASIO, gpu, meter, master_context, std::move(mode)
+          , std::move(draw_callback), std::move(scene), std::move(modeset)
+          , requested
+          );
+          if (!mRoutine) return;
+          DrawRoutine::start(mRoutine);
+          mASIO.run();
+          mRoutine = nullptr;
         }
-    {}
+      );
+      mPolicy = &meter.policy(thread_name(mCrtcID), mThread->policy());
+    }
   };
 
   class DeviceManager final {
   private:
     Logger *mLog;
     GPU const &mGPU;
+    // When set, every output repaints on this io_service (and thread)
+    // instead of on a thread of its own
+    asio::io_service *mShared;
+    ContextSwitchMeter &mMeter;
+    scene::Hub &mScene;
     egl::SurfacelessContext mMasterContext;
     // The keys here are connector ids returned from libdrm. The hope is that
     // they are consistent across reboots etc.
     std::map<uint32_t, DrawThread> mDisplayLookup;
     std::set<uint32_t> mUnusedCrtcs;
-
-    void stop_threads() {
+    drm::ConnectorCache mConnectors;
+    drm::EncoderCache mEncoders;
+    // Without DRM master we can't bring outputs up, so hotplug events are
+    // dealt with once we get it back
+    bool mPaused;
+    bool mRescanOnResume;
+
+    void stop_threads(std::shared_ptr<void> const &on_finished = {}) {
       assert(*this);
       for (auto &pair : mDisplayLookup) {
         DrawThread &thread = pair.second;
-        thread.stop();
+        thread.stop(on_finished);
       }
     }
 
     struct Private {};
   public:
     DeviceManager(
-      Private, Logger &log, GPU const &gpu, std::set<uint32_t> unused_crtcs
+      Private, Logger &log, GPU const &gpu, asio::io_service *shared
+    , ContextSwitchMeter &meter, scene::Hub &scene
+    , egl::SurfacelessContext master_context, std::set<uint32_t> unused_crtcs
     ) : mLog{&log}
       , mGPU{gpu}
-      , mMasterContext{egl::SurfacelessContext::create(*mLog, mGPU.egl())}
+      , mShared{shared}
+      , mMeter{meter}
+      , mScene{scene}
+      , mMasterContext{std::move(master_context)}
       , mDisplayLookup{}
       , mUnusedCrtcs{std::move(unused_crtcs)}
+      , mConnectors{}
+      , mEncoders{}
+      , mPaused{false}
+      , mRescanOnResume{false}
     { assert(*this); }
     ~DeviceManager() { this->stop_threads(); }
 
-    static std::optional<DeviceManager> create(Logger &log, GPU const &gpu) {
+    // Pass an io_service to repaint every output on it, rather than giving
+    // each output a thread
+    static std::optional<DeviceManager> create(
+      Logger &log, GPU const &gpu, ContextSwitchMeter &meter
+    , scene::Hub &scene, asio::io_service *shared = nullptr
+    ) {
       drm::Resources resources{log, gpu.drm()};
       if (!resources) return std::nullopt;
 
       std::set<uint32_t> unused_crtcs{};
       for (uint32_t crtc_id : resources.crtcs()) unused_crtcs.insert(crtc_id);
 
+      egl::SurfacelessContext master_context{};
+      {
+        PhaseTimer timer{log, "context creation (master)"};
+        master_context = egl::SurfacelessContext::create(log, gpu.egl());
+      }
+
       return std::make_optional<DeviceManager>(
-        Private{}, log, std::move(gpu), std::move(unused_crtcs)
+        Private{}, log, std::move(gpu), shared, meter, scene
+      , std::move(master_context), std::move(unused_crtcs)
       );
     }
 
@@ -1403,14 +2289,150 @@ namespace waypositor {
       return (mLog != nullptr) && mGPU;
     }
 
-    void update_connections() {
+    // Stop every output from repainting, e.g. because we're about to lose
+    // DRM master. The callback is called once no page flips are in flight
+    // (or once a frame or two has passed, in case an output is wedged).
+    // With a thread per output this blocks until then. With a shared
+    // io_service the flips can only land once we return, so the callback
+    // comes later.
+    void pause(std::function<void()> on_paused) {
+      assert(*this);
+      mPaused = true;
+      auto const timeout = std::chrono::milliseconds{100};
+
+      if (!mShared) {
+        std::vector<std::future<void>> parked{};
+        for (auto &pair : mDisplayLookup) {
+          // asio wants copyable handlers
+          auto promise = std::make_shared<std::promise<void>>();
+          parked.push_back(promise->get_future());
+          pair.second.pause([promise] { promise->set_value(); });
+        }
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        for (auto &future : parked) {
+          if (future.wait_until(deadline) != std::future_status::ready) {
+            mLog->error("Timed out waiting for an output to pause");
+          }
+        }
+        on_paused();
+        return;
+      }
+
+      struct Waiting {
+        std::size_t outputs;
+        std::function<void()> on_paused;
+        asio::steady_timer timeout;
+
+        void finish() {
+          if (!on_paused) return;
+          boost::system::error_code error;
+          timeout.cancel(error);
+          auto callback = std::move(on_paused);
+          on_paused = nullptr;
+          callback();
+        }
+      };
+      // One extra, so that outputs that are idle already can't finish the
+      // wait before every output has been asked
+      auto waiting = std::make_shared<Waiting>(Waiting{
+        mDisplayLookup.size() + 1, std::move(on_paused)
+      , asio::steady_timer{*mShared, timeout}
+      });
+      waiting->timeout.async_wait(
+        [log = mLog, waiting](boost::system::error_code const &error) {
+          if (error) return;
+          log->error("Timed out waiting for an output to pause");
+          waiting->finish();
+        }
+      );
+      auto parked = [waiting] {
+        if (--waiting->outputs == 0) waiting->finish();
+      };
+      for (auto &pair : mDisplayLookup) pair.second.pause(parked);
+      parked();
+    }
+
+    // Stop every output. The callback is called (possibly on a drawing
+    // thread) once they've all finished. The DRM event dispatcher has to
+    // keep running until then, so that their last page flips can land.
+    void shutdown(std::function<void()> on_finished) {
+      assert(*this);
+      auto finished = std::shared_ptr<void>{
+        nullptr, [on_finished = std::move(on_finished)](void *) {
+          on_finished();
+        }
+      };
+      this->stop_threads(finished);
+      finished = nullptr;
+      // With a thread per output, this waits for the threads
+      mDisplayLookup.clear();
+    }
+
+    // Outputs put their last frame back up, only setting the mode if
+    // something else changed it in the meantime
+    void resume() {
       assert(*this);
+      mPaused = false;
+      for (auto &pair : mDisplayLookup) pair.second.resume();
+      if (mRescanOnResume) {
+        mRescanOnResume = false;
+        this->update_connections();
+      }
+    }
+
+    // Outputs that come up as a result of this call report how long it took
+    // them to get their first flip, measured from the given time
+    void update_connections(
+      std::chrono::steady_clock::time_point requested
+        = std::chrono::steady_clock::now()
+    ) {
+      assert(*this);
+      if (mPaused) {
+        mRescanOnResume = true;
+        return;
+      }
 
       drm::Resources resources{*mLog, mGPU.drm()};
       if (!resources) return;
 
-      for (uint32_t connector_id : resources.connectors()) {
-        drm::Connector connector{*mLog, mGPU.drm(), connector_id};
+      this->update_connections(resources, resources.connectors(), requested);
+    }
+
+    // Only look at one connector. Other outputs are left running untouched.
+    void update_connection(
+      uint32_t connector_id
+    , std::chrono::steady_clock::time_point requested
+        = std::chrono::steady_clock::now()
+    ) {
+      assert(*this);
+
+      // Somebody told us this connector changed, so don't trust what we
+      // last knew about it
+      mConnectors.invalidate(connector_id);
+      if (mPaused) {
+        mRescanOnResume = true;
+        return;
+      }
+
+      drm::Resources resources{*mLog, mGPU.drm()};
+      if (!resources) return;
+      this->update_connections(
+        resources, Span<uint32_t const>{&connector_id, 1}, requested
+      );
+    }
+
+  private:
+    template <typename ConnectorIds>
+    void update_connections(
+      drm::Resources const &resources
+    , ConnectorIds const &connector_ids
+    , std::chrono::steady_clock::time_point requested
+    ) {
+      // Work out everything that needs bringing up first, so that all the
+      // new outputs can share a modeset batch
+      std::vector<DisplayMode> plugged{};
+      for (uint32_t connector_id : connector_ids) {
+        auto connector = mConnectors.query(*mLog, mGPU.drm(), connector_id);
         if (!connector) continue;
 
         if (
@@ -1426,33 +2448,68 @@ namespace waypositor {
           // Someone plugged it in!
 
           auto mode = DisplayMode::create(
-            *mLog, mGPU.drm(), resources, mUnusedCrtcs, std::move(connector)
+            *mLog, mGPU.drm(), mEncoders, resources, mUnusedCrtcs
+          , std::move(connector)
           );
           if (!mode) continue;
 
-          float red = ((float) rand() / (RAND_MAX));
-          float green = ((float) rand() / (RAND_MAX));
-          float blue = ((float) rand() / (RAND_MAX));
-
-          uint32_t connector_id = mode.connector_id();
-          uint32_t crtc_id = mode.crtc_id();
-          auto pair = mDisplayLookup.emplace(
-            std::piecewise_construct
-          , std::forward_as_tuple(connector_id)
-          , std::forward_as_tuple(
-              *mLog, mGPU, mMasterContext, std::move(mode)
-            , [red, green, blue]() {
-                glClearColor(red, green, blue, 1.0);
+          // Claim the crtc now so the next connector doesn't pick it too
+          mUnusedCrtcs.erase(mode.crtc_id());
+          plugged.push_back(std::move(mode));
+        }
+      }
+      if (plugged.empty()) return;
+
+      // The surfaces and contexts are created concurrently on the new draw
+      // threads. Their modes are then set together. On a shared io_service
+      // the outputs come up one after the other anyway, and waiting for the
+      // rest of the batch would block the thread they need.
+      std::shared_ptr<drm::ModesetBatch> batch{};
+      if (!mShared) {
+        batch = std::make_shared<drm::ModesetBatch>(
+          *mLog, mGPU.drm(), plugged.size()
+        );
+      }
+      for (DisplayMode &mode : plugged) {
+        float red = ((float) rand() / (RAND_MAX));
+        float green = ((float) rand() / (RAND_MAX));
+        float blue = ((float) rand() / (RAND_MAX));
+
+        uint32_t connector_id = mode.connector_id();
+        uint32_t crtc_id = mode.crtc_id();
+        auto height = static_cast<GLint>(mode.height());
+        auto pair = mDisplayLookup.emplace(
+          std::piecewise_construct
+        , std::forward_as_tuple(connector_id)
+        , std::forward_as_tuple(
+            *mLog, mShared, mGPU, mMeter, mMasterContext, std::move(mode)
+          , [red, green, blue, height](scene::Snapshot const *snapshot) {
+              glClearColor(red, green, blue, 1.0);
+              glClear(GL_COLOR_BUFFER_BIT);
+              if (snapshot == nullptr) return;
+
+              // Nothing samples the buffers yet, so just show where the
+              // surfaces are. GL counts rows from the bottom.
+              glEnable(GL_SCISSOR_TEST);
+              for (scene::Surface const &surface : snapshot->surfaces) {
+                glScissor(
+                  surface.x, height - surface.y - surface.height
+                , surface.width, surface.height
+                );
+                glClearColor(1.0f - red, 1.0f - green, 1.0f - blue, 1.0);
                 glClear(GL_COLOR_BUFFER_BIT);
               }
-            )
-          );
-          DrawThread &thread = pair.first->second;
-          if (!thread) {
-            mDisplayLookup.erase(connector_id);
-            continue;
-          }
-          mUnusedCrtcs.erase(crtc_id);
+              glDisable(GL_SCISSOR_TEST);
+            }
+          , mScene.subscribe()
+          , drm::ModesetBatch::Ticket{batch}
+          , requested
+          )
+        );
+        DrawThread &thread = pair.first->second;
+        if (!thread) {
+          mDisplayLookup.erase(connector_id);
+          mUnusedCrtcs.insert(crtc_id);
         }
       }
     }
@@ -1465,6 +2522,8 @@ namespace waypositor {
     drm::Descriptor const &mDrm;
     asio::posix::stream_descriptor mDescriptor;
     State mState;
+    metrics::Counter &mEvents;
+    metrics::Histogram &mHandling;
 
     class Worker {
     private:
@@ -1488,6 +2547,8 @@ namespace waypositor {
         boost::system::error_code const &error = {}, std::size_t = 0
       ) {
         assert(*this);
+        // Cancelled by stop(). The dispatcher may be gone already.
+        if (error == asio::error::operation_aborted) return;
         if (error) {
           self->mLog.error("ASIO error: ", error.message());
           return;
@@ -1496,8 +2557,12 @@ namespace waypositor {
         switch (self->mState) {
         case State::STOPPED:
           return;
-        case State::GOT_EVENT:
+        case State::GOT_EVENT: {
+          auto start = std::chrono::steady_clock::now();
           DrawRoutine::handle_event(self->mDrm);
+          self->mHandling.record(std::chrono::steady_clock::now() - start);
+          self->mEvents.add();
+        }
           // Fall through
         case State::WAITING:
           self->mState = State::GOT_EVENT;
@@ -1511,8 +2576,11 @@ namespace waypositor {
       explicit operator bool() const { return self != nullptr; }
     };
   public:
+    // Only stop once nothing is waiting for a page flip any more
     void stop() {
       mState = State::STOPPED;
+      boost::system::error_code error;
+      mDescriptor.cancel(error);
     }
 
     // Should only be called once!
@@ -1520,9 +2588,16 @@ namespace waypositor {
 
     EventDispatcher(
       Logger &log, asio::io_service &asio, drm::Descriptor const &drm
+    , metrics::Registry &registry
     ) : mLog{log}, mDrm{drm}
       , mDescriptor{asio, ::dup(drm.get())}
       , mState{State::WAITING}
+      , mEvents{registry.counter(
+          "waypositor_drm_wakeups_total", "Times DRM events were read"
+        )}
+      , mHandling{registry.histogram(
+          "waypositor_drm_event_seconds", "Time spent handling DRM events"
+        )}
     {}
   };
 
@@ -1533,17 +2608,292 @@ namespace waypositor {
     detail::RAIIThread mThread;
   public:
     DispatcherThread(
-      Logger &log, drm::Descriptor const &drm
+      Logger &log, drm::Descriptor const &drm, metrics::Registry &registry
     ) : mAsio{}
-      , mDispatcher{log, mAsio, drm}
-      , mThread{[this] {
-          mDispatcher.launch();
-          mAsio.run();
-        }}
-    {}
+      , mDispatcher{log, mAsio, drm, registry}
+      , mThread{
+          detail::ThreadPolicy::from_environment("DISPATCHER")
+        , [this] {
+            mDispatcher.launch();
+            mAsio.run();
+          }
+        }
+    {
+      log.info(
+        "Dispatcher thread scheduling: ", mThread.policy().description
+      );
+      detail::export_policy(registry, "Dispatcher", mThread.policy());
+    }
     ~DispatcherThread() { mAsio.post([this] { mDispatcher.stop(); }); }
   };
 
+  namespace hotplug {
+    struct Event {
+      // Newer kernels say which connector changed. Without that, every
+      // connector has to be checked (which is still cheap for the ones whose
+      // state didn't change).
+      std::optional<uint32_t> connector_id;
+    };
+
+    // Somewhere hotplug events come from
+    class Source {
+    public:
+      // Becomes readable when there are events to receive. Owned by the
+      // source.
+      virtual int descriptor() const = 0;
+      // Consume whatever events are available without blocking
+      virtual void receive(std::function<void(Event)> const &on_event) = 0;
+      virtual ~Source() = default;
+    };
+
+    // DRM change uevents from the kernel, via udev's netlink socket
+    class UdevSource final : public Source {
+    private:
+      static void safe_delete(udev *context) {
+        if (context != nullptr) udev_unref(context);
+      }
+      static void safe_delete_monitor(udev_monitor *monitor) {
+        if (monitor != nullptr) udev_monitor_unref(monitor);
+      }
+      static void safe_delete_device(udev_device *device) {
+        if (device != nullptr) udev_device_unref(device);
+      }
+      using Device = std::unique_ptr<
+        udev_device, decltype(&safe_delete_device)
+      >;
+
+      Logger &mLog;
+      std::string mDevnode;
+      std::unique_ptr<udev, decltype(&safe_delete)> mContext;
+      std::unique_ptr<udev_monitor, decltype(&safe_delete_monitor)> mMonitor;
+
+      static std::optional<uint32_t> parse_id(char const *value) {
+        if (value == nullptr) return std::nullopt;
+        char *end = nullptr;
+        unsigned long id = std::strtoul(value, &end, 10);
+        if (end == value || *end != '\0') return std::nullopt;
+        return static_cast<uint32_t>(id);
+      }
+
+    public:
+      // Only events for the given device node are reported
+      UdevSource(Logger &log, std::string devnode)
+        : mLog{log}, mDevnode{std::move(devnode)}
+        , mContext{udev_new(), &safe_delete}
+        , mMonitor{nullptr, &safe_delete_monitor}
+      {
+        if (!mContext) {
+          mLog.error("Couldn't create udev context");
+          return;
+        }
+        mMonitor.reset(udev_monitor_new_from_netlink(mContext.get(), "udev"));
+        if (!mMonitor) {
+          mLog.error("Couldn't create udev monitor");
+          return;
+        }
+        if (
+          udev_monitor_filter_add_match_subsystem_devtype(
+            mMonitor.get(), "drm", "drm_minor"
+          ) < 0
+       || udev_monitor_enable_receiving(mMonitor.get()) < 0
+        ) {
+          mLog.error("Couldn't start udev monitor");
+          mMonitor.reset();
+        }
+      }
+
+      explicit operator bool() const { return mMonitor != nullptr; }
+
+      int descriptor() const override {
+        assert(*this);
+        return udev_monitor_get_fd(mMonitor.get());
+      }
+
+      void receive(std::function<void(Event)> const &on_event) override {
+        assert(*this);
+        while (true) {
+          Device device{
+            udev_monitor_receive_device(mMonitor.get()), &safe_delete_device
+          };
+          if (!device) return;
+
+          char const *action = udev_device_get_action(device.get());
+          char const *devnode = udev_device_get_devnode(device.get());
+          char const *is_hotplug = udev_device_get_property_value(
+            device.get(), "HOTPLUG"
+          );
+          if (
+            action == nullptr || strcmp(action, "change") != 0
+         || devnode == nullptr || mDevnode != devnode
+         || is_hotplug == nullptr || strcmp(is_hotplug, "1") != 0
+          ) continue;
+
+          on_event(Event{parse_id(
+            udev_device_get_property_value(device.get(), "CONNECTOR")
+          )});
+        }
+      }
+    };
+
+    // Stands in for udev so hotplug handling can be exercised without
+    // touching any cables. Reads lines from a descriptor (e.g. a FIFO):
+    // "change" rescans everything, "change <connector id>" rescans one
+    // connector.
+    class FakeSource final : public Source {
+    private:
+      Logger &mLog;
+      int mDescriptor;
+      std::string mPending;
+
+    public:
+      FakeSource(Logger &log, char const *path)
+        : mLog{log}
+        , // Opening for writing too keeps the FIFO from reporting EOF
+          // whenever the last writer goes away
+          mDescriptor{open(path, O_RDWR | O_NONBLOCK)}
+        , mPending{}
+      { if (mDescriptor < 0) mLog.perror("Couldn't open fake hotplug source"); }
+      FakeSource(FakeSource const &) = delete;
+      FakeSource &operator=(FakeSource const &) = delete;
+      ~FakeSource() { if (*this) close(mDescriptor); }
+
+      explicit operator bool() const { return mDescriptor >= 0; }
+
+      int descriptor() const override { assert(*this); return mDescriptor; }
+
+      void receive(std::function<void(Event)> const &on_event) override {
+        assert(*this);
+        char buffer[256];
+        ssize_t count;
+        while ((count = read(mDescriptor, buffer, sizeof(buffer))) > 0) {
+          mPending.append(buffer, count);
+        }
+
+        std::size_t end;
+        while ((end = mPending.find('\n')) != std::string::npos) {
+          std::stringstream line{mPending.substr(0, end)};
+          mPending.erase(0, end + 1);
+
+          std::string action{};
+          line >> action;
+          if (action != "change") {
+            mLog.error("Unknown fake hotplug event: ", action);
+            continue;
+          }
+          uint32_t connector_id;
+          if (line >> connector_id) {
+            on_event(Event{connector_id});
+          } else {
+            on_event(Event{std::nullopt});
+          }
+        }
+      }
+    };
+
+    // Watches a hotplug source on an io_service and hands its events to the
+    // device manager
+    class Monitor final {
+    private:
+      enum class State { WAITING, GOT_EVENT, STOPPED };
+      Logger &mLog;
+      DeviceManager &mDevices;
+      std::unique_ptr<Source> mSource;
+      asio::posix::stream_descriptor mDescriptor;
+      State mState;
+
+      class Worker {
+      private:
+        Monitor *self;
+      public:
+        Worker(Worker const &);
+        Worker &operator=(Worker const &);
+        Worker(Worker &&other) noexcept : self{other.self}
+        { other.self = nullptr; }
+        Worker &operator=(Worker &&other) {
+          if (this == &other) return *this;
+          self = other.self;
+          other.self = nullptr;
+          return *this;
+        }
+        ~Worker() = default;
+
+        Worker(Monitor &self_) : self{&self_} {}
+
+        void operator()(
+          boost::system::error_code const &error = {}, std::size_t = 0
+        ) {
+          assert(*this);
+          if (error == asio::error::operation_aborted) return;
+          if (error) {
+            self->mLog.error("(Hotplug) ASIO error: ", error.message());
+            return;
+          }
+
+          switch (self->mState) {
+          case State::STOPPED:
+            return;
+          case State::GOT_EVENT:
+            self->mSource->receive([this](Event event) {
+              if (event.connector_id) {
+                self->mLog.info(
+                  "Hotplug event for connector ", *event.connector_id
+                );
+                self->mDevices.update_connection(*event.connector_id);
+              } else {
+                self->mLog.info("Hotplug event");
+                self->mDevices.update_connections();
+              }
+            });
+            // Fall through
+          case State::WAITING:
+            self->mState = State::GOT_EVENT;
+            asio::async_read(
+              self->mDescriptor, asio::null_buffers(), std::move(*this)
+            );
+            return;
+          }
+        }
+
+        explicit operator bool() const { return self != nullptr; }
+      };
+
+    public:
+      Monitor(
+        Logger &log, asio::io_service &asio, DeviceManager &devices
+      , std::unique_ptr<Source> source
+      ) : mLog{log}, mDevices{devices}, mSource{std::move(source)}
+        , mDescriptor{asio, ::dup(mSource->descriptor())}
+        , mState{State::WAITING}
+      {}
+      ~Monitor() { this->stop(); }
+
+      // Should only be called once!
+      void launch() { Worker{*this}(); }
+
+      void stop() {
+        mState = State::STOPPED;
+        boost::system::error_code error;
+        mDescriptor.cancel(error);
+      }
+    };
+
+    // Prefers the fake source when WAYPOSITOR_FAKE_HOTPLUG names one
+    inline std::unique_ptr<Source> create_source(
+      Logger &log, char const *devnode
+    ) {
+      if (char const *path = std::getenv("WAYPOSITOR_FAKE_HOTPLUG")) {
+        log.info("Reading fake hotplug events from ", path);
+        auto source = std::make_unique<FakeSource>(log, path);
+        if (!*source) return nullptr;
+        return source;
+      }
+
+      auto source = std::make_unique<UdevSource>(log, devnode);
+      if (!*source) return nullptr;
+      return source;
+    }
+  }
+
   namespace vt {
     // NOTE! This basically assumes it is launched directly from a virtual
     // terminal for now. It will need updating.
@@ -1592,28 +2942,92 @@ namespace waypositor {
 
 int main(int, char **argv) {
   using namespace waypositor;
+  auto startup = std::chrono::steady_clock::now();
 
+  // Outlives anything that might still be subscribed to it
+  scene::Hub scene{};
   asio::io_service asio{};
+  // Likewise for anything recording into it
+  metrics::Registry registry{};
 
   Logger logger{"Main"};
+  logger.instrument(registry);
+  // Before anything is posted to it
+  loop::Monitor::install(asio, registry, "Main", logger.slow_handlers());
 
   auto vt_mode = vt::Mode::create(logger, STDIN_FILENO);
   if (!vt_mode) return EXIT_FAILURE;
 
-  auto gpu = GPU::create(logger, "/dev/dri/card0");
+  static constexpr char gpu_path[] = "/dev/dri/card0";
+  auto gpu = GPU::create(logger, gpu_path);
   if (!gpu) return EXIT_FAILURE;
 
-  auto dispatcher = std::make_optional<DispatcherThread>(logger, gpu.drm());
+  // Run the outputs and DRM events on this thread, rather than on a thread
+  // each. This saves context switches, at the cost of the outputs sharing a
+  // core.
+  char const *shared_setting = std::getenv("WAYPOSITOR_SHARED_REACTOR");
+  bool const shared_reactor =
+    shared_setting != nullptr && std::string_view{shared_setting} != "0";
+
+  std::optional<DispatcherThread> dispatcher_thread{};
+  std::optional<EventDispatcher> dispatcher{};
+  if (shared_reactor) {
+    auto applied = detail::apply(
+      detail::ThreadPolicy::from_environment("DRAW")
+    );
+    logger.info("Shared reactor scheduling: ", applied.description);
+    detail::export_policy(registry, "Shared reactor", applied);
+    dispatcher.emplace(logger, asio, gpu.drm(), registry);
+    dispatcher->launch();
+  } else {
+    dispatcher_thread.emplace(logger, gpu.drm(), registry);
+  }
+
+  ContextSwitchMeter meter{logger, asio, registry};
+  meter.start();
 
   std::optional<drm::Master> master = drm::Master::create(logger, gpu.drm());
   if (!*master) return EXIT_FAILURE;
 
   std::optional<DeviceManager> device_manager = DeviceManager::create(
-    logger, gpu
+    logger, gpu, meter, scene, shared_reactor ? &asio : nullptr
   );
   if (!device_manager) return EXIT_FAILURE;
 
-  device_manager->update_connections();
+  device_manager->update_connections(startup);
+
+  // Serve clients from this process too, and show what they commit
+  char const *socket_name = std::getenv("WAYPOSITOR_LISTEN");
+  FrameClock frames{logger, asio, scene};
+  std::optional<Listener> listener = socket_name
+    ? Listener::create(
+        logger, asio, scene, surface_globals(frames), socket_name
+      )
+    : std::nullopt;
+  if (socket_name && !listener) return EXIT_FAILURE;
+  if (listener) {
+    listener->server().instrument(registry);
+    listener->server().limit(Limits::from_environment());
+    frames.launch();
+    listener->launch();
+  }
+
+  // Metrics on a socket of their own, for scraping
+  char const *stats_name = std::getenv("WAYPOSITOR_STATS");
+  std::optional<stats::Endpoint> endpoint = stats_name
+    ? stats::Endpoint::create(logger, registry, stats_name)
+    : std::nullopt;
+  if (stats_name && !endpoint) return EXIT_FAILURE;
+
+  std::optional<hotplug::Monitor> hotplug_monitor{};
+  if (auto source = hotplug::create_source(logger, gpu_path)) {
+    hotplug_monitor.emplace(
+      logger, asio, *device_manager, std::move(source)
+    );
+    hotplug_monitor->launch();
+  } else {
+    logger.error("Hotplug monitoring unavailable");
+  }
 
   // TTY stuff (This doesn't work yet.)
   struct vt_mode mode{};
@@ -1628,26 +3042,40 @@ int main(int, char **argv) {
   auto tty_signals = std::make_optional<asio::signal_set>(
     asio, SIGUSR1, SIGUSR2
   );
-  tty_signals->async_wait([&](
-    boost::system::error_code const &error, int signal
-  ) {
+  std::function<void(boost::system::error_code const &, int)> on_tty_signal;
+  on_tty_signal = [&](boost::system::error_code const &error, int signal) {
+    if (error == asio::error::operation_aborted) return;
     if (error) {
       logger.error("(TTY signal handler) ASIO error: ", error.message());
       return;
     }
     switch (signal) {
     case SIGUSR1:
+    {
       logger.info("VT release requested");
-      master = std::nullopt;
-      ioctl(STDIN_FILENO, VT_RELDISP, 1);
+      // Nothing may be in flight on the hardware once we lose master
+      auto release = [&] {
+        master = std::nullopt;
+        ioctl(STDIN_FILENO, VT_RELDISP, 1);
+      };
+      if (device_manager) {
+        device_manager->pause(release);
+      } else {
+        release();
+      }
       break;
+    }
     case SIGUSR2:
       logger.info("VT acquire requested");
       ioctl(STDIN_FILENO, VT_RELDISP, VT_ACKACQ);
       master = drm::Master::create(logger, gpu.drm());
+      if (device_manager) device_manager->resume();
       break;
     }
-  });
+    // VT switches can happen any number of times
+    if (tty_signals) tty_signals->async_wait(on_tty_signal);
+  };
+  tty_signals->async_wait(on_tty_signal);
 
   asio::signal_set interrupts{asio, SIGINT, SIGTERM};
   interrupts.async_wait([&](
@@ -1661,11 +3089,26 @@ int main(int, char **argv) {
     }
 
     logger.info("SIGINT/SIGTERM signal handler invoked");
-    // We stop the dispatcher first because it holds references into the device
-    // manager
-    dispatcher = std::nullopt;
-    device_manager = std::nullopt;
+    if (listener) {
+      listener->server().log_latency();
+      listener->stop();
+    }
+    frames.stop();
+    hotplug_monitor = std::nullopt;
     tty_signals = std::nullopt;
+    auto stopped = [&] {
+      // The dispatcher holds references into the outputs, and the outputs
+      // need it until their last page flips land, so it goes last
+      device_manager = std::nullopt;
+      dispatcher = std::nullopt;
+      dispatcher_thread = std::nullopt;
+      meter.stop();
+    };
+    if (device_manager) {
+      device_manager->shutdown([&asio, stopped] { asio.post(stopped); });
+    } else {
+      stopped();
+    }
   });
 
   asio.run();
@@ -0,0 +1,674 @@
+// Times the protocol server's whole parse, dispatch and reply path, in this
+// process, over socket pairs. Nothing touches the filesystem, so the numbers
+// are only the server's (and the client harness's) work.
+//
+//   ob-protocol-bench [-n operations] [-b burst] [-w window] [-i idle]
+//                     [-f flooders] [-d] [-z] [scenario...]
+//
+// The scenarios are:
+//
+//   sync      a wl_display.sync roundtrip
+//   burst     a number of syncs pipelined in one write, timed per sync
+//   registry  wl_display.get_registry, and a roundtrip for the globals
+//   surface   wl_compositor.create_surface, commit and destroy, then a sync
+//   objects   a region and a surface created, and the ones from a window of
+//             operations ago destroyed, then a sync
+//   frames    a wl_shm buffer attached (one of two, in turn), a frame callback
+//             asked for and a commit, then a sync, the snapshot presented as
+//             an output would, and a wait for the callback's done
+//
+// After each scenario, while its connection is still open, comes what the
+// server holds for it: objects, and arena slack (what's freed or not yet
+// handed out). With -d, connections use the default allocator instead of
+// arenas, for comparison; the heap's own use is shown either way.
+//
+// With -i, a number of connections are opened first and left idle, each
+// with a registry, and what the server holds per connection is checked
+// against IDLE_CONNECTION_BUDGET.
+//
+// The scenarios run without a request rate limit, as they're there to time
+// the server. With -f, a client making roundtrips back to back is timed on
+// its own, and then next to a number of clients flooding the server with
+// requests, first without a rate limit and then with one well below what
+// the server can take. With the limit, it has to keep at least 90% of the
+// rate it had alone. A message over the size limit has to get its client
+// hung up on.
+//
+// After the scenarios comes the server's own view: its per-request latencies.
+//
+// Built with -Dallocation_tracking=true, it also counts what the server
+// thread allocates per operation once warmed up. With -z, a scenario fails
+// if that's anything at all, bar a connection's objects' table or arena
+// growing, and the server thread traps on allocating while dispatching a
+// request, naming where.
+// The server's own log goes to stdout as usual. Results go to stderr.
+
+#include <waypositor/allocations.hpp>
+#include <waypositor/harness.hpp>
+#include <waypositor/latency.hpp>
+#include <waypositor/logger.hpp>
+#include <waypositor/protocol.hpp>
+#include <waypositor/scene.hpp>
+#include <waypositor/surface.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <malloc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <boost/asio/io_service.hpp>
+
+namespace waypositor { namespace protocol_bench {
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    std::size_t operations{100000};
+    std::size_t burst{16};
+    // Fail if the server allocates more than a scenario's budget once
+    // warmed up
+    bool check_allocations{false};
+    // Connections to check the idle footprint with
+    std::size_t idle{0};
+    // Operations an object lives for in the objects scenario
+    std::size_t window{64};
+    // Whether connections use arenas
+    bool arenas{true};
+    // Clients to flood the server with
+    std::size_t flooders{0};
+  };
+
+  // A scenario's connection, and what it keeps between operations
+  struct Session {
+    harness::Client &client;
+    uint32_t compositor;
+    // Stands in for an output, on this thread
+    scene::Hub::Subscription &output;
+    // Oldest first
+    std::deque<uint32_t> live{};
+    // What frames are drawn with, made on the first one
+    uint32_t surface{0};
+    std::array<uint32_t, 2> buffers{};
+    std::size_t frame{0};
+  };
+
+  // One operation. False if the connection broke.
+  using Scenario = bool (*)(Session &, Options const &);
+
+  bool sync(Session &session, Options const &) {
+    return session.client.roundtrip();
+  }
+
+  bool burst(Session &session, Options const &options) {
+    harness::Client &client = session.client;
+    // The roundtrip brings the last one
+    for (std::size_t i = 1; i < options.burst; ++i) {
+      client.request(Event{1, 0}.uint(client.new_id()));
+    }
+    return client.roundtrip();
+  }
+
+  bool registry(Session &session, Options const &) {
+    harness::Client &client = session.client;
+    client.request(Event{1, 1}.uint(client.new_id()));
+    return client.roundtrip();
+  }
+
+  bool surface(Session &session, Options const &) {
+    harness::Client &client = session.client;
+    uint32_t id = client.new_id();
+    client.request(Event{session.compositor, 0}.uint(id));
+    client.request(Event{id, 6});
+    client.request(Event{id, 0});
+    return client.roundtrip();
+  }
+
+  // Objects of two sizes with overlapping lifetimes, the way a client's
+  // come and go, to show up fragmentation
+  bool objects(Session &session, Options const &options) {
+    harness::Client &client = session.client;
+    uint32_t region = client.new_id();
+    client.request(Event{session.compositor, 1}.uint(region));
+    uint32_t surface = client.new_id();
+    client.request(Event{session.compositor, 0}.uint(surface));
+    session.live.push_back(region);
+    session.live.push_back(surface);
+    while (session.live.size() > 2 * options.window) {
+      // Both have destroy as opcode 0
+      client.request(Event{session.live.front(), 0});
+      session.live.pop_front();
+    }
+    return client.roundtrip();
+  }
+
+  // Binds a global, or returns 0 if the server doesn't have it
+  inline uint32_t bind(harness::Client &client, std::string_view wanted) {
+    uint32_t registry = client.new_id();
+    client.request(Event{1, 1}.uint(registry));
+    std::optional<std::pair<uint32_t, uint32_t>> found{};
+    bool ok = client.roundtrip([&](uint32_t object, Message &message) {
+      if (object != registry || message.opcode() != 0) return;
+      uint32_t name = message.uint();
+      std::string_view interface = message.string();
+      uint32_t version = message.uint();
+      if (message && interface == wanted) found.emplace(name, version);
+    });
+    if (!ok || !found) return 0;
+    uint32_t id = client.new_id();
+    client.request(
+      Event{registry, 0}.uint(found->first).string(wanted)
+        .uint(found->second).uint(id)
+    );
+    return client.roundtrip() ? id : 0;
+  }
+
+  // A surface, and two buffers in a pool to attach to it in turn
+  inline bool prepare_frames(Session &session) {
+    static constexpr int32_t SIZE = 64;
+    static constexpr int32_t STRIDE = SIZE * 4;
+    harness::Client &client = session.client;
+    uint32_t shm = bind(client, "wl_shm");
+    if (shm == 0) return false;
+    int fd = ::memfd_create("ob-protocol-bench", MFD_CLOEXEC);
+    if (fd < 0) return false;
+    if (::ftruncate(fd, 2 * STRIDE * SIZE) < 0) {
+      ::close(fd);
+      return false;
+    }
+    uint32_t pool = client.new_id();
+    client.request(Event{shm, 0}.uint(pool).integer(2 * STRIDE * SIZE), fd);
+    for (std::size_t i = 0; i < session.buffers.size(); ++i) {
+      session.buffers[i] = client.new_id();
+      client.request(
+        Event{pool, 0}.uint(session.buffers[i])
+          .integer(static_cast<int32_t>(i) * STRIDE * SIZE)
+          .integer(SIZE).integer(SIZE).integer(STRIDE).uint(1)
+      );
+    }
+    session.surface = client.new_id();
+    client.request(Event{session.compositor, 0}.uint(session.surface));
+    bool ok = client.roundtrip();
+    ::close(fd);
+    return ok;
+  }
+
+  // Shows the latest snapshot, as an output would right after its flip
+  inline void present(scene::Hub::Subscription &output, unsigned sequence) {
+    output.update();
+    scene::Snapshot const *snapshot = output.current();
+    if (snapshot == nullptr) return;
+    auto visible = std::make_shared<
+      std::vector<std::pair<std::size_t, uint32_t>>
+    >();
+    for (scene::Surface const &surface : snapshot->surfaces) {
+      visible->emplace_back(surface.client, surface.id);
+    }
+    output.present(scene::Presentation{
+      0, snapshot->generation, scene::Clock::now(), {}, sequence
+    , std::move(visible)
+    });
+  }
+
+  bool frames(Session &session, Options const &) {
+    harness::Client &client = session.client;
+    if (session.surface == 0 && !prepare_frames(session)) return false;
+    uint32_t buffer = session.buffers[session.frame % session.buffers.size()];
+    uint32_t callback = client.new_id();
+    client.request(
+      Event{session.surface, 1}.uint(buffer).integer(0).integer(0)
+    );
+    client.request(Event{session.surface, 3}.uint(callback));
+    client.request(Event{session.surface, 6});
+    // The commit has to be in the scene before it can be shown
+    if (!client.roundtrip()) return false;
+    present(session.output, static_cast<unsigned>(++session.frame));
+    return client.until([callback](uint32_t object, Message &message) {
+      return object == callback && message.opcode() == 0;
+    });
+  }
+
+  struct Entry {
+    std::string_view name;
+    Scenario run;
+    // How many requests it times in one go
+    bool bursts;
+  };
+
+  constexpr std::array<Entry, 6> scenarios{{
+    {"sync", sync, false}
+  , {"burst", burst, true}
+  , {"registry", registry, false}
+  , {"surface", surface, false}
+  , {"objects", objects, false}
+  , {"frames", frames, false}
+  }};
+
+  // The server thread's allocations so far. They're read on that thread,
+  // and the asking is done (and counted) on this one.
+  inline allocations::Counts server_allocations(asio::io_service &asio) {
+    std::promise<allocations::Counts> promise{};
+    auto counts = promise.get_future();
+    asio.post([&promise] { promise.set_value(allocations::counts()); });
+    return counts.get();
+  }
+
+  // Whether the server thread traps on allocating where it's forbidden to
+  inline void check_server(asio::io_service &asio, bool enabled) {
+    std::promise<void> promise{};
+    auto done = promise.get_future();
+    asio.post([&promise, enabled] {
+      allocations::check(enabled);
+      promise.set_value();
+    });
+    done.wait();
+  }
+
+  // Waits for the server thread to finish what it's doing
+  inline void settle(asio::io_service &asio) {
+    std::promise<void> promise{};
+    auto done = promise.get_future();
+    asio.post([&promise] { promise.set_value(); });
+    done.wait();
+  }
+
+  // False if the connections hold more than the budget
+  inline bool check_idle(
+    Server &server, asio::io_service &asio, std::size_t count
+  ) {
+    std::deque<harness::Client> clients{};
+    for (std::size_t i = 0; i < count; ++i) {
+      harness::Client &client = clients.emplace_back(server);
+      client.request(Event{1, 1}.uint(client.new_id()));
+      if (!client.roundtrip()) {
+        std::cerr << "idle: the server hung up" << std::endl;
+        return false;
+      }
+    }
+    // The last ones go idle after answering
+    settle(asio);
+    auto [footprint, connections] = server.footprint();
+    std::size_t each = footprint.total() / std::max<std::size_t>(
+      1, connections
+    );
+    std::cerr << "idle: " << connections << " connections, " << each
+              << " bytes each (connection "
+              << footprint.connection / connections
+              << ", objects " << footprint.objects / connections
+              << ", slack " << footprint.slack / connections
+              << ", buffers " << footprint.buffers / connections
+              << ", scratch " << footprint.scratch / connections
+              << "), budget " << IDLE_CONNECTION_BUDGET << "\n" << std::endl;
+    return connections == count && each <= IDLE_CONNECTION_BUDGET;
+  }
+
+  inline void report(
+    Entry const &entry, Options const &options
+  , std::vector<uint64_t> &latencies, Clock::duration elapsed
+  , allocations::Counts allocated
+  ) {
+    using Seconds = std::chrono::duration<double>;
+    std::size_t per = entry.bursts ? options.burst : 1;
+    double operations = static_cast<double>(latencies.size() * per);
+    std::sort(latencies.begin(), latencies.end());
+    auto at = [&latencies, per](double p) {
+      auto index = static_cast<std::size_t>(
+        p * (latencies.size() - 1) + 0.5
+      );
+      return latencies[index] / 1000.0 / per;
+    };
+    std::cerr << std::left << std::setw(10) << entry.name
+              << std::right << std::setw(10)
+              << static_cast<std::size_t>(operations)
+              << std::setw(12) << operations / Seconds{elapsed}.count()
+              << std::setw(10) << at(0.5)
+              << std::setw(10) << at(0.9)
+              << std::setw(10) << at(0.99)
+              << std::setw(10) << latencies.back() / 1000.0 / per;
+    if constexpr (allocations::TRACKED) {
+      std::cerr << std::setw(12) << allocated.allocations / operations
+                << std::setw(12) << allocated.bytes / operations;
+    }
+    std::cerr << std::endl;
+  }
+
+  // How a client making roundtrips back to back got on
+  struct Roundtrips {
+    double rate;
+    // In microseconds
+    double p50;
+    double p99;
+  };
+
+  // Each roundtrip starts as soon as the last one is done, so whatever the
+  // server takes from this client for others shows up as a lower rate
+  inline std::optional<Roundtrips> roundtrips(
+    Server &server, std::size_t count
+  ) {
+    harness::Client client{server};
+    std::vector<uint64_t> latencies{};
+    latencies.reserve(count);
+    auto start = Clock::now();
+    for (std::size_t i = 0; i < count; ++i) {
+      auto before = Clock::now();
+      if (!client.roundtrip()) return std::nullopt;
+      latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - before
+      ).count());
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    std::sort(latencies.begin(), latencies.end());
+    auto at = [&latencies](double p) {
+      return latencies[static_cast<std::size_t>(
+        p * (latencies.size() - 1) + 0.5
+      )] / 1000.0;
+    };
+    return Roundtrips{count / elapsed.count(), at(0.5), at(0.99)};
+  }
+
+  // Sends wl_region.add as fast as the server will take it, until told to
+  // stop. Nothing comes back, so nothing has to be read. It only writes
+  // when there's room, so that it sees being told.
+  inline void flood(harness::Client &client, std::atomic<bool> &stop) {
+    uint32_t compositor = bind(client, "wl_compositor");
+    if (compositor == 0) return;
+    uint32_t region = client.new_id();
+    client.request(Event{compositor, 1}.uint(region));
+    while (!stop) {
+      if (!client.writable(std::chrono::milliseconds{100})) continue;
+      for (int i = 0; i < 64; ++i) {
+        client.request(
+          Event{region, 1}.integer(0).integer(0).integer(1).integer(1)
+        );
+      }
+      if (!client.flush()) return;
+    }
+  }
+
+  // What the flood check holds the flooders to: low enough that dozens of
+  // them together take a few percent of what the server can do
+  inline Limits flood_limits() {
+    Limits limits{};
+    limits.rate = 200;
+    limits.burst = 64;
+    return limits;
+  }
+
+  // The well-behaved client's roundtrips next to flooding clients, each
+  // held to limits of their own
+  inline std::optional<Roundtrips> flooded(
+    Server &server, std::size_t flooders, Limits const &theirs
+  , Limits const &ours, std::size_t count
+  ) {
+    std::size_t before = server.footprint().second;
+    server.limit(theirs);
+    std::atomic<bool> stop{false};
+    std::deque<harness::Client> clients{};
+    std::vector<std::thread> threads{};
+    for (std::size_t i = 0; i < flooders; ++i) {
+      harness::Client &client = clients.emplace_back(server);
+      threads.emplace_back([&client, &stop] { flood(client, stop); });
+    }
+    server.limit(ours);
+    // Long enough for them to use up their bursts, after which they only
+    // get the rate
+    std::this_thread::sleep_for(std::chrono::milliseconds{100});
+    auto result = roundtrips(server, count);
+    stop = true;
+    for (auto &thread : threads) thread.join();
+    clients.clear();
+    // The server goes through what they left on their sockets before it
+    // sees them hang up, and it shouldn't be doing that in the next run
+    while (server.footprint().second > before) {
+      std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    }
+    return result;
+  }
+
+  // False if a well-behaved client lost more than a little of its rate to
+  // the flooding ones, or if the size limit didn't hold
+  inline bool check_flood(Server &server, std::size_t flooders) {
+    constexpr std::size_t COUNT = 20000;
+    // Runs vary by about as much as what's being looked for, but runs taken
+    // one after the other vary together. So each round compares its own,
+    // and the median of the rounds is what counts.
+    constexpr std::size_t ROUNDS = 7;
+    // The well-behaved client isn't held to a rate itself
+    Limits const limits = flood_limits();
+    Limits const unlimited{};
+
+    // Of the rate alone. The flooders without a rate limit are there for
+    // comparison.
+    std::vector<double> control{};
+    std::vector<double> limited{};
+    for (std::size_t i = 0; i < ROUNDS; ++i) {
+      auto alone = roundtrips(server, COUNT);
+      auto loose = flooded(server, flooders, unlimited, unlimited, COUNT);
+      auto held = flooded(server, flooders, limits, unlimited, COUNT);
+      if (!alone || !loose || !held) {
+        std::cerr << "flood: the server hung up" << std::endl;
+        return false;
+      }
+      std::cerr << "flood: " << alone->rate << " roundtrips/s alone (p99 "
+                << alone->p99 << "us), " << loose->rate << " next to "
+                << flooders << " flooders without a rate limit (p99 "
+                << loose->p99 << "us), " << held->rate << " with (p99 "
+                << held->p99 << "us)" << std::endl;
+      control.push_back(loose->rate / alone->rate);
+      limited.push_back(held->rate / alone->rate);
+    }
+    auto median = [](std::vector<double> &values) {
+      std::sort(values.begin(), values.end());
+      return values[values.size() / 2];
+    };
+
+    // Round robin alone leaves it 1 / (flooders + 1). With the rate limit,
+    // the flooders only get a little, and it should hardly notice them.
+    constexpr double KEPT = 0.9;
+    double kept = median(limited);
+    std::cerr << "flood: kept " << kept * 100 << "% of the rate alone, "
+              << median(control) * 100 << "% without a rate limit, and needs "
+              << KEPT * 100 << "%" << std::endl;
+    bool ok = kept >= KEPT;
+
+    // Made up as a sync with far too much after it
+    harness::Client oversized{server};
+    Event event{1, 0};
+    for (std::size_t i = 0; i < limits.message / sizeof(uint32_t); ++i) {
+      event.uint(0);
+    }
+    oversized.request(event);
+    bool hung_up = !oversized.roundtrip();
+    std::cerr << "flood: a " << event.words().size() * sizeof(uint32_t)
+              << " byte message was " << (hung_up ? "" : "not ")
+              << "hung up on\n" << std::endl;
+    return ok && hung_up;
+  }
+
+  // What's held for objects, by the one connection open, and by the heap
+  inline void report_memory(Server &server) {
+    Footprint footprint = server.footprint().first;
+    struct mallinfo2 heap = ::mallinfo2();
+    std::cerr << std::setw(10) << "" << " objects " << footprint.objects
+              << " bytes, slack " << footprint.slack << " bytes; heap "
+              << heap.uordblks << " in use, " << heap.fordblks << " free"
+              << std::endl;
+  }
+}}
+
+int main(int argc, char **argv) {
+  using namespace waypositor;
+  using namespace waypositor::protocol_bench;
+
+  Options options{};
+  int option = 0;
+  while ((option = getopt(argc, argv, "n:b:w:i:f:dz")) != -1) {
+    switch (option) {
+    case 'n':
+      options.operations = std::max(1ul, std::strtoul(optarg, nullptr, 10));
+      break;
+    case 'b':
+      options.burst = std::max(1ul, std::strtoul(optarg, nullptr, 10));
+      break;
+    case 'w':
+      options.window = std::max(1ul, std::strtoul(optarg, nullptr, 10));
+      break;
+    case 'i':
+      options.idle = std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'f':
+      options.flooders = std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'd':
+      options.arenas = false;
+      break;
+    case 'z':
+      options.check_allocations = true;
+      break;
+    default:
+      std::cerr << "Usage: " << argv[0]
+                << " [-n operations] [-b burst] [-w window] [-i idle]"
+                << " [-f flooders] [-d] [-z] [scenario...]"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::vector<Entry> chosen{};
+  for (int i = optind; i < argc; ++i) {
+    auto it = std::find_if(
+      scenarios.begin(), scenarios.end()
+    , [name = std::string_view{argv[i]}](Entry const &entry) {
+        return entry.name == name;
+      }
+    );
+    if (it == scenarios.end()) {
+      std::cerr << "Unknown scenario " << argv[i] << std::endl;
+      return EXIT_FAILURE;
+    }
+    chosen.push_back(*it);
+  }
+  if (chosen.empty()) chosen.assign(scenarios.begin(), scenarios.end());
+  if (options.check_allocations && !allocations::TRACKED) {
+    std::cerr << "-z needs a build with allocation tracking" << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (options.check_allocations && !options.arenas) {
+    std::cerr << "-z budgets are for connections with arenas" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Logger log{"ProtocolBench"};
+  scene::Hub scene{};
+
+  // The server runs on a thread of its own, as it would in protocol-server
+  asio::io_service asio{};
+  std::optional<asio::io_service::work> work{asio};
+  FrameClock frames{log, asio, scene};
+  Server server{log, asio, scene, surface_globals(frames)};
+  server.use_arenas(options.arenas);
+  asio.post([&] { frames.launch(); });
+  // For the frames scenario. Nothing else draws.
+  scene::Hub::Subscription output = scene.subscribe();
+  std::thread server_thread{[&log, &asio] {
+    log.register_thread(std::this_thread::get_id(), "Server");
+    asio.run();
+  }};
+
+  bool failed = false;
+  if (options.idle > 0 && !check_idle(server, asio, options.idle)) {
+    failed = true;
+  }
+
+  std::cerr << std::left << std::setw(10) << "scenario"
+            << std::right << std::setw(10) << "count"
+            << std::setw(12) << "ops/s"
+            << std::setw(10) << "p50"
+            << std::setw(10) << "p90"
+            << std::setw(10) << "p99"
+            << std::setw(10) << "max";
+  if constexpr (allocations::TRACKED) {
+    std::cerr << std::setw(12) << "allocs/op" << std::setw(12) << "bytes/op";
+  }
+  std::cerr << "  (latencies in us)" << std::endl;
+  std::cerr << std::fixed << std::setprecision(2);
+
+  for (Entry const &entry : chosen) {
+    // A fresh connection each, so that one doesn't pile up objects for the
+    // next
+    harness::Client client{server};
+    Session session{client, bind(client, "wl_compositor"), output};
+    if (session.compositor == 0) {
+      std::cerr << entry.name << ": couldn't bind wl_compositor" << std::endl;
+      failed = true;
+      continue;
+    }
+    // Warm up the allocator and the server's tables
+    for (std::size_t i = 0; i < options.operations / 10; ++i) {
+      entry.run(session, options);
+    }
+    std::size_t count = options.operations;
+    if (entry.bursts) count = std::max<std::size_t>(1, count / options.burst);
+    std::vector<uint64_t> latencies{};
+    latencies.reserve(count);
+    if (options.check_allocations) check_server(asio, true);
+    auto before_allocations = server_allocations(asio);
+    auto start = Clock::now();
+    for (std::size_t i = 0; i < count; ++i) {
+      auto before = Clock::now();
+      if (!entry.run(session, options)) break;
+      latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - before
+      ).count());
+    }
+    auto elapsed = Clock::now() - start;
+    auto allocated = server_allocations(asio) - before_allocations;
+    if (options.check_allocations) check_server(asio, false);
+    if (!client || latencies.empty()) {
+      std::cerr << entry.name << ": the server hung up" << std::endl;
+      failed = true;
+      continue;
+    }
+    report(entry, options, latencies, elapsed, allocated);
+    report_memory(server);
+    std::size_t operations = latencies.size()
+                           * (entry.bursts ? options.burst : 1);
+    // Bar the objects' arena and table growing, as registries are never
+    // destroyed. Allowing for what else happens now and then, rather than
+    // per operation.
+    std::size_t unexpected = allocated.allocations - allocated.grown;
+    if (options.check_allocations && unexpected > operations / 100) {
+      std::cerr << entry.name << ": the server allocated " << unexpected
+                << " times in " << operations
+                << " operations once warmed up" << std::endl;
+      failed = true;
+    }
+  }
+
+  std::cerr << "\n";
+  if (options.flooders > 0 && !check_flood(server, options.flooders)) {
+    failed = true;
+  }
+
+  // The same, as the server saw it, warm-up included
+  latency::print(std::cerr, server.latency().snapshot());
+
+  asio.post([&] {
+    server.stop();
+    frames.stop();
+    work = std::nullopt;
+  });
+  server_thread.join();
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
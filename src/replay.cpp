@@ -0,0 +1,583 @@
+// Plays a capture (see WAYPOSITOR_CAPTURE) back through the protocol server,
+// in this process, over socket pairs. With -t the original timing is kept;
+// otherwise each connection's traffic goes in as fast as the server takes it.
+// Given a fixed capture, the numbers are comparable from build to build.
+// File descriptors aren't captured, only how many came along with the bytes;
+// each goes in as a stand-in memfd. Pools get one of the size they're made
+// with.
+//
+//   ob-replay [-t] [-n runs] capture
+//
+// The server's own log goes to stdout as usual. Results go to stderr.
+
+#include <waypositor/capture.hpp>
+#include <waypositor/latency.hpp>
+#include <waypositor/logger.hpp>
+#include <waypositor/protocol.hpp>
+#include <waypositor/scene.hpp>
+#include <waypositor/surface.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/write.hpp>
+
+namespace waypositor { namespace replay {
+  using Clock = std::chrono::steady_clock;
+
+  // The last id a client may allocate. Captured clients won't have used it
+  // (they'd have needed four billion objects), so it's safe to sync on.
+  constexpr uint32_t FINAL_SYNC = 0xfeffffff;
+
+  // One captured connection, ready to be played back
+  struct Stream {
+    struct Chunk {
+      // Since the start of the capture
+      Clock::duration offset;
+      std::vector<unsigned char> bytes;
+      // wl_display.sync callbacks whose request ends in this chunk
+      std::vector<uint32_t> syncs;
+      // File descriptors that came along with the bytes
+      std::size_t fds;
+    };
+    Clock::duration opened{};
+    std::vector<Chunk> chunks{};
+    std::size_t messages{0};
+    std::size_t fds{0};
+    // In the order the fds are taken, how big each stand-in is. Anything
+    // past the end, e.g. for requests other than wl_shm.create_pool, is
+    // empty.
+    std::vector<std::size_t> sizes{};
+  };
+
+  // The argument words of a request, bounds checked
+  class Arguments final {
+  private:
+    unsigned char const *mData;
+    std::size_t mWords;
+    std::size_t mNext{0};
+  public:
+    Arguments(unsigned char const *data, std::size_t words)
+      : mData{data}, mWords{words}
+    {}
+
+    std::optional<uint32_t> uint() {
+      if (mNext == mWords) return std::nullopt;
+      uint32_t result;
+      std::memcpy(&result, mData + mNext++ * sizeof(uint32_t), sizeof(result));
+      return result;
+    }
+
+    std::optional<std::string_view> string() {
+      auto length = this->uint();
+      if (!length || *length == 0) return std::nullopt;
+      std::size_t words = (*length + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+      if (mWords - mNext < words) return std::nullopt;
+      auto data = reinterpret_cast<char const *>(
+        mData + mNext * sizeof(uint32_t)
+      );
+      mNext += words;
+      // Without the terminator
+      return std::string_view{data, *length - 1};
+    }
+  };
+
+  // Follows the registries and wl_shm objects a client makes, for the sizes
+  // of the pools it makes from them
+  class Pools final {
+  private:
+    std::unordered_set<uint32_t> mRegistries{};
+    std::unordered_set<uint32_t> mShms{};
+  public:
+    void request(
+      uint32_t object, uint16_t opcode, Arguments arguments
+    , std::vector<std::size_t> &sizes
+    ) {
+      if (object == 1 && opcode == 1) { // wl_display.get_registry
+        if (auto id = arguments.uint()) mRegistries.insert(*id);
+      } else if (mRegistries.count(object) && opcode == 0) { // bind
+        arguments.uint();
+        auto interface = arguments.string();
+        arguments.uint();
+        auto id = arguments.uint();
+        if (interface && id && *interface == "wl_shm") mShms.insert(*id);
+      } else if (mShms.count(object) && opcode == 0) { // create_pool
+        // The fd isn't in the body
+        arguments.uint();
+        auto size = arguments.uint();
+        int32_t bytes = size ? static_cast<int32_t>(*size) : 0;
+        sizes.push_back(bytes > 0 ? static_cast<std::size_t>(bytes) : 0);
+      }
+    }
+  };
+
+  // Split a capture into streams, and find the requests in each
+  inline std::vector<Stream> prepare(std::vector<capture::Record> &records) {
+    std::map<std::size_t, Stream> streams{};
+    // Received, and not yet handed to a chunk. They're captured before the
+    // bytes they came with.
+    std::map<std::size_t, std::size_t> fds{};
+    Clock::duration now{};
+    for (capture::Record &record : records) {
+      now += record.delay;
+      Stream &stream = streams[record.connection];
+      switch (record.type) {
+      case capture::Type::OPEN:
+        stream.opened = now;
+        break;
+      case capture::Type::DATA:
+        stream.chunks.push_back(Stream::Chunk{
+          now, std::move(record.bytes), {}
+        , std::exchange(fds[record.connection], 0)
+        });
+        break;
+      case capture::Type::FDS:
+        stream.fds += record.fds;
+        fds[record.connection] += record.fds;
+        break;
+      case capture::Type::CLOSE:
+        break;
+      }
+    }
+
+    for (auto &pair : streams) {
+      Stream &stream = pair.second;
+      // Messages can straddle chunks, so walk the whole stream
+      std::vector<unsigned char> bytes{};
+      std::vector<std::size_t> ends{};
+      for (Stream::Chunk const &chunk : stream.chunks) {
+        bytes.insert(bytes.end(), chunk.bytes.begin(), chunk.bytes.end());
+        ends.push_back(bytes.size());
+      }
+      std::size_t offset = 0;
+      std::size_t chunk = 0;
+      Pools pools{};
+      while (bytes.size() - offset >= 2 * sizeof(uint32_t)) {
+        uint32_t header[2];
+        std::memcpy(header, bytes.data() + offset, sizeof(header));
+        std::size_t size = header[1] >> 16;
+        if (size < sizeof(header) || bytes.size() - offset < size) break;
+        stream.messages++;
+        pools.request(
+          header[0], static_cast<uint16_t>(header[1] & 0xffff)
+        , Arguments{
+            bytes.data() + offset + sizeof(header)
+          , (size - sizeof(header)) / sizeof(uint32_t)
+          }
+        , stream.sizes
+        );
+        offset += size;
+        while (ends[chunk] < offset) chunk++;
+        bool sync = header[0] == 1 && (header[1] & 0xffff) == 0;
+        if (sync && size >= 3 * sizeof(uint32_t)) {
+          uint32_t callback;
+          std::memcpy(
+            &callback, bytes.data() + offset - size + sizeof(header)
+          , sizeof(callback)
+          );
+          stream.chunks[chunk].syncs.push_back(callback);
+        }
+      }
+    }
+
+    std::vector<Stream> result{};
+    for (auto &pair : streams) result.push_back(std::move(pair.second));
+    return result;
+  }
+
+  struct Results {
+    // In nanoseconds
+    std::vector<uint64_t> syncs{};
+    // From a connection's last byte going in to the server catching up
+    std::vector<uint64_t> drains{};
+    std::size_t errors{0};
+  };
+
+  // Plays one stream into its end of a socket pair
+  class Feeder final {
+  private:
+    enum class Task { WROTE, READ, TIMER, WRITABLE };
+    Stream const &mStream;
+    bool mTimed;
+    Clock::time_point mStart;
+    Domain::socket mSocket;
+    asio::steady_timer mTimer;
+    Results &mResults;
+    std::size_t mNext;
+    std::vector<uint32_t> mFinal;
+    std::unordered_map<uint32_t, Clock::time_point> mSyncs;
+    std::optional<Clock::time_point> mDrainStart;
+    std::vector<unsigned char> mInput;
+    std::size_t mFilled;
+    bool mFinished;
+    // Stand-ins made so far, and the ones for the next chunk until it's in
+    std::size_t mMade;
+    std::vector<int> mStandIns;
+
+    class Worker final {
+    private:
+      Feeder *self;
+      Task mTask;
+    public:
+      Worker(Feeder &self_, Task task) : self{&self_}, mTask{task} {}
+      Worker(Worker const &);
+      Worker &operator=(Worker const &);
+      Worker(Worker &&other) noexcept : self{other.self}, mTask{other.mTask} {
+        other.self = nullptr;
+      }
+      Worker &operator=(Worker &&other) {
+        if (this == &other) return *this;
+        self = other.self;
+        mTask = other.mTask;
+        other.self = nullptr;
+        return *this;
+      }
+      ~Worker() = default;
+
+      void operator()(
+        boost::system::error_code const &error = {}, std::size_t size = 0
+      ) {
+        if (self->mFinished) return;
+        if (error) {
+          std::cerr << "Replay: " << error.message() << std::endl;
+          self->mResults.errors++;
+          self->finish();
+          return;
+        }
+        switch (mTask) {
+        case Task::WROTE:
+          self->wrote();
+          return;
+        case Task::READ:
+          self->received(size);
+          return;
+        case Task::TIMER:
+        case Task::WRITABLE:
+          self->write();
+          return;
+        }
+      }
+    };
+
+    void write() {
+      if (mNext == mStream.chunks.size()) {
+        // Everything is in. Time how long the server takes to catch up.
+        uint32_t sync[3] = {1, (3 * sizeof(uint32_t)) << 16, FINAL_SYNC};
+        mFinal.assign(sync, sync + 3);
+        mDrainStart = Clock::now();
+        asio::async_write(
+          mSocket, asio::buffer(mFinal), Worker{*this, Task::WROTE}
+        );
+        return;
+      }
+      auto const &chunk = mStream.chunks[mNext];
+      auto due = mStart + (chunk.offset - mStream.opened);
+      if (mTimed && Clock::now() < due) {
+        mTimer.expires_at(due);
+        mTimer.async_wait(Worker{*this, Task::TIMER});
+        return;
+      }
+      if (chunk.fds > 0) {
+        this->write_with_fds(chunk);
+        return;
+      }
+      asio::async_write(
+        mSocket, asio::buffer(chunk.bytes), Worker{*this, Task::WROTE}
+      );
+    }
+
+    // -1 if it can't be made
+    int stand_in() {
+      std::size_t size = 0;
+      if (mMade < mStream.sizes.size()) size = mStream.sizes[mMade];
+      mMade++;
+      int fd = ::memfd_create("ob-replay", MFD_CLOEXEC);
+      if (fd < 0) return -1;
+      if (::ftruncate(fd, static_cast<off_t>(size)) < 0) {
+        ::close(fd);
+        return -1;
+      }
+      return fd;
+    }
+
+    // The fds go along with the first of the chunk's bytes, as they would
+    // have from the client
+    void write_with_fds(Stream::Chunk const &chunk) {
+      while (mStandIns.size() < chunk.fds) {
+        int fd = this->stand_in();
+        if (fd < 0) {
+          std::cerr << "Replay: can't make a stand-in fd: "
+                    << std::strerror(errno) << std::endl;
+          mResults.errors++;
+          this->finish();
+          return;
+        }
+        mStandIns.push_back(fd);
+      }
+      std::vector<char> control(CMSG_SPACE(mStandIns.size() * sizeof(int)));
+      iovec iov{
+        const_cast<unsigned char *>(chunk.bytes.data()), chunk.bytes.size()
+      };
+      msghdr message{};
+      message.msg_iov = &iov;
+      message.msg_iovlen = 1;
+      message.msg_control = control.data();
+      message.msg_controllen = control.size();
+      cmsghdr *header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(mStandIns.size() * sizeof(int));
+      std::memcpy(
+        CMSG_DATA(header), mStandIns.data(), mStandIns.size() * sizeof(int)
+      );
+      ssize_t sent = ::sendmsg(
+        mSocket.native_handle(), &message, MSG_DONTWAIT | MSG_NOSIGNAL
+      );
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        mSocket.async_wait(
+          Domain::socket::wait_write, Worker{*this, Task::WRITABLE}
+        );
+        return;
+      }
+      int error = errno;
+      // The server has its own copies now
+      for (int fd : mStandIns) ::close(fd);
+      mStandIns.clear();
+      if (sent < 0) {
+        std::cerr << "Replay: " << std::strerror(error) << std::endl;
+        mResults.errors++;
+        this->finish();
+        return;
+      }
+      asio::async_write(
+        mSocket, asio::buffer(chunk.bytes) + static_cast<std::size_t>(sent)
+      , Worker{*this, Task::WROTE}
+      );
+    }
+
+    void wrote() {
+      if (mNext == mStream.chunks.size()) return;
+      auto now = Clock::now();
+      for (uint32_t callback : mStream.chunks[mNext].syncs) {
+        mSyncs.insert_or_assign(callback, now);
+      }
+      mNext++;
+      this->write();
+    }
+
+    void read() {
+      mSocket.async_read_some(
+        asio::buffer(mInput.data() + mFilled, mInput.size() - mFilled)
+      , Worker{*this, Task::READ}
+      );
+    }
+
+    void received(std::size_t size) {
+      auto now = Clock::now();
+      mFilled += size;
+      std::size_t offset = 0;
+      while (mFilled - offset >= 2 * sizeof(uint32_t)) {
+        uint32_t header[2];
+        std::memcpy(header, mInput.data() + offset, sizeof(header));
+        std::size_t message_size = header[1] >> 16;
+        if (message_size < sizeof(header)) {
+          mResults.errors++;
+          this->finish();
+          return;
+        }
+        if (mFilled - offset < message_size) break;
+        offset += message_size;
+        // Only wl_callback.done matters
+        if ((header[1] & 0xffff) != 0) continue;
+        if (header[0] == FINAL_SYNC && mDrainStart) {
+          mResults.drains.push_back(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+              now - *mDrainStart
+            ).count()
+          ));
+          this->finish();
+          return;
+        }
+        auto it = mSyncs.find(header[0]);
+        if (it == mSyncs.end()) continue;
+        mResults.syncs.push_back(static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now - it->second
+          ).count()
+        ));
+        mSyncs.erase(it);
+      }
+      std::memmove(mInput.data(), mInput.data() + offset, mFilled - offset);
+      mFilled -= offset;
+      this->read();
+    }
+
+    void finish() {
+      mFinished = true;
+      boost::system::error_code error;
+      mTimer.cancel(error);
+      mSocket.close(error);
+    }
+
+  public:
+    Feeder(
+      Stream const &stream, bool timed, Clock::time_point start
+    , Domain::socket socket, Results &results
+    ) : mStream{stream}, mTimed{timed}, mStart{start}
+      , mSocket{std::move(socket)}, mTimer{mSocket.get_executor()}
+      , mResults{results}, mNext{0}, mFinal{}, mSyncs{}
+      , mDrainStart{std::nullopt}, mInput(64 * 1024), mFilled{0}
+      , mFinished{false}, mMade{0}, mStandIns{}
+    {}
+    Feeder(Feeder const &) = delete;
+    Feeder &operator=(Feeder const &) = delete;
+    ~Feeder() {
+      for (int fd : mStandIns) ::close(fd);
+    }
+
+    void launch() {
+      this->read();
+      this->write();
+    }
+  };
+
+  inline void report(
+    Results &results, std::vector<Stream> const &streams
+  , Clock::duration elapsed
+  ) {
+    using Seconds = std::chrono::duration<double>;
+    double seconds = Seconds{elapsed}.count();
+    std::size_t messages = 0;
+    std::size_t fds = 0;
+    for (Stream const &stream : streams) {
+      messages += stream.messages;
+      fds += stream.fds;
+    }
+    std::cerr << streams.size() << " connections, " << messages
+              << " requests in " << seconds * 1000 << "ms: "
+              << messages / seconds << " requests/s" << std::endl;
+    if (fds > 0) {
+      std::cerr << fds << " file descriptors in the capture were stood in for"
+                << std::endl;
+    }
+    auto summary = [](char const *name, std::vector<uint64_t> &latencies) {
+      if (latencies.empty()) return;
+      std::sort(latencies.begin(), latencies.end());
+      auto at = [&latencies](double p) {
+        auto index = static_cast<std::size_t>(
+          p * (latencies.size() - 1) + 0.5
+        );
+        return latencies[index] / 1000.0;
+      };
+      std::cerr << name << ": " << latencies.size() << " samples, p50 "
+                << at(0.5) << "us, p90 " << at(0.9) << "us, p99 "
+                << at(0.99) << "us, max " << latencies.back() / 1000.0
+                << "us" << std::endl;
+    };
+    summary("sync", results.syncs);
+    summary("drain", results.drains);
+    if (results.errors > 0) {
+      std::cerr << results.errors << " connections failed" << std::endl;
+    }
+  }
+}}
+
+int main(int argc, char **argv) {
+  using namespace waypositor;
+  using namespace waypositor::replay;
+
+  bool timed = false;
+  std::size_t runs = 1;
+  int option = 0;
+  while ((option = getopt(argc, argv, "tn:")) != -1) {
+    switch (option) {
+    case 't':
+      timed = true;
+      break;
+    case 'n':
+      runs = std::max(1ul, std::strtoul(optarg, nullptr, 10));
+      break;
+    default:
+      std::cerr << "Usage: " << argv[0] << " [-t] [-n runs] capture"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc) {
+    std::cerr << "Usage: " << argv[0] << " [-t] [-n runs] capture"
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::ifstream file{argv[optind], std::ios::binary};
+  auto records = capture::read(file);
+  if (!records) {
+    std::cerr << "Couldn't read capture " << argv[optind] << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::vector<Stream> const streams = prepare(*records);
+
+  Logger log{"Replay"};
+  scene::Hub scene{};
+
+  // The server runs on a thread of its own, as it would in protocol-server
+  asio::io_service server{};
+  std::optional<asio::io_service::work> work{server};
+  FrameClock frames{log, server, scene};
+  // Without a rate limit, as captures go in faster than any client would
+  // send them
+  Server protocol{log, server, scene, surface_globals(frames)};
+  server.post([&] { frames.launch(); });
+  std::thread server_thread{[&log, &server] {
+    log.register_thread(std::this_thread::get_id(), "Server");
+    server.run();
+  }};
+
+  bool failed = false;
+  for (std::size_t run = 0; run < runs; ++run) {
+    asio::io_service client{};
+    Results results{};
+    auto start = Clock::now();
+    std::vector<std::unique_ptr<Feeder>> feeders{};
+    for (Stream const &stream : streams) {
+      feeders.push_back(std::make_unique<Feeder>(
+        stream, timed, start, protocol.connect(client), results
+      ));
+      feeders.back()->launch();
+    }
+    client.run();
+    report(results, streams, Clock::now() - start);
+    failed = failed || results.errors > 0;
+  }
+  std::cerr << "\n";
+  latency::print(std::cerr, protocol.latency().snapshot());
+
+  server.post([&] {
+    protocol.stop();
+    frames.stop();
+    work = std::nullopt;
+  });
+  server_thread.join();
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}